@@ -0,0 +1,619 @@
+/*************************************************************************
+** CS372 Intro to Networks
+** Winter 2019
+**
+** Project 1 - Load Tester (chatbench)
+** David Mednikov
+**
+** Measures how a chat server (chatroom) holds up under load. chatbench
+** opens many simulated chat sessions, spread over a few threads that each
+** run their own epoll loop, and puts every group of sessions in its own
+** room. Each session sends messages of a set size at a set rate for a set
+** amount of time.
+**
+** Every message carries the time it was sent, so when another session in
+** the room receives it the end-to-end delivery latency is recorded in a
+** histogram. When the run is over, chatbench prints how many messages
+** were sent and delivered per second, and the latency percentiles.
+**
+** chatbench and the server have to run on the same host, since latency is
+** measured with one clock.
+*************************************************************************/
+
+// import modules
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "chatframe.h"
+
+// max # of epoll events handled per loop
+#define MAX_EVENTS 256
+
+// bytes of messages a session can have waiting to be sent. messages that
+// don't fit are skipped (and counted) instead of piling up
+#define OUTBOX_SIZE 8192
+
+// latency histogram: values under SUB_BUCKETS get their own bucket, after
+// that each power of 2 is split into SUB_BUCKETS buckets (about 6% wide)
+#define SUB_BUCKETS 16
+#define SUB_BUCKET_BITS 4
+#define HISTOGRAM_BUCKETS (64 * SUB_BUCKETS)
+
+// how long to keep reading after the last message is sent
+#define DRAIN_SECONDS 1
+
+// longest message text a session sends (leaves room for the server's sequence # and timestamp)
+#define MAX_MESSAGE_SIZE (FRAME_MAX_PAYLOAD - EVENT_HEADER_SIZE)
+
+
+// settings for a run
+typedef struct benchConfig {
+    char* host;
+    char* port;
+    int sessions, threads, groupSize, size, seconds;
+    double rate;
+} benchConfig;
+
+// counts of latencies (in microseconds) in log-linear buckets
+typedef struct latencyHistogram {
+    uint64_t counts[HISTOGRAM_BUCKETS];
+    uint64_t total, max;
+} latencyHistogram;
+
+// one simulated chat session
+typedef struct session {
+    int fd, id;
+    frameRing inbox;
+    char outbox[OUTBOX_SIZE];
+    size_t outboxLength;
+
+    // when the next message is due (ns) and if epoll is watching for writability
+    uint64_t nextSend;
+    int watchingWrites;
+} session;
+
+// a thread and the sessions it runs
+typedef struct benchThread {
+    pthread_t thread;
+    benchConfig* config;
+    session* sessions;
+    int firstSession, sessionCount, epollFd;
+
+    // results
+    uint64_t sent, delivered, skipped, disconnected, failed;
+    latencyHistogram latency;
+} benchThread;
+
+// server address, and barrier so every thread starts sending at the same time
+struct addrinfo* serverInfo;
+pthread_barrier_t startBarrier;
+
+
+/*************************************************************************
+* function nowNanos
+* Gets the current time from the monotonic clock
+* Returns:
+*   uint64_t time in nanoseconds
+* Pre-conditions: None
+* Post-conditions: None
+*************************************************************************/
+uint64_t nowNanos() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+
+/*************************************************************************
+* function bucketFor
+* Finds the histogram bucket a value falls in
+* Params:
+*   uint64_t value (latency in microseconds)
+* Returns:
+*   int bucket index
+* Pre-conditions: None
+* Post-conditions: None
+*************************************************************************/
+int bucketFor(uint64_t value) {
+    // small values get exact buckets
+    if (value < SUB_BUCKETS) {
+        return (int) value;
+    }
+
+    // otherwise find the power of 2, then which slice of it the value is in
+    int magnitude = 63 - __builtin_clzll(value);
+    int shift = magnitude - SUB_BUCKET_BITS;
+    return (magnitude - SUB_BUCKET_BITS + 1) * SUB_BUCKETS + (int) ((value >> shift) - SUB_BUCKETS);
+}
+
+
+/*************************************************************************
+* function bucketTop
+* Gets the largest value that falls in a histogram bucket
+* Params:
+*   int bucket (bucket index)
+* Returns:
+*   uint64_t top of the bucket in microseconds
+* Pre-conditions: None
+* Post-conditions: None
+*************************************************************************/
+uint64_t bucketTop(int bucket) {
+    if (bucket < SUB_BUCKETS) {
+        return bucket;
+    }
+    int shift = bucket / SUB_BUCKETS - 1;
+    uint64_t bottom = (uint64_t) (SUB_BUCKETS + bucket % SUB_BUCKETS) << shift;
+    return bottom + ((uint64_t) 1 << shift) - 1;
+}
+
+
+/*************************************************************************
+* function recordLatency
+* Adds a latency to a histogram
+* Params:
+*   latencyHistogram* histogram (histogram to add to)
+*   uint64_t value (latency in microseconds)
+* Pre-conditions: None
+* Post-conditions: Value counted
+*************************************************************************/
+void recordLatency(latencyHistogram* histogram, uint64_t value) {
+    histogram->counts[bucketFor(value)]++;
+    histogram->total++;
+    if (value > histogram->max) {
+        histogram->max = value;
+    }
+}
+
+
+/*************************************************************************
+* function percentile
+* Finds the latency that a given fraction of the recorded values are at
+* or under
+* Params:
+*   latencyHistogram* histogram (histogram to read)
+*   double fraction (e.g. 0.99 for the 99th percentile)
+* Returns:
+*   uint64_t latency in microseconds (top of the bucket it falls in)
+* Pre-conditions: None
+* Post-conditions: None
+*************************************************************************/
+uint64_t percentile(latencyHistogram* histogram, double fraction) {
+    // count up through the buckets until enough values are covered
+    uint64_t wanted = (uint64_t) (fraction * histogram->total + 0.5);
+    uint64_t seen = 0;
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        seen += histogram->counts[i];
+        if (seen >= wanted && seen > 0) {
+            uint64_t top = bucketTop(i);
+            return top < histogram->max ? top : histogram->max;
+        }
+    }
+    return histogram->max;
+}
+
+
+/*************************************************************************
+* function raiseFileLimit
+* Raises the open file limit to the max allowed, since each session needs
+* its own socket
+* Pre-conditions: None
+* Post-conditions: Soft file limit equals hard file limit
+*************************************************************************/
+void raiseFileLimit() {
+    struct rlimit limit;
+    getrlimit(RLIMIT_NOFILE, &limit);
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+}
+
+
+/*************************************************************************
+* function queueFrame
+* Appends a text frame to a session's outbox
+* Params:
+*   session* current (session to send from)
+*   const char* text (frame payload)
+*   size_t length (# of bytes in text)
+* Returns:
+*   1 if queued, 0 if the outbox is too full
+* Pre-conditions: None
+* Post-conditions: Frame waiting in outbox for flushSession
+*************************************************************************/
+int queueFrame(session* current, const char* text, size_t length) {
+    if (current->outboxLength + FRAME_HEADER_SIZE + length > OUTBOX_SIZE) {
+        return 0;
+    }
+    current->outboxLength += buildFrame(&current->outbox[current->outboxLength], FRAME_TEXT, text, length);
+    return 1;
+}
+
+
+/*************************************************************************
+* function flushSession
+* Sends as much of a session's outbox as the socket will take, and
+* watches for writability if some is left
+* Params:
+*   benchThread* worker (thread holding the epoll fd)
+*   session* current (session to send from)
+* Returns:
+*   1 if the connection is fine, 0 if it failed
+* Pre-conditions: Socket is non-blocking
+* Post-conditions: Sent bytes removed from the front of the outbox
+*************************************************************************/
+int flushSession(benchThread* worker, session* current) {
+    // send everything queued in one call
+    if (current->outboxLength > 0) {
+        ssize_t written = send(current->fd, current->outbox, current->outboxLength, 0);
+        if (written < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            return 0;
+        }
+
+        // move anything that didn't fit to the front of the outbox
+        if (written > 0) {
+            memmove(current->outbox, &current->outbox[written], current->outboxLength - written);
+            current->outboxLength -= written;
+        }
+    }
+
+    // only ask epoll about writability while there is something left to write
+    int wantWrites = current->outboxLength > 0;
+    if (wantWrites != current->watchingWrites) {
+        struct epoll_event event;
+        event.events = EPOLLIN | (wantWrites ? EPOLLOUT : 0);
+        event.data.ptr = current;
+        epoll_ctl(worker->epollFd, EPOLL_CTL_MOD, current->fd, &event);
+        current->watchingWrites = wantWrites;
+    }
+    return 1;
+}
+
+
+/*************************************************************************
+* function closeSession
+* Closes a session the server hung up on (or that failed)
+* Params:
+*   benchThread* worker (thread running the session)
+*   session* current (session to close)
+* Pre-conditions: Session is connected
+* Post-conditions: Socket closed, session counted as disconnected
+*************************************************************************/
+void closeSession(benchThread* worker, session* current) {
+    close(current->fd);
+    current->fd = -1;
+    worker->disconnected++;
+}
+
+
+/*************************************************************************
+* function sendTimedMessage
+* Queues a message carrying the current time and padded to the message
+* size, then sends it
+* Params:
+*   benchThread* worker (thread running the session)
+*   session* current (session to send from)
+*   uint64_t now (current time in ns)
+* Pre-conditions: Session is connected
+* Post-conditions: Message sent or queued, or counted as skipped
+*************************************************************************/
+void sendTimedMessage(benchThread* worker, session* current, uint64_t now) {
+    char text[MAX_MESSAGE_SIZE + 1];
+
+    // "username> T<send time> xxxx..." padded out to the message size
+    int length = snprintf(text, sizeof text, "b%d> T%llu ", current->id, (unsigned long long) now);
+    while (length < worker->config->size) {
+        text[length++] = 'x';
+    }
+
+    // skip the message if the session is too far behind to take it
+    if (!queueFrame(current, text, length)) {
+        worker->skipped++;
+        return;
+    }
+    worker->sent++;
+    if (!flushSession(worker, current)) {
+        closeSession(worker, current);
+    }
+}
+
+
+/*************************************************************************
+* function readSession
+* Reads everything waiting on a session's socket and records the latency
+* of every benchmark message in it
+* Params:
+*   benchThread* worker (thread running the session)
+*   session* current (session with data waiting)
+* Pre-conditions: epoll reported the socket as readable
+* Post-conditions: Messages counted, or session closed if the server hung up
+*************************************************************************/
+void readSession(benchThread* worker, session* current) {
+    char payload[FRAME_MAX_PAYLOAD + 1];
+    size_t length;
+    int type;
+
+    while (1) {
+        // read until the socket is empty
+        ssize_t bytesRead = ringFill(&current->inbox, current->fd);
+        if (bytesRead < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+            return;
+        }
+        if (bytesRead <= 0) {
+            closeSession(worker, current);
+            return;
+        }
+
+        // handle each complete frame. only chat messages (not notices) are counted
+        uint64_t now = nowNanos();
+        int result;
+        while ((result = ringNextFrame(&current->inbox, &type, payload, &length)) == 1) {
+            if (type != FRAME_EVENT || length < EVENT_HEADER_SIZE) {
+                continue;
+            }
+
+            // find the send time after "username> T"
+            char* stamp = strstr(&payload[EVENT_HEADER_SIZE], "> T");
+            if (stamp == NULL) {
+                continue;
+            }
+            uint64_t sentAt = strtoull(stamp + 3, NULL, 10);
+            worker->delivered++;
+            recordLatency(&worker->latency, now > sentAt ? (now - sentAt) / 1000 : 0);
+        }
+
+        // frame too big, not a chat server we understand
+        if (result < 0) {
+            closeSession(worker, current);
+            return;
+        }
+    }
+}
+
+
+/*************************************************************************
+* function connectSession
+* Connects a session to the server and sends it to its group's room
+* Params:
+*   benchThread* worker (thread running the session)
+*   session* current (session to connect, with its id set)
+* Returns:
+*   1 if connected, 0 if not
+* Pre-conditions: serverInfo set
+* Post-conditions: Session registered with the thread's epoll
+*************************************************************************/
+int connectSession(benchThread* worker, session* current) {
+    char text[64];
+    int yes = 1;
+
+    // connect (blocking, it's before the clock starts)
+    current->fd = socket(serverInfo->ai_family, serverInfo->ai_socktype, 0);
+    if (current->fd < 0 || connect(current->fd, serverInfo->ai_addr, serverInfo->ai_addrlen) != 0) {
+        if (current->fd >= 0) close(current->fd);
+        current->fd = -1;
+        return 0;
+    }
+
+    // send small messages right away, like chatclient would
+    setsockopt(current->fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof yes);
+    fcntl(current->fd, F_SETFL, fcntl(current->fd, F_GETFL) | O_NONBLOCK);
+
+    // watch for messages from the server
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = current;
+    epoll_ctl(worker->epollFd, EPOLL_CTL_ADD, current->fd, &event);
+
+    // join this session's group room
+    int length = snprintf(text, sizeof text, "b%d> \\join bench%d", current->id, current->id / worker->config->groupSize);
+    queueFrame(current, text, length);
+    return flushSession(worker, current);
+}
+
+
+/*************************************************************************
+* function runThread
+* Connects a thread's sessions, waits for every other thread to be ready,
+* then sends messages on schedule and reads replies until the run is over
+* Params:
+*   void* arg (benchThread* for this thread)
+* Returns:
+*   NULL
+* Pre-conditions: Thread's config and session range set
+* Post-conditions: Thread's results filled in, sessions closed
+*************************************************************************/
+void* runThread(void* arg) {
+    benchThread* worker = arg;
+    benchConfig* config = worker->config;
+    struct epoll_event events[MAX_EVENTS];
+
+    // connect sessions
+    worker->epollFd = epoll_create1(0);
+    worker->sessions = calloc(worker->sessionCount, sizeof(session));
+    for (int i = 0; i < worker->sessionCount; i++) {
+        worker->sessions[i].id = worker->firstSession + i;
+        if (!connectSession(worker, &worker->sessions[i])) {
+            worker->failed++;
+        }
+    }
+
+    // start sending once every thread is connected. each session's first message is
+    // staggered over one interval so they don't all go at once
+    pthread_barrier_wait(&startBarrier);
+    uint64_t interval = (uint64_t) (1e9 / config->rate);
+    uint64_t start = nowNanos() + 500000000ULL;
+    uint64_t end = start + (uint64_t) config->seconds * 1000000000ULL;
+    uint64_t drainEnd = end + DRAIN_SECONDS * 1000000000ULL;
+    for (int i = 0; i < worker->sessionCount; i++) {
+        worker->sessions[i].nextSend = start + interval * (uint64_t) worker->sessions[i].id / config->sessions;
+    }
+
+    uint64_t now = nowNanos();
+    uint64_t nextDue = start;
+    while (now < drainEnd) {
+        // sleep until the next message is due (or the run ends)
+        uint64_t wakeAt = now < end && nextDue < drainEnd ? nextDue : drainEnd;
+        int timeout = wakeAt > now ? (int) ((wakeAt - now + 999999) / 1000000) : 0;
+        int ready = epoll_wait(worker->epollFd, events, MAX_EVENTS, timeout);
+
+        // handle sockets that are ready
+        for (int i = 0; i < ready; i++) {
+            session* current = events[i].data.ptr;
+            if (current->fd >= 0 && (events[i].events & EPOLLOUT) && !flushSession(worker, current)) {
+                closeSession(worker, current);
+            }
+            if (current->fd >= 0 && (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+                readSession(worker, current);
+            }
+        }
+
+        // send every message that is due, and find when the next one is
+        now = nowNanos();
+        if (now >= nextDue && now < end) {
+            nextDue = drainEnd;
+            for (int i = 0; i < worker->sessionCount; i++) {
+                session* current = &worker->sessions[i];
+                if (current->fd < 0) {
+                    continue;
+                }
+                if (current->nextSend <= now) {
+                    sendTimedMessage(worker, current, now);
+                    current->nextSend += interval;
+                }
+                if (current->nextSend < nextDue) {
+                    nextDue = current->nextSend;
+                }
+            }
+        }
+    }
+
+    // done, close everything
+    for (int i = 0; i < worker->sessionCount; i++) {
+        if (worker->sessions[i].fd >= 0) {
+            close(worker->sessions[i].fd);
+        }
+    }
+    close(worker->epollFd);
+    free(worker->sessions);
+    return NULL;
+}
+
+
+/*************************************************************************
+* function printUsage
+* Shows the correct usage and exits
+*************************************************************************/
+void printUsage() {
+    printf("USAGE: chatbench [-c SESSIONS] [-t THREADS] [-g ROOM_SIZE] [-r MSGS_PER_SEC] [-s MSG_BYTES] [-d SECONDS] <host> <port>\n");
+    exit(1);
+}
+
+
+/*************************************************************************
+* main method
+* Reads the settings, starts the threads, waits for the run to finish, and
+* prints the combined results
+*************************************************************************/
+int main(int argc, char* argv[]) {
+    benchConfig config = { NULL, NULL, 1000, 4, 10, 100, 10, 1.0 };
+    int option;
+
+    // read options
+    while ((option = getopt(argc, argv, "c:t:g:r:s:d:")) != -1) {
+        switch (option) {
+            case 'c': config.sessions = atoi(optarg); break;
+            case 't': config.threads = atoi(optarg); break;
+            case 'g': config.groupSize = atoi(optarg); break;
+            case 'r': config.rate = atof(optarg); break;
+            case 's': config.size = atoi(optarg); break;
+            case 'd': config.seconds = atoi(optarg); break;
+            default: printUsage();
+        }
+    }
+    if (argc - optind != 2 || config.sessions < 1 || config.threads < 1 || config.groupSize < 2 || config.rate <= 0 || config.seconds < 1) {
+        printUsage();
+    }
+    config.host = argv[optind];
+    config.port = argv[optind + 1];
+
+    // messages need room for the username and send time
+    if (config.size > MAX_MESSAGE_SIZE) {
+        config.size = MAX_MESSAGE_SIZE;
+    }
+    if (config.threads > config.sessions) {
+        config.threads = config.sessions;
+    }
+
+    // look up the server once for every session
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(config.host, config.port, &hints, &serverInfo) != 0) {
+        fprintf(stderr, "chatbench: ERROR looking up %s\n", config.host);
+        exit(1);
+    }
+    raiseFileLimit();
+
+    // print update to terminal
+    printf("chatbench: %d sessions on %d threads, rooms of %d, %.2f msgs/sec each, %d byte messages, %d sec\n",
+        config.sessions, config.threads, config.groupSize, config.rate, config.size, config.seconds);
+    fflush(stdout);
+
+    // split sessions evenly between threads and start them
+    benchThread* workers = calloc(config.threads, sizeof(benchThread));
+    pthread_barrier_init(&startBarrier, NULL, config.threads);
+    for (int i = 0; i < config.threads; i++) {
+        workers[i].config = &config;
+        workers[i].firstSession = (int) ((long) config.sessions * i / config.threads);
+        workers[i].sessionCount = (int) ((long) config.sessions * (i + 1) / config.threads) - workers[i].firstSession;
+        pthread_create(&workers[i].thread, NULL, runThread, &workers[i]);
+    }
+
+    // wait for them, adding up their results
+    benchThread total;
+    memset(&total, 0, sizeof(total));
+    for (int i = 0; i < config.threads; i++) {
+        pthread_join(workers[i].thread, NULL);
+        total.sent += workers[i].sent;
+        total.delivered += workers[i].delivered;
+        total.skipped += workers[i].skipped;
+        total.disconnected += workers[i].disconnected;
+        total.failed += workers[i].failed;
+        for (int j = 0; j < HISTOGRAM_BUCKETS; j++) {
+            total.latency.counts[j] += workers[i].latency.counts[j];
+        }
+        total.latency.total += workers[i].latency.total;
+        if (workers[i].latency.max > total.latency.max) {
+            total.latency.max = workers[i].latency.max;
+        }
+    }
+
+    // print results
+    printf("sent:         %llu (%.1f msgs/sec)\n", (unsigned long long) total.sent, (double) total.sent / config.seconds);
+    printf("delivered:    %llu (%.1f msgs/sec)\n", (unsigned long long) total.delivered, (double) total.delivered / config.seconds);
+    printf("skipped:      %llu (session outbox full)\n", (unsigned long long) total.skipped);
+    printf("failed:       %llu connects, %llu disconnected by server\n", (unsigned long long) total.failed, (unsigned long long) total.disconnected);
+    if (total.latency.total > 0) {
+        printf("latency (us): p50 %llu  p90 %llu  p99 %llu  p99.9 %llu  max %llu\n",
+            (unsigned long long) percentile(&total.latency, 0.50), (unsigned long long) percentile(&total.latency, 0.90),
+            (unsigned long long) percentile(&total.latency, 0.99), (unsigned long long) percentile(&total.latency, 0.999),
+            (unsigned long long) total.latency.max);
+    }
+
+    freeaddrinfo(serverInfo);
+    free(workers);
+    return 0;
+}
@@ -11,9 +11,17 @@
 ** command line argument. The client attempts to connect to a server
 ** at the host and port specified via command line arguments. After
 ** asking the user for their username, the client sends a message to
-** the server. The two hosts message back and forth until one of them
-** kills the connection. After killing the connection, the client should
-** stop running, but the server should go back to listenting on the port.
+** the server. Both hosts can send messages at any time (the client polls
+** the keyboard and the socket together) until one of them kills the
+** connection. After killing the connection, the client should stop
+** running, but the server should go back to listenting on the port.
+**
+** If the connection drops without the server saying '\quit', the client
+** reconnects on its own, waiting a little longer after each failed try.
+** It keeps the session token the server gave it and the sequence # of
+** the last message it has, so the server can put it back in its room and
+** send it whatever it missed. Anything typed meanwhile is sent once the
+** connection is back.
 **
 ** This program is the client.
 *************************************************************************/
@@ -21,6 +29,8 @@
 // import modules
 #include <arpa/inet.h>
 #include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <netdb.h>
 #include <netinet/in.h>
 #include <poll.h>
@@ -29,8 +39,44 @@
 #include <string.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "chatframe.h"
+
+// longest message the user can send, and max bytes read from stdin at once
+#define MESSAGE_SIZE 500
+#define INPUT_SIZE 4096
+
+// size of the outbox, and room that must be free in it before reading more input
+// (a full read can be up to INPUT_SIZE one-char lines, each with a frame header and username added)
+#define OUTBOX_SIZE 131072
+#define OUTBOX_RESERVE (INPUT_SIZE * 24)
+
+// reconnecting: first try right away, then wait RETRY_BASE_MS, doubling each time up
+// to RETRY_MAX_MS, and give up after MAX_RETRIES tries in a row
+#define RETRY_BASE_MS 100
+#define RETRY_MAX_MS 5000
+#define MAX_RETRIES 12
+
+// the connection to the server, and what's needed to pick up where it left off after reconnecting
+typedef struct chatSession {
+    // server address (looked up once), socket (-1 while waiting to retry), and 1 while a connect is in progress
+    struct addrinfo* serverInfo;
+    int socketStream, connecting;
+
+    // # of reconnect tries in a row, and when to try next (ms)
+    int retries;
+    long long retryAt;
+
+    // session token from the server, room we're in, and newest sequence # we have in it
+    char token[TOKEN_SIZE];
+    char room[32];
+    uint64_t lastSequence;
+
+    // bytes already sent of the frame at the front of the outbox (it stays there until it's all sent)
+    size_t frontSent;
+} chatSession;
 
 /*************************************************************************
 * function openSocket
@@ -147,160 +193,416 @@ char* getName() {
 
 
 /*************************************************************************
-* function flushStdin
-* Flushes any buffered data from stdin. This fixes a bug caused by the
-* client sending messages out-of-turn.
+* function showPrompt
+* Prints the "username> " prompt if a person is typing at a terminal.
+* Scripted input (a pipe or file) doesn't get prompts.
+* Params:
+*   char* username (for displaying the prompt)
 * Pre-conditions: None
-* Post-conditions: stdin will be emptied
+* Post-conditions: Prompt shown and stdout flushed
 *************************************************************************/
-void flushStdin() {
-    /*
-        This code adapted from https://pubs.opengroup.org/onlinepubs/009695399/functions/poll.html
-    */
+void showPrompt(char* username) {
+    if (isatty(0)) {
+        printf("%s> ", username);
+    }
+    fflush(stdout);
+}
 
-    // set up struct data for poll() function
-    struct pollfd fds[1];
 
-    // poll stdin (represented by 0)
-    fds[0].fd = 0;
-    // poll any data (represented by POLLRDNORM)
-    fds[0].events = POLLRDNORM;
+/*************************************************************************
+* function queueMessage
+* Appends "username> message" to the outbox as a frame. Frames queued
+* together go out in a single send.
+* Params:
+*   char* message (text typed by the user)
+*   char* username (for appending to the message before sending)
+*   char* outbox (buffer of bytes waiting to be sent)
+*   size_t* outboxLength (# of bytes in outbox, updated)
+* Pre-conditions: outbox has room for the message (OUTBOX_SIZE - MESSAGE_SIZE free)
+* Post-conditions: Message waiting in outbox for flushMessages
+*************************************************************************/
+void queueMessage(char* message, char* username, char* outbox, size_t* outboxLength) {
+    char payload[FRAME_MAX_PAYLOAD + 1];
+
+    // set payload to username + message and append it to the outbox as a frame
+    int length = snprintf(payload, sizeof payload, "%s> %s", username, message);
+    *outboxLength += buildFrame(&outbox[*outboxLength], FRAME_TEXT, payload, length);
+}
 
-    // poll stdin and store to result
-    int result = poll(fds, 1, 0);
 
-    // if result not 0, data needs to be flushed from stdin
-    while(result != 0) {
-        // create temporary variable to flush stdin into
-        char trash[1000];
+/*************************************************************************
+* function queueHistoryRequest
+* Appends a FRAME_HISTORY frame to the outbox, asking the server for every
+* message in the room after a sequence #
+* Params:
+*   const char* request (text after "\history", the sequence #, or empty for all history)
+*   char* outbox (buffer of bytes waiting to be sent)
+*   size_t* outboxLength (# of bytes in outbox, updated)
+* Pre-conditions: outbox has room for the frame
+* Post-conditions: Request waiting in outbox for flushMessages
+*************************************************************************/
+void queueHistoryRequest(const char* request, char* outbox, size_t* outboxLength) {
+    char payload[8];
 
-        // get data from stdin and store to trash
-        fgets(trash, 1000, stdin);
+    // sequence # defaults to 0, which means the whole history
+    putNumber(payload, strtoull(request, NULL, 10));
+    *outboxLength += buildFrame(&outbox[*outboxLength], FRAME_HISTORY, payload, sizeof payload);
+}
 
-        // poll new result to see if more data needs to be cleared
-        result = poll(fds, 1, 0);
-    }
+
+/*************************************************************************
+* function queueHello
+* Puts a FRAME_HELLO at the front of the outbox, so it is the first thing
+* the server gets on a new connection. A frame that was part way sent on
+* the old connection is sent again in full after the hello.
+* Params:
+*   chatSession* session (token, room, and last sequence # to send)
+*   char* username (sent so the server knows who we are right away)
+*   char* outbox (buffer of bytes waiting to be sent)
+*   size_t* outboxLength (# of bytes in outbox, updated)
+* Pre-conditions: Connection was just made, outbox has room for the hello
+* Post-conditions: Hello at the front of the outbox
+*************************************************************************/
+void queueHello(chatSession* session, char* username, char* outbox, size_t* outboxLength) {
+    char payload[TOKEN_SIZE + 8 + 64];
+    char frame[FRAME_HEADER_SIZE + sizeof payload];
+
+    // the server threw away the part of the front frame it got, so send all of it again
+    session->frontSent = 0;
+
+    // token, last sequence #, then "username room"
+    memcpy(payload, session->token, TOKEN_SIZE);
+    putNumber(&payload[TOKEN_SIZE], session->lastSequence);
+    int textLength = snprintf(&payload[TOKEN_SIZE + 8], 64, "%s%s%s", username, session->room[0] ? " " : "", session->room);
+    size_t frameLength = buildFrame(frame, FRAME_HELLO, payload, TOKEN_SIZE + 8 + textLength);
+
+    // move queued messages back to make room at the front
+    memmove(&outbox[frameLength], outbox, *outboxLength);
+    memcpy(outbox, frame, frameLength);
+    *outboxLength += frameLength;
 }
 
 
 /*************************************************************************
-* function getInput
-* Gets input from user and stores to char* inputString param
+* function flushMessages
+* Sends as much of the outbox as the socket will take without blocking
 * Params:
-*   char* username (for displaying the query)
-*   char* inputString (to store the user input to)
+*   char* outbox (buffer of bytes waiting to be sent)
+*   size_t* outboxLength (# of bytes in outbox, updated)
+*   chatSession* session (connection to send on)
 * Returns:
-*   stores input to char* inputString param
-* Pre-conditions: Client is waiting for user input
-* Post-conditions: Client gets user input and passes back to main function
+*   1 if connection is still open, 0 if sending failed
+* Pre-conditions: Socket is non-blocking
+* Post-conditions: Sent bytes removed from the front of the outbox
 *************************************************************************/
-void getInput(char* username, char* inputString) {
-    // flush stdin so that bad data is not sent to server
-    flushStdin();
+int flushMessages(char* outbox, size_t* outboxLength, chatSession* session) {
+    // nothing waiting
+    if (*outboxLength == 0) {
+        return 1;
+    }
 
-    // print username and query user for input
-    printf("%s> ", username);
+    // send everything queued (after what's already sent of the front frame) in one call
+    int charsWritten = send(session->socketStream, &outbox[session->frontSent], *outboxLength - session->frontSent, 0);
+    if (charsWritten < 0) {
+        // socket full, try again when poll says it's writable
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+            return 1;
+        }
 
-    // clear inputString and stdin
-    memset(inputString, '\0', 512);
+        // error writing to socket
+        printf("chatclient: ERROR sending to socket\n");
+        return 0;
+    }
 
-    // get input from user and store to inputString
-    fgets(inputString, 512, stdin);
+    // find the end of the last frame that was sent in full
+    size_t sent = session->frontSent + charsWritten, offset = 0;
+    while (offset < sent && offset + frameSize(&outbox[offset]) <= sent) {
+        offset += frameSize(&outbox[offset]);
+    }
 
-    // drop newline character from inputString
-    inputString[strlen(inputString) - 1] = '\0';
+    // move the rest (including all of a frame the send stopped in) to the front of the outbox
+    memmove(outbox, &outbox[offset], *outboxLength - offset);
+    *outboxLength -= offset;
+    session->frontSent = sent - offset;
+    return 1;
 }
 
 
 /*************************************************************************
-* function sendMessage
-* Sends provided message to the socket pointed to by socketStream
+* function readInput
+* Reads whatever the user has typed (or a script has piped in) and queues
+* each complete line as a message. A partial line is kept in inputBuffer
+* until the rest of it arrives. Lines longer than 500 chars are cut off.
 * Params:
-*   char* message
-*   char* username (for appending to the message before sending)
-*   char* buffer (for sending the actual message)
-*   int socketStream (points to socket connection)
-* Pre-conditions: Client has user input and is ready to send it
-* Post-conditions: Client sends user input and then waits for a response
+*   char* username (for appending to messages)
+*   char* inputBuffer (holds a partial line between calls)
+*   size_t* inputLength (# of bytes in inputBuffer, updated)
+*   char* outbox (buffer of bytes waiting to be sent)
+*   size_t* outboxLength (# of bytes in outbox, updated)
+* Returns:
+*   1 to keep going, 0 if the user entered '\quit' or stdin closed
+* Pre-conditions: poll says stdin is readable, outbox has room for a full read
+* Post-conditions: Complete lines queued in outbox
 *************************************************************************/
-void sendMessage(char* message, char* username, char* buffer, int socketStream) {
-    /*
-        Used my code from CS344 for sending messages
-    */
+int readInput(char* username, char* inputBuffer, size_t* inputLength, char* outbox, size_t* outboxLength) {
+    char readBuffer[INPUT_SIZE];
 
-    // clear out buffer array and set to username + message
-    memset(buffer, '\0', 1000);
-    sprintf(buffer, "%s> %s", username, message);
+    // read what's available from stdin
+    ssize_t charsRead = read(0, readBuffer, INPUT_SIZE);
+    if (charsRead < 0) {
+        return errno == EAGAIN || errno == EINTR;
+    }
 
-    // send buffer to socket
-    int charsWritten = send(socketStream, buffer, strlen(buffer), 0);
-    if (charsWritten < 0) {
-        // error writing to socket
-        printf("chatclient: ERROR sending to socket\n");
+    // end of input, treat like '\quit'
+    if (charsRead == 0) {
+        return 0;
     }
 
-    // clear buffer after sending
-    memset(buffer, '\0', 1000);
+    // split into lines
+    for (ssize_t i = 0; i < charsRead; i++) {
+        if (readBuffer[i] != '\n') {
+            // add char to current line, dropping anything past the message limit
+            if (*inputLength < MESSAGE_SIZE) {
+                inputBuffer[(*inputLength)++] = readBuffer[i];
+            }
+            continue;
+        }
+
+        // end of line reached, null terminate it
+        inputBuffer[*inputLength] = '\0';
+        *inputLength = 0;
+
+        // user entered '\quit', stop here
+        if (strcmp(inputBuffer, "\\quit") == 0) {
+            return 0;
+        }
+
+        // '\history [N]' asks for the room's messages after # N, skip empty lines, queue everything else
+        if (strncmp(inputBuffer, "\\history", 8) == 0 && (inputBuffer[8] == '\0' || inputBuffer[8] == ' ')) {
+            queueHistoryRequest(&inputBuffer[8], outbox, outboxLength);
+        } else if (strlen(inputBuffer) > 0) {
+            queueMessage(inputBuffer, username, outbox, outboxLength);
+        }
+
+        // show prompt again for the next message
+        showPrompt(username);
+    }
+    return 1;
 }
 
 
 /*************************************************************************
 * function receiveMessage
-* Receives a message from the designated socket and returns a status
-* that indicates if the connection is still open
+* Reads from the socket into the inbox ring buffer and prints every
+* complete message in it, keeping track of the session details the server
+* sends. Returns a status that indicates if the connection is still open
 * Params:
-*   char* buffer
-*   int socketStream (points to socket connection)
+*   frameRing* inbox (ring buffer holding bytes not yet parsed into frames)
+*   char* username (for showing the prompt again afterwards)
+*   chatSession* session (connection to read from, session details updated)
 * Returns:
-*   1 if connection is still open, 0 if connection is closed
-* Pre-conditions: Client has sent a message and is waiting for a response
-* Post-conditions: Query input to send to server or quit if server quit
+*   1 if connection is still open, 0 if the server quit, -1 if the connection was lost
+* Pre-conditions: poll says the socket is readable
+* Post-conditions: Messages printed, or quit if server quit
 *************************************************************************/
-int receiveMessage(char* buffer, int socketStream) {
+int receiveMessage(frameRing* inbox, char* username, chatSession* session) {
     /*
         Used my code from CS344 for receiving messages
     */
-
-    // clear out buffer array
-    memset(buffer, '\0', 1000);
+    char payload[FRAME_MAX_PAYLOAD + 1];
+    size_t length;
+    int type, result, printed = 0;
 
     // receive data from socket
-    int charsRead = recv(socketStream, buffer, 512, 0);
+    ssize_t charsRead = ringFill(inbox, session->socketStream);
     if (charsRead < 0) {
+        // nothing there after all, connection is still open
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+            return 1;
+        }
+
         // error receiving from socket
         printf("chatclient: ERROR receiving from socket\n");
     }
 
-    // if buffer not equal to '\quit', server has not closed connection
-    if (strcmp(buffer, "\\quit") != 0 && strcmp(buffer, "") != 0) {
-        // print contents of buffer
-        printf("%s\n", buffer);
+    // print each complete message
+    while (charsRead > 0 && (result = ringNextFrame(inbox, &type, payload, &length)) == 1) {
+        // the server is talking to us, so this connection ends the run of failed tries
+        // (just connecting doesn't count, a server that hangs up right away should still back off)
+        session->retries = 0;
 
-        // clear out buffer
-        memset(buffer, '\0', 1000);
+        // server sent '\quit', it is closing the connection for good
+        if (type == FRAME_TEXT && strcmp(payload, "\\quit") == 0) {
+            printf("\nchatclient: server has closed the connection\n");
+            return 0;
+        }
 
-        // return 1 indicating connection still open
-        return 1;
-    } else {
-        // server has quit the connection, close socket
-        printf("chatclient: server has closed the connection\n");
+        // welcome: save token, and if we're in a different room than before, start counting from its newest message.
+        // (if it's the same room, we keep our own count so the server can send what we missed)
+        if (type == FRAME_WELCOME && length >= TOKEN_SIZE + 8) {
+            static const char noToken[TOKEN_SIZE];
+            if (memcmp(payload, noToken, TOKEN_SIZE) != 0) {
+                memcpy(session->token, payload, TOKEN_SIZE);
+            }
+            // room name is the rest of the payload (cut to fit), it isn't null terminated
+            char room[sizeof(session->room)];
+            size_t roomLength = length - TOKEN_SIZE - 8;
+            if (roomLength > sizeof(room) - 1) roomLength = sizeof(room) - 1;
+            memcpy(room, &payload[TOKEN_SIZE + 8], roomLength);
+            room[roomLength] = '\0';
+            if (strcmp(session->room, room) != 0) {
+                memcpy(session->room, room, roomLength + 1);
+                session->lastSequence = getNumber(&payload[TOKEN_SIZE]);
+            }
+            continue;
+        }
 
-        // clear out buffer
-        memset(buffer, '\0', 1000);
+        // server stored one of our messages, we have it too
+        if (type == FRAME_ACK && length == 8) {
+            uint64_t sequence = getNumber(payload);
+            if (sequence > session->lastSequence) session->lastSequence = sequence;
+            continue;
+        }
 
-        // return 0 indicating connection has been closed
+        // numbered chat message, the text comes after its sequence # and timestamp
+        char* text = payload;
+        if (type == FRAME_EVENT && length >= EVENT_HEADER_SIZE) {
+            uint64_t sequence = getNumber(payload);
+            if (sequence > session->lastSequence) session->lastSequence = sequence;
+            text = &payload[EVENT_HEADER_SIZE];
+        } else if (type != FRAME_TEXT) {
+            continue;
+        }
+
+        // clear the prompt line (the user may be partway through typing) before the first message
+        if (printed == 0 && isatty(0)) {
+            printf("\r\033[K");
+        }
+        printf("%s\n", text);
+        printed++;
+    }
+
+    // nothing read or bad frame, connection was lost
+    if (charsRead <= 0 || result < 0) {
+        printf("\nchatclient: lost connection to server\n");
+
+        // return -1 indicating connection has been lost
+        return -1;
+    }
+
+    // show prompt again if anything was printed, and return 1 indicating connection still open
+    if (printed > 0) {
+        showPrompt(username);
+    }
+    return 1;
+}
+
+/*************************************************************************
+* function nowMillis
+* Gets the current time from the monotonic clock
+* Returns:
+*   long long time in milliseconds
+* Pre-conditions: None
+* Post-conditions: None
+*************************************************************************/
+long long nowMillis() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+
+/*************************************************************************
+* function scheduleRetry
+* Closes the socket and picks when to try connecting again: right away the
+* first time, then after a delay that doubles with each failed try (plus
+* up to 50% random jitter, so clients dropped together don't all come back
+* at the same moment)
+* Params:
+*   chatSession* session (connection that was lost or failed)
+* Pre-conditions: None
+* Post-conditions: Socket closed, retryAt set
+*************************************************************************/
+void scheduleRetry(chatSession* session) {
+    if (session->socketStream >= 0) {
+        close(session->socketStream);
+    }
+    session->socketStream = -1;
+    session->connecting = 0;
+
+    // work out the delay for this try
+    long long delay = 0;
+    if (session->retries > 0) {
+        delay = RETRY_BASE_MS << (session->retries - 1 < 6 ? session->retries - 1 : 6);
+        if (delay > RETRY_MAX_MS) delay = RETRY_MAX_MS;
+        delay += rand() % (delay / 2 + 1);
+    }
+    session->retries++;
+    session->retryAt = nowMillis() + delay;
+}
+
+
+/*************************************************************************
+* function startConnect
+* Starts a non-blocking connect to the server, using the address looked
+* up at startup so no time is spent on DNS while reconnecting
+* Params:
+*   chatSession* session (connection to make)
+* Pre-conditions: No socket open
+* Post-conditions: Connect in progress, or another try scheduled if it failed
+*************************************************************************/
+void startConnect(chatSession* session) {
+    struct addrinfo* serverInfo = session->serverInfo;
+    session->socketStream = socket(serverInfo->ai_family, serverInfo->ai_socktype, 0);
+    if (session->socketStream < 0) {
+        scheduleRetry(session);
+        return;
+    }
+
+    // poll says when the connect is done (writable)
+    fcntl(session->socketStream, F_SETFL, fcntl(session->socketStream, F_GETFL) | O_NONBLOCK);
+    if (connect(session->socketStream, serverInfo->ai_addr, serverInfo->ai_addrlen) != 0 && errno != EINPROGRESS) {
+        scheduleRetry(session);
+        return;
+    }
+    session->connecting = 1;
+}
+
+
+/*************************************************************************
+* function finishConnect
+* Checks if a non-blocking connect worked. This doesn't end the run of
+* failed tries: that only happens once the server sends a frame (see
+* receiveMessage), so a server that accepts and hangs up still backs off.
+* Params:
+*   chatSession* session (connection in progress)
+* Returns:
+*   1 if connected, 0 if not (and another try is scheduled)
+* Pre-conditions: poll says the connecting socket is ready
+* Post-conditions: Connected, or another try scheduled
+*************************************************************************/
+int finishConnect(chatSession* session) {
+    int error = 0;
+    socklen_t errorLength = sizeof error;
+    session->connecting = 0;
+    if (getsockopt(session->socketStream, SOL_SOCKET, SO_ERROR, &error, &errorLength) != 0 || error != 0) {
+        scheduleRetry(session);
         return 0;
     }
+    return 1;
 }
 
+
 /*************************************************************************
 * main method
 * Opens a socket connection with the host and port provided as runtime
 * arguments. After opening the connection, the client will ask the user
-* for their username, and then send an initial message to the server.
-* The client will then wait until it receives a response from the server
-* and print it out. This will repeat until one of the server or client
-* quit the connection.
+* for their username. From then on it polls stdin and the socket together:
+* lines typed by the user are queued and sent whenever the socket can take
+* them, and messages from the server are printed as soon as they arrive,
+* so both sides can send at any time. This repeats until the user enters
+* '\quit' (or stdin ends) or the server closes the connection. If the
+* connection is lost instead, the client reconnects and resumes its session.
 *************************************************************************/
 int main (int argc, char* argv[]) {
     // if arg count is wrong, display message showing correct usage to user
@@ -329,6 +631,10 @@ int main (int argc, char* argv[]) {
     hints.ai_family = AF_INET;
     hints.ai_socktype = SOCK_STREAM;
 
+    // don't buffer stdin, so fgets in getName doesn't read ahead past the username
+    // (lines after it belong to the poll loop, which reads stdin directly)
+    setvbuf(stdin, NULL, _IONBF, 0);
+
     // get runtime arguments and store to variables
     strcpy(host, argv[1]);
     strcpy(portString, argv[2]);
@@ -345,35 +651,109 @@ int main (int argc, char* argv[]) {
     char username[20];
     strcpy(username, getName());
 
+    // from here on, never block on the socket or stdin, poll tells us when each is ready
+    fcntl(socketStream, F_SETFL, fcntl(socketStream, F_GETFL) | O_NONBLOCK);
+    fcntl(0, F_SETFL, fcntl(0, F_GETFL) | O_NONBLOCK);
+
+    // keep the connection and server address for reconnecting
+    chatSession session;
+    memset(&session, 0, sizeof(session));
+    session.serverInfo = serverInfo;
+    session.socketStream = socketStream;
+    srand(getpid());
+
     // variables for input and sending/receiving data
-    char input[512];
-    char buffer[1000];
-    int stayConnected = 1;
+    char inputBuffer[MESSAGE_SIZE + 1];
+    char outbox[OUTBOX_SIZE];
+    frameRing inbox;
+    size_t inputLength = 0, outboxLength = 0;
+    memset(&inbox, 0, sizeof(inbox));
+    int stayConnected = 1, quitting = 0;
+
+    // say hello first, so the server knows who we are and gives us a session token
+    queueHello(&session, username, outbox, &outboxLength);
+
+    // set up poll for stdin and socket
+    struct pollfd fds[2];
+    fds[0].fd = 0;
+
+    // show first prompt
+    showPrompt(username);
 
     // repeat until connection closed
     while (stayConnected) {
-        // get input from user and copy to input var
-        getInput(username, input);
-
-        // if user entered something other than '\quit', append the username to the message and send to the server
-        if (strcmp(input, "\\quit") != 0) {
-            // send message to the server
-            sendMessage(input, username, buffer, socketStream);
-
-            // receiveMessage waits for response. returns 1 if connection is still alive, 0 if server closed connection
-            if(!receiveMessage(buffer, socketStream)) {
-                // server closed connection, close socket on client and break out of loop
-                close(socketStream);
+        // read stdin only if the outbox has room for a full read's worth of messages (and a hello)
+        fds[0].events = (!quitting && outboxLength + OUTBOX_RESERVE <= OUTBOX_SIZE) ? POLLIN : 0;
+
+        // while connecting wait for the socket to be writable, when connected ask about writing
+        // only while there's something to send, and with no socket (poll skips -1) wait to retry
+        fds[1].fd = session.socketStream;
+        fds[1].events = session.connecting ? POLLOUT : POLLIN | (outboxLength > 0 ? POLLOUT : 0);
+        int timeout = -1;
+        if (session.socketStream < 0) {
+            long long wait = session.retryAt - nowMillis();
+            timeout = wait > 0 ? (int) wait : 0;
+        }
+
+        // wait for stdin or the socket (or the next retry)
+        if (poll(fds, 2, timeout) < 0) {
+            continue;
+        }
+
+        if (session.socketStream < 0) {
+            // out of tries, give up
+            if (session.retries > MAX_RETRIES) {
+                printf("chatclient: could not reconnect to server, giving up\n");
                 stayConnected = 0;
+                continue;
             }
-            // receiveMessage returned 1, loop back to top of loop and query user for input
-        } else {
-            // user entered quit, close socket and break out of loop
-            close(socketStream);
+
+            // time to try again
+            if (nowMillis() >= session.retryAt) {
+                startConnect(&session);
+            }
+        } else if (session.connecting) {
+            // connect finished, say hello again (with our token) before anything else
+            if (fds[1].revents && finishConnect(&session)) {
+                printf("chatclient: reconnected to server\n");
+                memset(&inbox, 0, sizeof(inbox));
+                queueHello(&session, username, outbox, &outboxLength);
+                showPrompt(username);
+            }
+        } else if (fds[1].revents & (POLLIN | POLLHUP | POLLERR)) {
+            // message from the server. receiveMessage returns 0 if server quit, -1 if connection was lost
+            int result = receiveMessage(&inbox, username, &session);
+            if (result == 0) {
+                stayConnected = 0;
+                continue;
+            }
+            if (result < 0) {
+                scheduleRetry(&session);
+            }
+        }
+
+        // user typed something. readInput returns 0 if user entered '\quit' or input ended
+        if ((fds[0].revents & (POLLIN | POLLHUP)) && !readInput(username, inputBuffer, &inputLength, outbox, &outboxLength)) {
+            quitting = 1;
+        }
+
+        // send whatever is queued, all in one send
+        if (session.socketStream >= 0 && !session.connecting && !flushMessages(outbox, &outboxLength, &session)) {
+            printf("\nchatclient: lost connection to server\n");
+            scheduleRetry(&session);
+        }
+
+        // quitting and everything has been sent (or there's no connection to send it on), done
+        if (quitting && (outboxLength == 0 || session.socketStream < 0)) {
             stayConnected = 0;
         }
     }
 
-    // return 0 and exit
+    // close socket, put stdin back to blocking, and exit
+    if (session.socketStream >= 0) {
+        close(session.socketStream);
+    }
+    freeaddrinfo(serverInfo);
+    fcntl(0, F_SETFL, fcntl(0, F_GETFL) & ~O_NONBLOCK);
     return 0;
-}
+}
\ No newline at end of file
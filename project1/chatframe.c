@@ -0,0 +1,237 @@
+/*************************************************************************
+** CS372 Intro to Networks
+** Winter 2019
+**
+** Project 1 - Message Framing (chatframe)
+** David Mednikov
+**
+** Builds and parses the length-prefixed frames described in chatframe.h.
+** Shared by chatclient and chatroom.
+*************************************************************************/
+
+// import modules
+#include <string.h>
+#include <sys/uio.h>
+
+#include "chatframe.h"
+
+
+/*************************************************************************
+* function writeHeader
+* Writes a frame header into out
+* Params:
+*   char* out (buffer with room for FRAME_HEADER_SIZE bytes)
+*   int type (frame type)
+*   size_t length (# of bytes in the payload that will follow)
+* Pre-conditions: length <= FRAME_MAX_PAYLOAD
+* Post-conditions: out holds the header
+*************************************************************************/
+static void writeHeader(char* out, int type, size_t length) {
+    // length is written big endian, then the type
+    out[0] = (char) ((length >> 24) & 0xFF);
+    out[1] = (char) ((length >> 16) & 0xFF);
+    out[2] = (char) ((length >> 8) & 0xFF);
+    out[3] = (char) (length & 0xFF);
+    out[4] = (char) type;
+}
+
+
+/*************************************************************************
+* function buildFrame
+* Writes a frame header followed by the payload into out
+* Params:
+*   char* out (buffer with room for FRAME_HEADER_SIZE + length bytes)
+*   int type (frame type)
+*   const char* payload (frame contents)
+*   size_t length (# of bytes in payload)
+* Returns:
+*   size_t total # of bytes written to out
+* Pre-conditions: length <= FRAME_MAX_PAYLOAD
+* Post-conditions: out holds a complete frame
+*************************************************************************/
+size_t buildFrame(char* out, int type, const char* payload, size_t length) {
+    writeHeader(out, type, length);
+
+    // payload goes right after the header
+    memcpy(&out[FRAME_HEADER_SIZE], payload, length);
+    return FRAME_HEADER_SIZE + length;
+}
+
+
+/*************************************************************************
+* function frameSize
+* Gets the total size of the frame starting at frame
+* Params:
+*   const char* frame (start of a frame header)
+* Returns:
+*   size_t header + payload size
+* Pre-conditions: frame points to at least FRAME_HEADER_SIZE bytes
+* Post-conditions: None
+*************************************************************************/
+size_t frameSize(const char* frame) {
+    const unsigned char* header = (const unsigned char*) frame;
+    size_t payloadLength = ((size_t) header[0] << 24) | ((size_t) header[1] << 16) | ((size_t) header[2] << 8) | header[3];
+    return FRAME_HEADER_SIZE + payloadLength;
+}
+
+
+/*************************************************************************
+* function putNumber
+* Writes a number as 8 bytes, big endian
+* Params:
+*   char* out (buffer with room for 8 bytes)
+*   uint64_t value (number to write)
+* Pre-conditions: None
+* Post-conditions: out holds the number
+*************************************************************************/
+void putNumber(char* out, uint64_t value) {
+    for (int i = 7; i >= 0; i--) {
+        out[i] = (char) (value & 0xFF);
+        value >>= 8;
+    }
+}
+
+
+/*************************************************************************
+* function getNumber
+* Reads a number written by putNumber
+* Params:
+*   const char* in (8 bytes, big endian)
+* Returns:
+*   uint64_t number that was written
+* Pre-conditions: None
+* Post-conditions: None
+*************************************************************************/
+uint64_t getNumber(const char* in) {
+    uint64_t value = 0;
+    for (int i = 0; i < 8; i++) {
+        value = (value << 8) | (unsigned char) in[i];
+    }
+    return value;
+}
+
+
+/*************************************************************************
+* function buildEvent
+* Writes a FRAME_EVENT frame: the header, then the sequence # and
+* timestamp, then the text
+* Params:
+*   char* out (buffer with room for FRAME_HEADER_SIZE + EVENT_HEADER_SIZE + length bytes)
+*   uint64_t sequence (message's sequence # in its room)
+*   uint64_t timestamp (time the message was sent, in ms since the epoch)
+*   const char* text (message text)
+*   size_t length (# of bytes in text)
+* Returns:
+*   size_t total # of bytes written to out
+* Pre-conditions: EVENT_HEADER_SIZE + length <= FRAME_MAX_PAYLOAD
+* Post-conditions: out holds a complete frame
+*************************************************************************/
+size_t buildEvent(char* out, uint64_t sequence, uint64_t timestamp, const char* text, size_t length) {
+    // header, then sequence # and timestamp, then text
+    writeHeader(out, FRAME_EVENT, EVENT_HEADER_SIZE + length);
+    putNumber(&out[FRAME_HEADER_SIZE], sequence);
+    putNumber(&out[FRAME_HEADER_SIZE + 8], timestamp);
+    memcpy(&out[FRAME_HEADER_SIZE + EVENT_HEADER_SIZE], text, length);
+    return FRAME_HEADER_SIZE + EVENT_HEADER_SIZE + length;
+}
+
+
+/*************************************************************************
+* function ringFill
+* Reads as much as fits from the socket into the ring's free space. The
+* free space can wrap around the end of the buffer, so it is read with
+* readv into (up to) two pieces in one call.
+* Params:
+*   frameRing* ring (ring buffer to fill)
+*   int socketFD (socket to read from)
+* Returns:
+*   ssize_t # of bytes read, 0 if connection closed, -1 on error
+* Pre-conditions: All complete frames were taken out after the last fill
+* Post-conditions: New bytes added to the ring
+*************************************************************************/
+ssize_t ringFill(frameRing* ring, int socketFD) {
+    struct iovec iov[2];
+
+    // find free space, starting at the tail
+    size_t used = ring->tail - ring->head;
+    size_t freeSpace = RING_SIZE - used;
+    size_t start = ring->tail % RING_SIZE;
+
+    // first piece runs to the end of the buffer, second piece (if any) wraps to the start
+    iov[0].iov_base = &ring->data[start];
+    iov[0].iov_len = freeSpace < RING_SIZE - start ? freeSpace : RING_SIZE - start;
+    iov[1].iov_base = &ring->data[0];
+    iov[1].iov_len = freeSpace - iov[0].iov_len;
+
+    // read into both pieces at once
+    ssize_t bytesRead = readv(socketFD, iov, iov[1].iov_len > 0 ? 2 : 1);
+    if (bytesRead > 0) {
+        ring->tail += bytesRead;
+    }
+    return bytesRead;
+}
+
+
+/*************************************************************************
+* function ringCopy
+* Copies bytes out of the ring, starting offset bytes past the head
+* Params:
+*   frameRing* ring (ring buffer to copy from)
+*   size_t offset (# of bytes past head to start at)
+*   char* out (buffer to copy to)
+*   size_t length (# of bytes to copy)
+* Pre-conditions: Ring holds at least offset + length bytes
+* Post-conditions: out holds the bytes, ring is unchanged
+*************************************************************************/
+static void ringCopy(frameRing* ring, size_t offset, char* out, size_t length) {
+    // copy up to the end of the buffer, then the rest from the start
+    size_t start = (ring->head + offset) % RING_SIZE;
+    size_t first = length < RING_SIZE - start ? length : RING_SIZE - start;
+    memcpy(out, &ring->data[start], first);
+    memcpy(out + first, &ring->data[0], length - first);
+}
+
+
+/*************************************************************************
+* function ringNextFrame
+* Takes the next complete frame out of the ring
+* Params:
+*   frameRing* ring (ring buffer to read from)
+*   int* type (set to the frame type)
+*   char* payload (buffer of FRAME_MAX_PAYLOAD + 1 bytes for the payload)
+*   size_t* length (set to # of bytes in payload)
+* Returns:
+*   1 if a frame was taken, 0 if the next frame isn't complete yet,
+*   -1 if the next frame is bigger than FRAME_MAX_PAYLOAD
+* Pre-conditions: None
+* Post-conditions: Frame removed from ring and payload null terminated
+*************************************************************************/
+int ringNextFrame(frameRing* ring, int* type, char* payload, size_t* length) {
+    unsigned char header[FRAME_HEADER_SIZE];
+    size_t used = ring->tail - ring->head;
+
+    // need a whole header first
+    if (used < FRAME_HEADER_SIZE) {
+        return 0;
+    }
+
+    // read header and check the length
+    ringCopy(ring, 0, (char*) header, FRAME_HEADER_SIZE);
+    size_t payloadLength = ((size_t) header[0] << 24) | ((size_t) header[1] << 16) | ((size_t) header[2] << 8) | header[3];
+    if (payloadLength > FRAME_MAX_PAYLOAD) {
+        return -1;
+    }
+
+    // wait for the rest of the payload
+    if (used < FRAME_HEADER_SIZE + payloadLength) {
+        return 0;
+    }
+
+    // copy payload out and move head past the frame
+    ringCopy(ring, FRAME_HEADER_SIZE, payload, payloadLength);
+    payload[payloadLength] = '\0';
+    *type = header[4];
+    *length = payloadLength;
+    ring->head += FRAME_HEADER_SIZE + payloadLength;
+    return 1;
+}
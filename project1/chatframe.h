@@ -0,0 +1,93 @@
+/*************************************************************************
+** CS372 Intro to Networks
+** Winter 2019
+**
+** Project 1 - Message Framing (chatframe)
+** David Mednikov
+**
+** Every message between chatclient and a chat server is sent as a frame:
+**
+**     4 bytes   payload length (big endian, not counting this header)
+**     1 byte    frame type (FRAME_TEXT, ...)
+**     N bytes   payload
+**
+** so receivers know exactly where each message ends, even when several
+** arrive in one read or one arrives split across reads. Received bytes go
+** into a ring buffer, and complete frames are taken out of it one by one.
+**
+** Chat messages that chatroom keeps in its history are sent as FRAME_EVENT,
+** whose payload starts with the message's sequence # in its room and the
+** time it was sent (both 8 bytes, big endian) before the text. A client
+** asks for the history after some sequence # with a FRAME_HISTORY frame
+** holding just that 8 byte sequence #. Sequence #s start at 1; a message
+** numbered 0 couldn't be added to the history and doesn't count towards it.
+**
+** Sessions: a client starts by sending FRAME_HELLO (session token, last
+** sequence # it has, then "username room"). chatroom answers with
+** FRAME_WELCOME (session token, newest sequence # in the room, room name)
+** after the hello and whenever the client changes rooms, and confirms
+** each chat message it stores with a FRAME_ACK holding its sequence #. A
+** client that reconnects sends its old token and last sequence # in the
+** hello to get back into its room and be sent what it missed.
+*************************************************************************/
+
+#ifndef CHATFRAME_H
+#define CHATFRAME_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// size of the frame header (length + type)
+#define FRAME_HEADER_SIZE 5
+
+// largest payload allowed in a frame. bigger frames are treated as a broken connection
+#define FRAME_MAX_PAYLOAD 1024
+
+// size of a receive ring buffer. must be a power of 2 and hold at least one full frame
+#define RING_SIZE 8192
+
+// frame types
+#define FRAME_TEXT 1
+#define FRAME_EVENT 2
+#define FRAME_HISTORY 3
+#define FRAME_HELLO 4
+#define FRAME_WELCOME 5
+#define FRAME_ACK 6
+
+// size of the sequence # + timestamp at the start of a FRAME_EVENT payload
+#define EVENT_HEADER_SIZE 16
+
+// size of a session token (all zeroes means no session yet)
+#define TOKEN_SIZE 16
+
+// ring buffer for received bytes. head and tail only ever count up, and are
+// taken modulo RING_SIZE to get positions in data
+typedef struct frameRing {
+    char data[RING_SIZE];
+    size_t head, tail;
+} frameRing;
+
+// builds a frame (header + payload) in out, returns total frame size
+size_t buildFrame(char* out, int type, const char* payload, size_t length);
+
+// returns the total size (header + payload) of the frame starting at frame
+size_t frameSize(const char* frame);
+
+// builds a FRAME_EVENT frame in out, returns total frame size
+size_t buildEvent(char* out, uint64_t sequence, uint64_t timestamp, const char* text, size_t length);
+
+// writes/reads an 8 byte big endian number
+void putNumber(char* out, uint64_t value);
+uint64_t getNumber(const char* in);
+
+// reads from socketFD into the ring's free space. returns bytes read, 0 if
+// the connection closed, or -1 with errno set (EAGAIN if nothing was waiting)
+ssize_t ringFill(frameRing* ring, int socketFD);
+
+// takes the next complete frame out of the ring. payload must hold
+// FRAME_MAX_PAYLOAD + 1 bytes and is null terminated. returns 1 if a frame
+// was taken, 0 if more bytes are needed, -1 if the frame is too big
+int ringNextFrame(frameRing* ring, int* type, char* payload, size_t* length);
+
+#endif
@@ -0,0 +1,461 @@
+/*************************************************************************
+** CS372 Intro to Networks
+** Winter 2019
+**
+** Project 1 - Chat History (chatlog)
+** David Mednikov
+**
+** Segmented, memory mapped, append-only room history described in
+** chatlog.h. Used by chatroom.
+*************************************************************************/
+
+// import modules
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "chatframe.h"
+#include "chatlog.h"
+
+
+/*************************************************************************
+* function segmentPath
+* Builds the path of a segment file or its index
+* Params:
+*   chatLog* log (log the segment belongs to)
+*   uint64_t firstSequence (sequence # the segment starts at)
+*   const char* extension ("log" or "idx")
+*   char* path (buffer of LOG_PATH_SIZE + 32 bytes for the result)
+* Pre-conditions: None
+* Post-conditions: path holds "<dir>/<firstSequence>.<extension>"
+*************************************************************************/
+static void segmentPath(chatLog* log, uint64_t firstSequence, const char* extension, char* path) {
+    // zero padded so the files list in order
+    snprintf(path, LOG_PATH_SIZE + 32, "%s/%020" PRIu64 ".%s", log->dir, firstSequence, extension);
+}
+
+
+/*************************************************************************
+* function addIndexEntry
+* Adds an entry to a segment's sparse index, and saves it to the index
+* file if the segment's files are open
+* Params:
+*   logSegment* segment (segment to add to)
+*   uint64_t sequence (sequence # of the message)
+*   size_t offset (where the message starts in the segment)
+* Pre-conditions: sequence is past every entry already in the index
+* Post-conditions: Entry added
+*************************************************************************/
+static void addIndexEntry(logSegment* segment, uint64_t sequence, size_t offset) {
+    // grow the index if it's full
+    if (segment->indexCount == segment->indexCapacity) {
+        segment->indexCapacity = segment->indexCapacity ? segment->indexCapacity * 2 : 64;
+        segment->index = realloc(segment->index, segment->indexCapacity * sizeof(logIndexEntry));
+    }
+
+    // add entry, and write it to its slot in the index file
+    logIndexEntry* entry = &segment->index[segment->indexCount];
+    entry->sequence = sequence;
+    entry->offset = offset;
+    if (segment->indexFd >= 0) {
+        pwrite(segment->indexFd, entry, sizeof(logIndexEntry), segment->indexCount * sizeof(logIndexEntry));
+    }
+    segment->indexCount++;
+}
+
+
+/*************************************************************************
+* function loadIndex
+* Reads a segment's saved index, keeping only the entries that still match
+* the messages in the segment (the rest get rebuilt by scanSegment)
+* Params:
+*   logSegment* segment (segment with its file mapped and index file open)
+* Pre-conditions: Index is empty
+* Post-conditions: Index holds the valid saved entries
+*************************************************************************/
+static void loadIndex(logSegment* segment) {
+    struct stat indexInfo;
+    if (fstat(segment->indexFd, &indexInfo) != 0 || indexInfo.st_size < (off_t) sizeof(logIndexEntry)) {
+        return;
+    }
+
+    // read every saved entry
+    segment->indexCapacity = indexInfo.st_size / sizeof(logIndexEntry);
+    segment->index = malloc(segment->indexCapacity * sizeof(logIndexEntry));
+    ssize_t bytesRead = pread(segment->indexFd, segment->index, segment->indexCapacity * sizeof(logIndexEntry), 0);
+    size_t saved = bytesRead > 0 ? bytesRead / sizeof(logIndexEntry) : 0;
+
+    // keep entries while each one is where it should be and points at the right message
+    while (segment->indexCount < saved) {
+        logIndexEntry* entry = &segment->index[segment->indexCount];
+        if (entry->sequence != segment->firstSequence + segment->indexCount * LOG_INDEX_INTERVAL
+            || entry->offset + FRAME_HEADER_SIZE + EVENT_HEADER_SIZE > segment->capacity
+            || (segment->indexCount > 0 && entry->offset <= entry[-1].offset)
+            || getNumber(&segment->data[entry->offset + FRAME_HEADER_SIZE]) != entry->sequence) {
+            break;
+        }
+        segment->indexCount++;
+    }
+}
+
+
+/*************************************************************************
+* function scanSegment
+* Finds the end of the messages in a segment, starting from the last
+* index entry, and adds any index entries that are missing (e.g. after
+* a crash)
+* Params:
+*   logSegment* segment (segment with its file mapped)
+* Returns:
+*   uint64_t sequence # after the segment's last message
+* Pre-conditions: Index loaded
+* Post-conditions: segment->end set
+*************************************************************************/
+static uint64_t scanSegment(logSegment* segment) {
+    // start at the last indexed message, or the start of the segment
+    size_t offset = 0;
+    uint64_t sequence = segment->firstSequence;
+    if (segment->indexCount > 0) {
+        offset = segment->index[segment->indexCount - 1].offset;
+        sequence = segment->index[segment->indexCount - 1].sequence;
+    }
+
+    // walk messages until one is missing, cut off, or out of order
+    while (offset + FRAME_HEADER_SIZE + EVENT_HEADER_SIZE <= segment->capacity) {
+        char* frame = &segment->data[offset];
+        size_t size = frameSize(frame);
+        if (frame[4] != FRAME_EVENT || size < FRAME_HEADER_SIZE + EVENT_HEADER_SIZE || size > FRAME_HEADER_SIZE + FRAME_MAX_PAYLOAD
+            || offset + size > segment->capacity || getNumber(&frame[FRAME_HEADER_SIZE]) != sequence) {
+            break;
+        }
+
+        // add index entry if this message should have one
+        if ((sequence - segment->firstSequence) % LOG_INDEX_INTERVAL == 0
+            && (segment->indexCount == 0 || segment->index[segment->indexCount - 1].sequence < sequence)) {
+            addIndexEntry(segment, sequence, offset);
+        }
+        offset += size;
+        sequence++;
+    }
+
+    segment->end = offset;
+    return sequence;
+}
+
+
+/*************************************************************************
+* function openSegment
+* Maps a segment file (creating it if needed) and loads its index. The
+* segment being appended to is grown to LOG_SEGMENT_SIZE and keeps its
+* files open, older segments are only kept mapped.
+* Params:
+*   chatLog* log (log the segment belongs to)
+*   logSegment* segment (segment to fill in)
+*   uint64_t firstSequence (sequence # the segment starts at)
+*   int active (1 if new messages will be appended to this segment)
+* Returns:
+*   uint64_t sequence # after the segment's last message, or 0 on error
+* Pre-conditions: None
+* Post-conditions: Segment mapped and indexed
+*************************************************************************/
+static uint64_t openSegment(chatLog* log, logSegment* segment, uint64_t firstSequence, int active) {
+    char path[LOG_PATH_SIZE + 32];
+    struct stat fileInfo;
+
+    memset(segment, 0, sizeof(logSegment));
+    segment->firstSequence = firstSequence;
+    segment->fd = segment->indexFd = -1;
+
+    // open segment file and grow it if messages will be added
+    segmentPath(log, firstSequence, "log", path);
+    segment->fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (segment->fd < 0 || fstat(segment->fd, &fileInfo) != 0) {
+        return 0;
+    }
+    segment->capacity = fileInfo.st_size;
+    if (active && segment->capacity < LOG_SEGMENT_SIZE) {
+        if (ftruncate(segment->fd, LOG_SEGMENT_SIZE) != 0) {
+            return 0;
+        }
+        segment->capacity = LOG_SEGMENT_SIZE;
+    }
+
+    // map it (an empty sealed segment has nothing to map)
+    if (segment->capacity > 0) {
+        segment->data = mmap(NULL, segment->capacity, PROT_READ | PROT_WRITE, MAP_SHARED, segment->fd, 0);
+        if (segment->data == MAP_FAILED) {
+            segment->data = NULL;
+            return 0;
+        }
+    }
+
+    // load saved index, then find where the messages end
+    segmentPath(log, firstSequence, "idx", path);
+    segment->indexFd = open(path, O_RDWR | O_CREAT, 0644);
+    if (segment->indexFd >= 0 && segment->data != NULL) {
+        loadIndex(segment);
+    }
+    uint64_t nextSequence = segment->data != NULL ? scanSegment(segment) : firstSequence;
+
+    // older segments don't need their files anymore
+    if (!active) {
+        close(segment->fd);
+        if (segment->indexFd >= 0) close(segment->indexFd);
+        segment->fd = segment->indexFd = -1;
+    }
+    return nextSequence;
+}
+
+
+/*************************************************************************
+* function compareSequences
+* qsort comparator for sequence #s
+*************************************************************************/
+static int compareSequences(const void* a, const void* b) {
+    uint64_t first = *(const uint64_t*) a, second = *(const uint64_t*) b;
+    return first < second ? -1 : first > second;
+}
+
+
+/*************************************************************************
+* function openLog
+* Opens the log in dir, mapping every segment in it. A new log starts
+* with one empty segment at sequence # 1.
+* Params:
+*   chatLog* log (log to fill in)
+*   const char* dir (directory holding the segments, created if missing)
+* Returns:
+*   int 0 on success, -1 on error
+* Pre-conditions: None
+* Post-conditions: Log ready for appendLog and findLog
+*************************************************************************/
+int openLog(chatLog* log, const char* dir) {
+    memset(log, 0, sizeof(chatLog));
+    strncpy(log->dir, dir, LOG_PATH_SIZE - 1);
+    if (mkdir(log->dir, 0755) != 0 && errno != EEXIST) {
+        return -1;
+    }
+
+    // collect the starting sequence # of every segment in the directory
+    DIR* logDir = opendir(log->dir);
+    if (logDir == NULL) {
+        return -1;
+    }
+    uint64_t* starts = NULL;
+    int count = 0, capacity = 0;
+    struct dirent* entry;
+    while ((entry = readdir(logDir)) != NULL) {
+        char* extension = strrchr(entry->d_name, '.');
+        if (extension == NULL || strcmp(extension, ".log") != 0) {
+            continue;
+        }
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 16;
+            starts = realloc(starts, capacity * sizeof(uint64_t));
+        }
+        starts[count++] = strtoull(entry->d_name, NULL, 10);
+    }
+    closedir(logDir);
+
+    // brand new log gets one segment starting at 1
+    if (count == 0) {
+        starts = realloc(starts, sizeof(uint64_t));
+        starts[count++] = 1;
+    }
+
+    // map the segments in order, the last one is appended to
+    qsort(starts, count, sizeof(uint64_t), compareSequences);
+    log->segments = calloc(count, sizeof(logSegment));
+    for (int i = 0; i < count; i++) {
+        log->nextSequence = openSegment(log, &log->segments[i], starts[i], i == count - 1);
+        log->segmentCount++;
+        if (log->nextSequence == 0) {
+            free(starts);
+            return -1;
+        }
+    }
+    free(starts);
+    return 0;
+}
+
+
+/*************************************************************************
+* function appendLog
+* Adds a message to the end of the log as a FRAME_EVENT frame. If it
+* doesn't fit in the current segment, that segment is cut down to its
+* used size and a new one is started.
+* Params:
+*   chatLog* log (log to add to)
+*   const char* text (message text)
+*   size_t length (# of bytes in text)
+*   uint64_t timestamp (time the message was sent, in ms since the epoch)
+*   const char** frame (set to the stored frame)
+* Returns:
+*   size_t size of the stored frame, or 0 if it couldn't be stored
+* Pre-conditions: EVENT_HEADER_SIZE + length <= FRAME_MAX_PAYLOAD
+* Post-conditions: Message stored with the next sequence #
+*************************************************************************/
+size_t appendLog(chatLog* log, const char* text, size_t length, uint64_t timestamp, const char** frame) {
+    size_t size = FRAME_HEADER_SIZE + EVENT_HEADER_SIZE + length;
+    logSegment* segment = &log->segments[log->segmentCount - 1];
+
+    // start a new segment if this one is full
+    if (segment->end + size > segment->capacity) {
+        // make room for the new segment at the end of the list
+        logSegment* segments = realloc(log->segments, (log->segmentCount + 1) * sizeof(logSegment));
+        if (segments == NULL) {
+            return 0;
+        }
+        log->segments = segments;
+
+        // open the new segment first, so the full one is left as it was if that fails
+        logSegment* full = &log->segments[log->segmentCount - 1];
+        segment = &log->segments[log->segmentCount];
+        if (openSegment(log, segment, log->nextSequence, 1) == 0) {
+            if (segment->data != NULL) munmap(segment->data, segment->capacity);
+            if (segment->fd >= 0) close(segment->fd);
+            return 0;
+        }
+        log->segmentCount++;
+
+        // seal the full one: trim the unused space and close its files. its mapping
+        // stays, but only the part that's still in the file may be read from now on
+        if (ftruncate(full->fd, full->end) == 0) {
+            full->capacity = full->end;
+        }
+        close(full->fd);
+        if (full->indexFd >= 0) close(full->indexFd);
+        full->fd = full->indexFd = -1;
+    }
+
+    // write the frame straight into the mapping, indexing it if it's due for an entry
+    char* out = &segment->data[segment->end];
+    buildEvent(out, log->nextSequence, timestamp, text, length);
+    if ((log->nextSequence - segment->firstSequence) % LOG_INDEX_INTERVAL == 0) {
+        addIndexEntry(segment, log->nextSequence, segment->end);
+    }
+    segment->end += size;
+    log->nextSequence++;
+
+    *frame = out;
+    return size;
+}
+
+
+/*************************************************************************
+* function findLog
+* Finds the first message after a sequence #: a binary search over the
+* segments, then over the segment's sparse index, then a scan of at most
+* LOG_INDEX_INTERVAL messages
+* Params:
+*   chatLog* log (log to search)
+*   uint64_t afterSequence (last sequence # the caller already has)
+* Returns:
+*   logCursor at the first message after afterSequence (or the end of the log)
+* Pre-conditions: Log is open
+* Post-conditions: None
+*************************************************************************/
+logCursor findLog(chatLog* log, uint64_t afterSequence) {
+    logCursor cursor;
+    uint64_t wanted = afterSequence + 1;
+
+    // caller is already up to date
+    if (wanted >= log->nextSequence) {
+        cursor.segment = log->segmentCount - 1;
+        cursor.offset = log->segments[cursor.segment].end;
+        return cursor;
+    }
+
+    // last segment starting at or before the wanted message
+    int low = 0, high = log->segmentCount - 1;
+    while (low < high) {
+        int middle = (low + high + 1) / 2;
+        if (log->segments[middle].firstSequence <= wanted) low = middle;
+        else high = middle - 1;
+    }
+    logSegment* segment = &log->segments[low];
+    cursor.segment = low;
+    cursor.offset = 0;
+
+    // last index entry at or before the wanted message
+    size_t first = 0, last = segment->indexCount;
+    while (first < last) {
+        size_t middle = (first + last) / 2;
+        if (segment->index[middle].sequence <= wanted) first = middle + 1;
+        else last = middle;
+    }
+    if (first > 0) {
+        cursor.offset = segment->index[first - 1].offset;
+    }
+
+    // walk forward to the wanted message
+    while (cursor.offset < segment->end && getNumber(&segment->data[cursor.offset + FRAME_HEADER_SIZE]) < wanted) {
+        cursor.offset += frameSize(&segment->data[cursor.offset]);
+    }
+    return cursor;
+}
+
+
+/*************************************************************************
+* function readLog
+* Gets the stored bytes from a cursor to the end of its segment, moving
+* the cursor to the next segment first if it has used this one up
+* Params:
+*   chatLog* log (log to read)
+*   logCursor* cursor (position to read from, caller adds what it used to offset)
+*   const char** span (set to the bytes)
+* Returns:
+*   size_t # of bytes in span, 0 if the cursor is at the end of the log
+* Pre-conditions: cursor came from findLog on this log
+* Post-conditions: None
+*************************************************************************/
+size_t readLog(chatLog* log, logCursor* cursor, const char** span) {
+    // skip past used up segments, but stay in the last one (more may be added to it)
+    while (cursor->segment < log->segmentCount - 1 && cursor->offset >= log->segments[cursor->segment].end) {
+        cursor->segment++;
+        cursor->offset = 0;
+    }
+
+    logSegment* segment = &log->segments[cursor->segment];
+    *span = &segment->data[cursor->offset];
+    return segment->end - cursor->offset;
+}
+
+
+/*************************************************************************
+* function logFrameEnd
+* Finds where the message containing a cursor's position ends, so a
+* replay that was cut off part way through a frame can be finished
+* Params:
+*   chatLog* log (log the cursor is in)
+*   logCursor* cursor (position to check)
+* Returns:
+*   size_t offset in the cursor's segment of the end of the message
+* Pre-conditions: cursor came from findLog on this log
+* Post-conditions: None
+*************************************************************************/
+size_t logFrameEnd(chatLog* log, logCursor* cursor) {
+    logSegment* segment = &log->segments[cursor->segment];
+
+    // last index entry at or before the cursor
+    size_t first = 0, last = segment->indexCount;
+    while (first < last) {
+        size_t middle = (first + last) / 2;
+        if (segment->index[middle].offset <= cursor->offset) first = middle + 1;
+        else last = middle;
+    }
+    size_t offset = first > 0 ? segment->index[first - 1].offset : 0;
+
+    // walk frames until reaching (or passing) the cursor
+    while (offset < cursor->offset) {
+        offset += frameSize(&segment->data[offset]);
+    }
+    return offset;
+}
@@ -0,0 +1,90 @@
+/*************************************************************************
+** CS372 Intro to Networks
+** Winter 2019
+**
+** Project 1 - Chat History (chatlog)
+** David Mednikov
+**
+** Append-only history of one chat room, kept in a directory of segment
+** files. Each segment is named after the sequence # of its first message
+** and memory mapped, and messages are stored as the exact FRAME_EVENT
+** frames that are sent to clients, so replaying history is just sending
+** bytes straight out of the mapping. When a segment fills up a new one is
+** started.
+**
+** Every LOG_INDEX_INTERVAL-th message of a segment gets an entry in a small
+** sparse index (saved next to the segment), so finding where "everything
+** after sequence N" starts only takes a binary search and a short scan
+** instead of reading the whole history.
+*************************************************************************/
+
+#ifndef CHATLOG_H
+#define CHATLOG_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// size of a segment file
+#define LOG_SEGMENT_SIZE (4 * 1024 * 1024)
+
+// # of messages between sparse index entries
+#define LOG_INDEX_INTERVAL 64
+
+// longest path to a room's log directory
+#define LOG_PATH_SIZE 512
+
+// sparse index entry: where in its segment a message starts
+typedef struct logIndexEntry {
+    uint64_t sequence;
+    uint64_t offset;
+} logIndexEntry;
+
+// one segment file and its index
+typedef struct logSegment {
+    uint64_t firstSequence;
+
+    // mapped file, # of bytes mapped, and # of bytes used by messages
+    char* data;
+    size_t capacity, end;
+
+    // files are only kept open for the segment being appended to, -1 otherwise
+    int fd, indexFd;
+
+    // sparse index
+    logIndexEntry* index;
+    size_t indexCount, indexCapacity;
+} logSegment;
+
+// history of one room
+typedef struct chatLog {
+    char dir[LOG_PATH_SIZE];
+    logSegment* segments;
+    int segmentCount;
+    uint64_t nextSequence;
+} chatLog;
+
+// position in a log (segment # and byte offset into it)
+typedef struct logCursor {
+    int segment;
+    size_t offset;
+} logCursor;
+
+// opens (or creates) the log in dir. returns 0 on success, -1 on error
+int openLog(chatLog* log, const char* dir);
+
+// adds a message to the end of the log and points frame at the stored
+// FRAME_EVENT. returns the frame's size, or 0 if it couldn't be stored
+size_t appendLog(chatLog* log, const char* text, size_t length, uint64_t timestamp, const char** frame);
+
+// returns a cursor at the first message with a sequence # after afterSequence
+logCursor findLog(chatLog* log, uint64_t afterSequence);
+
+// points span at the bytes from cursor to the end of its segment, moving on
+// to the next segment first if this one is used up. returns # of bytes, 0 at the end of the log
+size_t readLog(chatLog* log, logCursor* cursor, const char** span);
+
+// returns the offset where the message containing cursor's offset ends
+// (or cursor's offset itself if a message starts there)
+size_t logFrameEnd(chatLog* log, logCursor* cursor);
+
+#endif
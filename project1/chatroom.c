@@ -0,0 +1,1260 @@
+/*************************************************************************
+** CS372 Intro to Networks
+** Winter 2019
+**
+** Project 1 - Multi-user Server (chatroom)
+** David Mednikov
+**
+** This is a chat server for many users at once, unlike chatserve, which
+** talks to a single client. The server listens to a port that is passed as
+** a command line argument and accepts as many chatclient connections as the
+** system allows, all handled by one epoll event loop.
+**
+** Every client starts in the "lobby" room. A message sent by a client is
+** passed on to every other member of the same room. A client can switch
+** rooms by sending "\join <room>" and leaves by sending "\quit" (or by
+** closing the connection).
+**
+** Messages travel in length-prefixed frames (see chatframe.h). Each
+** message is framed and copied into memory once. All recipients share that
+** one buffer through a reference count, and each client just keeps a queue
+** of pointers to the messages it still has to be sent, so broadcasting to
+** a big room doesn't make a copy per member.
+**
+** When started with "-l <dir>", chat messages are also kept in a history
+** for each room (see chatlog.h) and sent as FRAME_EVENTs carrying their
+** sequence # in the room. A client can ask for everything after a sequence
+** # with a FRAME_HISTORY frame, and it is streamed straight from the
+** history files before any newer messages.
+**
+** This program is the server.
+*************************************************************************/
+
+// import modules
+#include <arpa/inet.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/random.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "chatframe.h"
+#include "chatlog.h"
+
+// size of buffer for building notices
+#define BUFFER_SIZE 1000
+
+// max # of messages waiting to be sent to one client. clients that fall this far behind are dropped
+#define MAX_QUEUED 256
+
+// max # of epoll events handled per loop, and messages per writev
+#define MAX_EVENTS 256
+#define MAX_IOV 64
+
+// room every client starts in
+#define DEFAULT_ROOM "lobby"
+
+// # of buckets in the session token hash table
+#define TOKEN_BUCKETS 4096
+
+// join/leave notices only go to the whole room while it has this many members or fewer,
+// otherwise thousands of clients joining at once would flood everyone with notices
+#define PRESENCE_LIMIT 32
+
+
+// a framed message to be sent to one or more clients. the frame is stored
+// once and freed when the last client it was queued for has been sent it
+typedef struct message {
+    int refs;
+
+    // 1 if the message is also in the room's history
+    int logged;
+
+    size_t length;
+    char data[];
+} message;
+
+// a chat room and the clients in it
+typedef struct room {
+    char name[32];
+    struct client* members;
+    int memberCount;
+
+    // room's history (NULL if history is off), or the next sequence # to hand out if there is none
+    chatLog* log;
+    uint64_t nextSequence;
+
+    struct room* next;
+} room;
+
+// a connected chatclient
+typedef struct client {
+    int fd;
+    char username[20];
+    room* room;
+    struct client *roomPrev, *roomNext;
+
+    // bytes received from the client that haven't been parsed into frames yet
+    frameRing inbox;
+
+    // circular queue of messages waiting to be sent, and how much of the first one is already sent
+    message* outbox[MAX_QUEUED];
+    int outHead, outCount;
+    size_t headOffset;
+
+    // 1 if epoll is watching for the socket to become writable
+    int watchingWrites;
+
+    // 1 if the client has new messages queued since the last flush
+    int dirty;
+
+    // 1 if a broadcast couldn't queue a message for the client (it's dropped once the broadcast is done)
+    int lagging;
+
+    // session token (once the client has sent a hello) and next client in its token hash bucket
+    unsigned char token[TOKEN_SIZE];
+    int hasToken;
+    struct client* tokenNext;
+
+    // 1 while history is being sent to the client, from which log and how far along.
+    // if replayStopping is set the replay ends at offset replayStop instead of the end of the log
+    int replaying, replayStopping;
+    chatLog* replayLog;
+    logCursor replay;
+    size_t replayStop;
+} client;
+
+// everything the server keeps track of
+typedef struct chatServer {
+    int listenFd, epollFd;
+
+    // clients indexed by socket fd
+    client** clients;
+    int clientCapacity, clientCount;
+
+    // fds of clients with new messages, flushed once per pass of the event loop
+    int* dirtyFds;
+    int dirtyCount;
+
+    // list of rooms, and directory their histories are kept in (NULL if history is off)
+    room* rooms;
+    char* logDir;
+
+    // clients with sessions, hashed by token
+    client* tokens[TOKEN_BUCKETS];
+} chatServer;
+
+// function prototypes (broadcast drops slow clients, and closing a client announces it to the room)
+void closeClient(chatServer* server, client* oldClient, int announceLeave);
+
+
+/*************************************************************************
+* function setNonBlocking
+* Sets the O_NONBLOCK flag on a socket
+* Params:
+*   int socketFD (socket to change)
+* Pre-conditions: Socket is open
+* Post-conditions: Socket calls return EAGAIN instead of blocking
+*************************************************************************/
+void setNonBlocking(int socketFD) {
+    fcntl(socketFD, F_SETFL, fcntl(socketFD, F_GETFL) | O_NONBLOCK);
+}
+
+
+/*************************************************************************
+* function raiseFileLimit
+* Raises the open file limit to the max allowed, since each client needs
+* its own socket
+* Returns:
+*   int new limit on open files
+* Pre-conditions: None
+* Post-conditions: Soft file limit equals hard file limit
+*************************************************************************/
+int raiseFileLimit() {
+    struct rlimit limit;
+    getrlimit(RLIMIT_NOFILE, &limit);
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+    getrlimit(RLIMIT_NOFILE, &limit);
+    return (int) limit.rlim_cur;
+}
+
+
+/*************************************************************************
+* function openListenSocket
+* Opens a non-blocking socket listening on the provided port
+* Params:
+*   char* port (port number to listen on)
+* Returns:
+*   int pointing to listening socketFD
+* Pre-conditions: Nothing else listening on port
+* Post-conditions: Socket bound and listening, or program exits on error
+*************************************************************************/
+int openListenSocket(char* port) {
+    /*
+        Used Beej's guide: https://beej.us/guide/bgnet/html/#getaddrinfoprepare-to-launch
+    */
+    struct addrinfo hints, *serverInfo;
+    int yes = 1;
+
+    // clear out hints struct and ask for a passive TCP socket
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    if (getaddrinfo(NULL, port, &hints, &serverInfo) != 0) {
+        fprintf(stderr, "chatroom: ERROR getting address for port %s\n", port);
+        exit(1);
+    }
+
+    // open socket and allow re-using the port right after a restart
+    int socketFD = socket(serverInfo->ai_family, serverInfo->ai_socktype, 0);
+    setsockopt(socketFD, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof yes);
+
+    // bind and listen, with a big backlog since lots of clients may connect at once
+    if (socketFD < 0 || bind(socketFD, serverInfo->ai_addr, serverInfo->ai_addrlen) != 0 || listen(socketFD, SOMAXCONN) != 0) {
+        fprintf(stderr, "chatroom: ERROR listening on port %s\n", port);
+        exit(1);
+    }
+    freeaddrinfo(serverInfo);
+
+    // accept without blocking, the event loop tells us when clients are waiting
+    setNonBlocking(socketFD);
+    return socketFD;
+}
+
+
+/*************************************************************************
+* function createMessage
+* Frames a payload as a message in a new shared buffer
+* Params:
+*   int type (frame type, FRAME_TEXT for notices)
+*   const char* payload (frame contents)
+*   size_t length (# of bytes in payload)
+* Returns:
+*   message* with no references yet
+* Pre-conditions: length <= FRAME_MAX_PAYLOAD
+* Post-conditions: Message must be queued for at least one client or freed
+*************************************************************************/
+message* createMessage(int type, const char* payload, size_t length) {
+    message* newMessage = malloc(sizeof(message) + FRAME_HEADER_SIZE + length);
+    newMessage->refs = 0;
+    newMessage->logged = 0;
+    newMessage->length = buildFrame(newMessage->data, type, payload, length);
+    return newMessage;
+}
+
+
+/*************************************************************************
+* function createEvent
+* Gives a chat message the next sequence # in its room and frames it as a
+* FRAME_EVENT. If the room has a history the message is added to it first,
+* and the stored frame is copied into the shared buffer. If it can't be
+* added, it goes out as sequence # 0 so clients don't count it as history.
+* Params:
+*   room* target (room the message was sent to)
+*   const char* text (message text)
+*   size_t length (# of bytes in text)
+* Returns:
+*   message* with no references yet
+* Pre-conditions: None
+* Post-conditions: Message must be queued for at least one client or freed
+*************************************************************************/
+message* createEvent(room* target, const char* text, size_t length) {
+    struct timespec now;
+    const char* stored;
+
+    // leave room in the frame for the sequence # and timestamp
+    if (length > FRAME_MAX_PAYLOAD - EVENT_HEADER_SIZE) {
+        length = FRAME_MAX_PAYLOAD - EVENT_HEADER_SIZE;
+    }
+    clock_gettime(CLOCK_REALTIME, &now);
+    uint64_t timestamp = (uint64_t) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+
+    // add to history, and copy the stored frame
+    message* newMessage = malloc(sizeof(message) + FRAME_HEADER_SIZE + EVENT_HEADER_SIZE + length);
+    newMessage->refs = 0;
+    if (target->log != NULL && (newMessage->length = appendLog(target->log, text, length, timestamp, &stored)) > 0) {
+        memcpy(newMessage->data, stored, newMessage->length);
+        newMessage->logged = 1;
+        return newMessage;
+    }
+
+    // history couldn't be written: send it as # 0, which is never in a history, so it can't
+    // move anyone's last sequence # (the room's own counter is only for rooms without history)
+    uint64_t sequence = 0;
+    if (target->log != NULL) {
+        printf("chatroom: could not add message to the history of #%s\n", target->name);
+    } else {
+        sequence = target->nextSequence++;
+    }
+    newMessage->length = buildEvent(newMessage->data, sequence, timestamp, text, length);
+    newMessage->logged = 0;
+    return newMessage;
+}
+
+
+/*************************************************************************
+* function releaseMessage
+* Drops one reference to a message, freeing it if no one else needs it
+* Params:
+*   message* oldMessage (message that a client is done with)
+* Pre-conditions: oldMessage was queued for a client
+* Post-conditions: oldMessage freed if this was the last reference
+*************************************************************************/
+void releaseMessage(message* oldMessage) {
+    oldMessage->refs--;
+    if (oldMessage->refs <= 0) {
+        free(oldMessage);
+    }
+}
+
+
+/*************************************************************************
+* function markDirty
+* Adds a client to the dirty list so it gets flushed once this pass of the
+* event loop is done
+* Params:
+*   chatServer* server (server holding the dirty list)
+*   client* recipient (client with something new to send)
+* Pre-conditions: None
+* Post-conditions: Client will be flushed on the next flush
+*************************************************************************/
+void markDirty(chatServer* server, client* recipient) {
+    if (!recipient->dirty) {
+        recipient->dirty = 1;
+        server->dirtyFds[server->dirtyCount++] = recipient->fd;
+    }
+}
+
+
+/*************************************************************************
+* function queueMessage
+* Adds a message to a client's outbox and marks the client for flushing
+* Params:
+*   chatServer* server (server holding the dirty list)
+*   client* recipient (client the message is for)
+*   message* newMessage (message to queue)
+* Returns:
+*   1 if queued, 0 if the client's outbox is full
+* Pre-conditions: None
+* Post-conditions: Message will be sent on the next flush
+*************************************************************************/
+int queueMessage(chatServer* server, client* recipient, message* newMessage) {
+    // client is too far behind, don't let its queue grow forever
+    if (recipient->outCount == MAX_QUEUED) {
+        return 0;
+    }
+
+    // add to end of circular queue and take a reference
+    recipient->outbox[(recipient->outHead + recipient->outCount) % MAX_QUEUED] = newMessage;
+    recipient->outCount++;
+    newMessage->refs++;
+
+    markDirty(server, recipient);
+    return 1;
+}
+
+
+/*************************************************************************
+* function sendHistory
+* Sends history to a client straight from the mapped log files, as much
+* as the socket will take. Messages added to the log while this is going
+* on are picked up too, so the replay ends when the client has caught up.
+* Params:
+*   client* recipient (client being sent history)
+* Returns:
+*   1 if the replay is done, 0 if the socket is full, -1 if sending failed
+* Pre-conditions: recipient->replaying is set
+* Post-conditions: Replay cursor moved past what was sent
+*************************************************************************/
+int sendHistory(client* recipient) {
+    const char* span;
+
+    while (1) {
+        // get the next stored bytes, or just the rest of the current message if the client changed rooms
+        size_t length = 0;
+        if (!recipient->replayStopping) {
+            length = readLog(recipient->replayLog, &recipient->replay, &span);
+        } else if (recipient->replay.offset < recipient->replayStop) {
+            readLog(recipient->replayLog, &recipient->replay, &span);
+            length = recipient->replayStop - recipient->replay.offset;
+        }
+
+        // caught up (or stopped), newer messages come through the outbox from here on
+        if (length == 0) {
+            recipient->replaying = recipient->replayStopping = 0;
+            return 1;
+        }
+
+        // send straight out of the mapping
+        ssize_t written = send(recipient->fd, span, length, 0);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        }
+        recipient->replay.offset += written;
+    }
+}
+
+
+/*************************************************************************
+* function flushClient
+* Sends as much of a client's outbox as the socket will take, several
+* messages per writev call, and watches for writability if some is left.
+* History being replayed goes first, unless a queued message is part way
+* sent (it has to be finished so the frames don't get mixed together).
+* Params:
+*   chatServer* server (server holding the epoll fd)
+*   client* recipient (client to send to)
+* Returns:
+*   1 if the connection is fine, 0 if it failed
+* Pre-conditions: None
+* Post-conditions: Sent messages released, EPOLLOUT set only if messages are left
+*************************************************************************/
+int flushClient(chatServer* server, client* recipient) {
+    struct iovec iov[MAX_IOV];
+
+    // keep writing until history and outbox are sent or the socket is full
+    while (recipient->replaying || recipient->outCount > 0) {
+        // send history first
+        if (recipient->replaying && recipient->headOffset == 0) {
+            int result = sendHistory(recipient);
+            if (result < 0) {
+                return 0;
+            }
+            if (result == 0 || recipient->outCount == 0) {
+                break;
+            }
+        }
+
+        // point an iovec at each queued message (skipping the part of the first already sent)
+        int count = 0;
+        while (count < recipient->outCount && count < MAX_IOV) {
+            message* queued = recipient->outbox[(recipient->outHead + count) % MAX_QUEUED];
+            size_t skip = count == 0 ? recipient->headOffset : 0;
+            iov[count].iov_base = queued->data + skip;
+            iov[count].iov_len = queued->length - skip;
+            count++;
+        }
+
+        // send them all in one call
+        ssize_t written = writev(recipient->fd, iov, count);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            return 0;
+        }
+
+        // release messages that went out completely, remember how far into the next one we got
+        size_t left = written;
+        while (left > 0) {
+            message* queued = recipient->outbox[recipient->outHead];
+            size_t remaining = queued->length - recipient->headOffset;
+            if (left < remaining) {
+                recipient->headOffset += left;
+                break;
+            }
+            left -= remaining;
+            releaseMessage(queued);
+            recipient->outHead = (recipient->outHead + 1) % MAX_QUEUED;
+            recipient->outCount--;
+            recipient->headOffset = 0;
+        }
+    }
+
+    // only ask epoll about writability while there is something left to write
+    int wantWrites = recipient->outCount > 0 || recipient->replaying;
+    if (wantWrites != recipient->watchingWrites) {
+        struct epoll_event event;
+        event.events = EPOLLIN | (wantWrites ? EPOLLOUT : 0);
+        event.data.fd = recipient->fd;
+        epoll_ctl(server->epollFd, EPOLL_CTL_MOD, recipient->fd, &event);
+        recipient->watchingWrites = wantWrites;
+    }
+    return 1;
+}
+
+
+/*************************************************************************
+* function findRoom
+* Finds a room by name, creating it if it doesn't exist yet
+* Params:
+*   chatServer* server (server holding the room list)
+*   const char* name (room name)
+* Returns:
+*   room* with that name
+* Pre-conditions: None
+* Post-conditions: Room exists
+*************************************************************************/
+room* findRoom(chatServer* server, const char* name) {
+    // look for an existing room
+    for (room* current = server->rooms; current != NULL; current = current->next) {
+        if (strcmp(current->name, name) == 0) {
+            return current;
+        }
+    }
+
+    // not found, add a new empty room to the list
+    room* newRoom = calloc(1, sizeof(room));
+    strncpy(newRoom->name, name, sizeof(newRoom->name) - 1);
+    newRoom->nextSequence = 1;
+    newRoom->next = server->rooms;
+    server->rooms = newRoom;
+
+    // open the room's history (picking up where it left off if the server has run before)
+    if (server->logDir != NULL) {
+        char path[LOG_PATH_SIZE];
+        snprintf(path, LOG_PATH_SIZE, "%s/%s", server->logDir, newRoom->name);
+        newRoom->log = malloc(sizeof(chatLog));
+        if (openLog(newRoom->log, path) != 0) {
+            printf("chatroom: ERROR opening history for #%s, it won't be kept\n", newRoom->name);
+            free(newRoom->log);
+            newRoom->log = NULL;
+        }
+    }
+    return newRoom;
+}
+
+
+/*************************************************************************
+* function validRoomName
+* Checks that a room name is short enough and only has letters, numbers,
+* '-' and '_' (the name is also the room's history directory)
+* Params:
+*   const char* name (name to check)
+* Returns:
+*   1 if the name is valid, 0 if not
+* Pre-conditions: None
+* Post-conditions: None
+*************************************************************************/
+int validRoomName(const char* name) {
+    size_t length = strlen(name);
+    if (length == 0 || length >= sizeof(((room*) 0)->name)) {
+        return 0;
+    }
+    for (size_t i = 0; i < length; i++) {
+        if (!isalnum((unsigned char) name[i]) && name[i] != '-' && name[i] != '_') {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+
+/*************************************************************************
+* function broadcast
+* Sends a message to every member of a room except the sender. The message
+* is created once and shared by every recipient. Members being sent the
+* room's history skip messages that are in it, since the replay will get
+* to them.
+* Params:
+*   chatServer* server (server holding the clients)
+*   room* target (room to send to)
+*   client* sender (client to skip, or NULL to send to everyone)
+*   message* newMessage (message with no references yet)
+* Pre-conditions: None
+* Post-conditions: Message queued for every other member of the room
+*************************************************************************/
+void broadcast(chatServer* server, room* target, client* sender, message* newMessage) {
+    // hold a reference while queueing so the message can't be freed part way through
+    newMessage->refs++;
+
+    // queue for each member. members that are too far behind are marked and dropped
+    // afterwards (not during the loop, since closing a client changes the member list)
+    int slowCount = 0;
+    for (client* member = target->members; member != NULL; member = member->roomNext) {
+        if (member == sender || (newMessage->logged && member->replaying && !member->replayStopping && member->replayLog == target->log)) {
+            continue;
+        }
+        if (!queueMessage(server, member, newMessage)) {
+            member->lagging = 1;
+            slowCount++;
+        }
+    }
+
+    // drop our reference (frees the message if nobody was in the room)
+    releaseMessage(newMessage);
+
+    // disconnect every client that couldn't keep up. no leave notice here, since that
+    // would be another broadcast that could drop clients that are still marked
+    client* member = target->members;
+    while (slowCount > 0 && member != NULL) {
+        client* next = member->roomNext;
+        if (member->lagging) {
+            printf("chatroom: dropping %s, too many messages waiting\n", member->username);
+            closeClient(server, member, 0);
+            slowCount--;
+        }
+        member = next;
+    }
+}
+
+
+/*************************************************************************
+* function announce
+* Broadcasts a "chatroom> ..." notice to a room
+* Params:
+*   chatServer* server (server holding the clients)
+*   room* target (room to send to)
+*   client* skip (client not to send to, or NULL)
+*   const char* notice (text of the notice)
+* Pre-conditions: None
+* Post-conditions: Notice queued for members of the room
+*************************************************************************/
+void announce(chatServer* server, room* target, client* skip, const char* notice) {
+    char buffer[BUFFER_SIZE];
+    int length = snprintf(buffer, BUFFER_SIZE, "chatroom> %s", notice);
+    broadcast(server, target, skip, createMessage(FRAME_TEXT, buffer, length < BUFFER_SIZE ? length : BUFFER_SIZE - 1));
+}
+
+
+/*************************************************************************
+* function sendFrame
+* Sends a frame to a single client
+* Params:
+*   chatServer* server (server holding the clients)
+*   client* recipient (client to send to)
+*   int type (frame type)
+*   const char* payload (frame contents)
+*   size_t length (# of bytes in payload)
+* Pre-conditions: length <= FRAME_MAX_PAYLOAD
+* Post-conditions: Frame queued for recipient (unless its outbox is full)
+*************************************************************************/
+void sendFrame(chatServer* server, client* recipient, int type, const char* payload, size_t length) {
+    message* newMessage = createMessage(type, payload, length);
+    if (!queueMessage(server, recipient, newMessage)) {
+        free(newMessage);
+    }
+}
+
+
+/*************************************************************************
+* function sendNotice
+* Sends a "chatroom> ..." notice to a single client
+* Params:
+*   chatServer* server (server holding the clients)
+*   client* recipient (client to send to)
+*   const char* notice (text of the notice)
+* Pre-conditions: None
+* Post-conditions: Notice queued for recipient (unless its outbox is full)
+*************************************************************************/
+void sendNotice(chatServer* server, client* recipient, const char* notice) {
+    char buffer[BUFFER_SIZE];
+    int length = snprintf(buffer, BUFFER_SIZE, "chatroom> %s", notice);
+    sendFrame(server, recipient, FRAME_TEXT, buffer, length < BUFFER_SIZE ? length : BUFFER_SIZE - 1);
+}
+
+
+/*************************************************************************
+* function sendWelcome
+* Tells a client its session token, the room it is in, and the newest
+* sequence # in that room
+* Params:
+*   chatServer* server (server holding the clients)
+*   client* recipient (client to send to)
+* Pre-conditions: Client is in a room
+* Post-conditions: FRAME_WELCOME queued for recipient
+*************************************************************************/
+void sendWelcome(chatServer* server, client* recipient) {
+    char payload[TOKEN_SIZE + 8 + sizeof(((room*) 0)->name)];
+    room* current = recipient->room;
+
+    // token, then newest sequence #, then room name
+    memcpy(payload, recipient->token, TOKEN_SIZE);
+    putNumber(&payload[TOKEN_SIZE], (current->log != NULL ? current->log->nextSequence : current->nextSequence) - 1);
+    size_t nameLength = strlen(current->name);
+    memcpy(&payload[TOKEN_SIZE + 8], current->name, nameLength);
+    sendFrame(server, recipient, FRAME_WELCOME, payload, TOKEN_SIZE + 8 + nameLength);
+}
+
+
+/*************************************************************************
+* function leaveRoom
+* Removes a client from its current room
+* Params:
+*   client* member (client leaving)
+* Pre-conditions: None
+* Post-conditions: Client is in no room
+*************************************************************************/
+void leaveRoom(client* member) {
+    room* current = member->room;
+    if (current == NULL) {
+        return;
+    }
+
+    // unlink from member list
+    if (member->roomPrev) member->roomPrev->roomNext = member->roomNext;
+    else current->members = member->roomNext;
+    if (member->roomNext) member->roomNext->roomPrev = member->roomPrev;
+
+    // update room and client
+    current->memberCount--;
+    member->room = NULL;
+    member->roomPrev = member->roomNext = NULL;
+}
+
+
+/*************************************************************************
+* function joinRoom
+* Moves a client into a room and tells the room about it
+* Params:
+*   chatServer* server (server holding the rooms)
+*   client* member (client joining)
+*   const char* name (name of room to join)
+* Pre-conditions: None
+* Post-conditions: Client is a member of the room
+*************************************************************************/
+void joinRoom(chatServer* server, client* member, const char* name) {
+    char notice[BUFFER_SIZE];
+    int memberFD = member->fd;
+
+    // stop sending the old room's history, finishing any message that is part way sent
+    if (member->replaying && !member->replayStopping) {
+        member->replayStopping = 1;
+        member->replayStop = logFrameEnd(member->replayLog, &member->replay);
+    }
+
+    // tell old room the client left (if it's small enough for notices)
+    room* oldRoom = member->room;
+    if (oldRoom != NULL) {
+        leaveRoom(member);
+        snprintf(notice, BUFFER_SIZE, "%s left #%s", member->username, oldRoom->name);
+        if (oldRoom->memberCount <= PRESENCE_LIMIT) {
+            announce(server, oldRoom, NULL, notice);
+        }
+    }
+
+    // add to front of new room's member list
+    room* newRoom = findRoom(server, name);
+    member->room = newRoom;
+    member->roomPrev = NULL;
+    member->roomNext = newRoom->members;
+    if (newRoom->members) newRoom->members->roomPrev = member;
+    newRoom->members = member;
+    newRoom->memberCount++;
+
+    // tell everyone in the room (including the new member) who joined, or just the new member if the room is big
+    snprintf(notice, BUFFER_SIZE, "%s joined #%s (%d online)", member->username, newRoom->name, newRoom->memberCount);
+    if (newRoom->memberCount <= PRESENCE_LIMIT) {
+        announce(server, newRoom, NULL, notice);
+    } else {
+        sendNotice(server, member, notice);
+    }
+
+    // tell the member where its room's sequence #s are up to (unless the notice above dropped it)
+    if (server->clients[memberFD] == member) {
+        sendWelcome(server, member);
+    }
+}
+
+
+/*************************************************************************
+* function tokenBucket
+* Gets the hash table bucket for a session token
+* Params:
+*   chatServer* server (server holding the table)
+*   const unsigned char* token (session token)
+* Returns:
+*   client** head of the bucket's list
+* Pre-conditions: None
+* Post-conditions: None
+*************************************************************************/
+client** tokenBucket(chatServer* server, const unsigned char* token) {
+    // tokens are random, so the first bytes are as good a hash as any
+    return &server->tokens[(token[0] | token[1] << 8) % TOKEN_BUCKETS];
+}
+
+
+/*************************************************************************
+* function findSession
+* Finds the connected client that has a session token
+* Params:
+*   chatServer* server (server holding the table)
+*   const unsigned char* token (session token)
+* Returns:
+*   client* with that token, or NULL if none
+* Pre-conditions: None
+* Post-conditions: None
+*************************************************************************/
+client* findSession(chatServer* server, const unsigned char* token) {
+    for (client* current = *tokenBucket(server, token); current != NULL; current = current->tokenNext) {
+        if (memcmp(current->token, token, TOKEN_SIZE) == 0) {
+            return current;
+        }
+    }
+    return NULL;
+}
+
+
+/*************************************************************************
+* function removeSession
+* Takes a client out of the token hash table
+* Params:
+*   chatServer* server (server holding the table)
+*   client* oldClient (client to remove)
+* Pre-conditions: None
+* Post-conditions: Client can't be found by its token
+*************************************************************************/
+void removeSession(chatServer* server, client* oldClient) {
+    if (!oldClient->hasToken) {
+        return;
+    }
+    client** link = tokenBucket(server, oldClient->token);
+    while (*link != NULL && *link != oldClient) {
+        link = &(*link)->tokenNext;
+    }
+    if (*link != NULL) {
+        *link = oldClient->tokenNext;
+    }
+    oldClient->hasToken = 0;
+}
+
+
+/*************************************************************************
+* function closeClient
+* Disconnects a client, dropping anything still waiting to be sent to it
+* Params:
+*   chatServer* server (server holding the clients)
+*   client* oldClient (client to disconnect)
+*   int announceLeave (1 to tell the room the client left)
+* Pre-conditions: Client is connected
+* Post-conditions: Socket closed and client freed
+*************************************************************************/
+void closeClient(chatServer* server, client* oldClient, int announceLeave) {
+    char notice[BUFFER_SIZE];
+    room* oldRoom = oldClient->room;
+
+    // print update to terminal, save leave notice, and remove from room
+    printf("chatroom: %s disconnected\n", oldClient->username);
+    snprintf(notice, BUFFER_SIZE, "%s left #%s", oldClient->username, oldRoom != NULL ? oldRoom->name : "");
+    leaveRoom(oldClient);
+    removeSession(server, oldClient);
+
+    // release every message still queued for the client
+    while (oldClient->outCount > 0) {
+        releaseMessage(oldClient->outbox[oldClient->outHead]);
+        oldClient->outHead = (oldClient->outHead + 1) % MAX_QUEUED;
+        oldClient->outCount--;
+    }
+
+    // close socket (which also removes it from epoll) and free client
+    server->clients[oldClient->fd] = NULL;
+    server->clientCount--;
+    close(oldClient->fd);
+    free(oldClient);
+
+    // let the rest of the room know
+    if (announceLeave && oldRoom != NULL && oldRoom->memberCount > 0 && oldRoom->memberCount <= PRESENCE_LIMIT) {
+        announce(server, oldRoom, NULL, notice);
+    }
+}
+
+
+/*************************************************************************
+* function acceptClients
+* Accepts every client waiting on the listen socket
+* Params:
+*   chatServer* server (server holding the listen socket)
+* Pre-conditions: epoll reported the listen socket as readable
+* Post-conditions: New clients registered with epoll
+*************************************************************************/
+void acceptClients(chatServer* server) {
+    while (1) {
+        // accept next client, stop when there are none left
+        int clientFD = accept(server->listenFd, NULL, NULL);
+        if (clientFD < 0) {
+            return;
+        }
+
+        // make room in the fd table if needed
+        if (clientFD >= server->clientCapacity) {
+            int newCapacity = server->clientCapacity * 2;
+            while (clientFD >= newCapacity) {
+                newCapacity *= 2;
+            }
+            server->clients = realloc(server->clients, newCapacity * sizeof(client*));
+            server->dirtyFds = realloc(server->dirtyFds, newCapacity * sizeof(int));
+            memset(&server->clients[server->clientCapacity], 0, (newCapacity - server->clientCapacity) * sizeof(client*));
+            server->clientCapacity = newCapacity;
+        }
+
+        // create client. the username (and room) aren't known until it sends its hello or first message
+        client* newClient = calloc(1, sizeof(client));
+        newClient->fd = clientFD;
+        strcpy(newClient->username, "anonymous");
+        server->clients[clientFD] = newClient;
+        server->clientCount++;
+
+        // send messages right away instead of letting Nagle hold small ones back
+        // for the client's delayed ACK (which added ~40ms to deliveries under load)
+        int yes = 1;
+        setsockopt(clientFD, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof yes);
+
+        // watch for messages from the client
+        setNonBlocking(clientFD);
+        struct epoll_event event;
+        event.events = EPOLLIN;
+        event.data.fd = clientFD;
+        epoll_ctl(server->epollFd, EPOLL_CTL_ADD, clientFD, &event);
+    }
+}
+
+
+/*************************************************************************
+* function handleMessage
+* Handles one message from a client. Messages look like "username> text".
+* "\join <room>" switches rooms, "\quit" disconnects, and anything else is
+* passed on to the rest of the room unchanged. A client that never sent a
+* hello joins the default room with its first message.
+* Params:
+*   chatServer* server (server holding the clients)
+*   client* sender (client that sent the message)
+*   char* buffer (null-terminated message)
+*   size_t length (# of bytes in message)
+* Pre-conditions: Message read from sender
+* Post-conditions: Message handled
+*************************************************************************/
+void handleMessage(chatServer* server, client* sender, char* buffer, size_t length) {
+    // split "username> text" to get the username and text
+    char* text = strstr(buffer, "> ");
+    if (text != NULL) {
+        size_t nameLength = text - buffer;
+        if (nameLength > 0 && nameLength < sizeof(sender->username) && strncmp(sender->username, buffer, nameLength) != 0) {
+            memset(sender->username, '\0', sizeof(sender->username));
+            strncpy(sender->username, buffer, nameLength);
+        }
+        text += 2;
+    } else {
+        text = buffer;
+    }
+
+    // client without a hello is put in the default room now that its name is known (unless it's joining another or quitting)
+    int joining = strncmp(text, "\\join ", 6) == 0 && validRoomName(text + 6);
+    if (sender->room == NULL && !joining && strcmp(text, "\\quit") != 0) {
+        int senderFD = sender->fd;
+        joinRoom(server, sender, DEFAULT_ROOM);
+        if (server->clients[senderFD] != sender) {
+            return;
+        }
+    }
+
+    // handle commands, or pass message on to the room
+    if (strcmp(text, "\\quit") == 0) {
+        closeClient(server, sender, 1);
+    } else if (strncmp(text, "\\join ", 6) == 0 && !validRoomName(text + 6)) {
+        sendNotice(server, sender, "room names can only have letters, numbers, '-' and '_' (31 chars max)");
+    } else if (strncmp(text, "\\join ", 6) == 0) {
+        joinRoom(server, sender, text + 6);
+    } else if (sender->room != NULL) {
+        message* event = createEvent(sender->room, buffer, length);
+        char ack[8];
+        memcpy(ack, &event->data[FRAME_HEADER_SIZE], sizeof ack);
+        broadcast(server, sender->room, sender, event);
+
+        // confirm the sequence # to clients with sessions, so they know they have it
+        // and don't ask for it again after reconnecting (# 0 wasn't stored, nothing to confirm)
+        if (sender->hasToken && getNumber(ack) != 0) {
+            sendFrame(server, sender, FRAME_ACK, ack, sizeof ack);
+        }
+    }
+}
+
+
+/*************************************************************************
+* function startReplay
+* Starts sending a client every message in its room's history after the
+* sequence # it asked for
+* Params:
+*   chatServer* server (server holding the dirty list)
+*   client* requester (client that sent a FRAME_HISTORY)
+*   uint64_t afterSequence (last sequence # the client already has)
+* Pre-conditions: None
+* Post-conditions: Replay starts on the next flush
+*************************************************************************/
+void startReplay(chatServer* server, client* requester, uint64_t afterSequence) {
+    room* current = requester->room;
+    if (current == NULL || current->log == NULL) {
+        sendNotice(server, requester, "history is not being kept");
+        return;
+    }
+
+    // one replay at a time (the last one may still be finishing a message)
+    if (requester->replaying) {
+        sendNotice(server, requester, "history is already being sent");
+        return;
+    }
+
+    // find where to start and let the flush take it from there
+    requester->replaying = 1;
+    requester->replayLog = current->log;
+    requester->replay = findLog(current->log, afterSequence);
+    markDirty(server, requester);
+}
+
+
+/*************************************************************************
+* function handleHello
+* Starts or resumes a client's session. A new client is given a token. A
+* client coming back with a token it was given before (whether or not
+* the server has restarted since) takes over from any connection still
+* open with that token, is put back in the room it names, and is sent the
+* room's messages after the last sequence # it has.
+* Params:
+*   chatServer* server (server holding the clients)
+*   client* sender (client that sent the hello)
+*   char* payload (token, last sequence #, then "username room")
+*   size_t length (# of bytes in payload)
+* Pre-conditions: payload is null terminated
+* Post-conditions: Client has a session and has been sent a welcome
+*************************************************************************/
+void handleHello(chatServer* server, client* sender, char* payload, size_t length) {
+    static const unsigned char noToken[TOKEN_SIZE];
+    if (length < TOKEN_SIZE + 8 || sender->hasToken) {
+        return;
+    }
+    uint64_t lastSequence = getNumber(&payload[TOKEN_SIZE]);
+
+    // get username and room from "username room"
+    char* username = &payload[TOKEN_SIZE + 8];
+    char* roomName = strchr(username, ' ');
+    if (roomName != NULL) {
+        *roomName++ = '\0';
+    }
+    if (*username != '\0' && strlen(username) < sizeof(sender->username)) {
+        memset(sender->username, '\0', sizeof(sender->username));
+        strcpy(sender->username, username);
+    }
+
+    // new session gets a fresh token, a returning one takes over from its old connection
+    int resuming = memcmp(payload, noToken, TOKEN_SIZE) != 0;
+    if (resuming) {
+        memcpy(sender->token, payload, TOKEN_SIZE);
+        client* oldConnection = findSession(server, sender->token);
+        if (oldConnection != NULL) {
+            printf("chatroom: %s reconnected, closing old connection\n", sender->username);
+            closeClient(server, oldConnection, 0);
+        }
+    } else if (getrandom(sender->token, TOKEN_SIZE, 0) != TOKEN_SIZE) {
+        return;
+    }
+    client** bucket = tokenBucket(server, sender->token);
+    sender->tokenNext = *bucket;
+    *bucket = sender;
+    sender->hasToken = 1;
+
+    // put the client in the room it names (the default room if none), or just confirm the one it's in
+    int senderFD = sender->fd;
+    if (roomName != NULL && validRoomName(roomName) && (sender->room == NULL || strcmp(sender->room->name, roomName) != 0)) {
+        joinRoom(server, sender, roomName);
+    } else if (sender->room == NULL) {
+        joinRoom(server, sender, DEFAULT_ROOM);
+    } else {
+        sendWelcome(server, sender);
+    }
+
+    // send what it missed while it was away
+    if (resuming && server->clients[senderFD] == sender && sender->room != NULL && sender->room->log != NULL
+        && lastSequence + 1 < sender->room->log->nextSequence) {
+        startReplay(server, sender, lastSequence);
+    }
+}
+
+
+/*************************************************************************
+* function readClient
+* Reads what a client sent into its ring buffer and handles every complete
+* frame in it. A read can hold several frames, or just part of one, in
+* which case the rest is handled after a later read.
+* Params:
+*   chatServer* server (server holding the clients)
+*   client* sender (client with data waiting)
+* Pre-conditions: epoll reported the client socket as readable
+* Post-conditions: Frames handled, or client closed if it hung up or sent a bad frame
+*************************************************************************/
+void readClient(chatServer* server, client* sender) {
+    char payload[FRAME_MAX_PAYLOAD + 1];
+    size_t length;
+    int type, result;
+
+    // read what the client sent
+    ssize_t charsRead = ringFill(&sender->inbox, sender->fd);
+    if (charsRead < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+        return;
+    }
+
+    // 0 bytes or an error means the client is gone
+    if (charsRead <= 0) {
+        closeClient(server, sender, 1);
+        return;
+    }
+
+    // handle each complete frame, stopping if the client quits along the way
+    int senderFD = sender->fd;
+    while ((result = ringNextFrame(&sender->inbox, &type, payload, &length)) == 1) {
+        if (type == FRAME_TEXT) {
+            handleMessage(server, sender, payload, length);
+        } else if (type == FRAME_HISTORY && length == 8) {
+            startReplay(server, sender, getNumber(payload));
+        } else if (type == FRAME_HELLO) {
+            handleHello(server, sender, payload, length);
+        }
+        if (server->clients[senderFD] != sender) {
+            return;
+        }
+    }
+
+    // frame too big, client isn't speaking the protocol
+    if (result < 0) {
+        printf("chatroom: bad frame from %s\n", sender->username);
+        closeClient(server, sender, 1);
+    }
+}
+
+
+/*************************************************************************
+* function flushDirtyClients
+* Sends queued messages to every client that got new ones during this pass
+* of the event loop. Doing this once per pass lets several broadcasts to
+* the same client go out in one writev.
+* Params:
+*   chatServer* server (server holding the dirty list)
+* Pre-conditions: None
+* Post-conditions: Dirty list empty
+*************************************************************************/
+void flushDirtyClients(chatServer* server) {
+    for (int i = 0; i < server->dirtyCount; i++) {
+        // client may have been closed (or the fd reused) since it was marked
+        client* recipient = server->clients[server->dirtyFds[i]];
+        if (recipient == NULL || !recipient->dirty) {
+            continue;
+        }
+        recipient->dirty = 0;
+        if (!flushClient(server, recipient)) {
+            closeClient(server, recipient, 1);
+        }
+    }
+    server->dirtyCount = 0;
+}
+
+
+/*************************************************************************
+* main method
+* Opens a listening socket on the port passed as a runtime argument, then
+* runs the event loop forever: accepting clients, reading their messages,
+* and sending each message to the rest of the sender's room. With
+* "-l <dir>", each room's history is kept in <dir>/<room>.
+*************************************************************************/
+int main(int argc, char* argv[]) {
+    char* logDir = NULL;
+    int option;
+
+    // read options
+    while ((option = getopt(argc, argv, "l:")) != -1) {
+        if (option == 'l') {
+            logDir = optarg;
+        } else {
+            printf("USAGE: chatroom [-l HISTORY_DIR] <port>\n");
+            exit(1);
+        }
+    }
+
+    // if arg count is wrong, display message showing correct usage to user
+    if (argc - optind != 1) {
+        printf("USAGE: chatroom [-l HISTORY_DIR] <port>\n");
+        exit(1);
+    }
+    char* port = argv[optind];
+
+    // make history directory
+    if (logDir != NULL && mkdir(logDir, 0755) != 0 && errno != EEXIST) {
+        fprintf(stderr, "chatroom: ERROR creating history directory %s\n", logDir);
+        exit(1);
+    }
+
+    // a client hanging up while we write to it shouldn't kill the server
+    signal(SIGPIPE, SIG_IGN);
+
+    // set up server state
+    chatServer server;
+    memset(&server, 0, sizeof(server));
+    server.clientCapacity = 1024;
+    server.clients = calloc(server.clientCapacity, sizeof(client*));
+    server.dirtyFds = calloc(server.clientCapacity, sizeof(int));
+    server.logDir = logDir;
+
+    // open listening socket and add it to epoll
+    int fileLimit = raiseFileLimit();
+    server.listenFd = openListenSocket(port);
+    server.epollFd = epoll_create1(0);
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.fd = server.listenFd;
+    epoll_ctl(server.epollFd, EPOLL_CTL_ADD, server.listenFd, &event);
+
+    // print update to terminal
+    printf("chatroom: listening on port %s (up to %d clients)...\n", port, fileLimit - 8);
+    fflush(stdout);
+
+    // loop forever (until SIGINT)
+    struct epoll_event events[MAX_EVENTS];
+    while (1) {
+        // wait for sockets to become ready
+        int ready = epoll_wait(server.epollFd, events, MAX_EVENTS, -1);
+
+        for (int i = 0; i < ready; i++) {
+            int fd = events[i].data.fd;
+
+            // new clients waiting
+            if (fd == server.listenFd) {
+                acceptClients(&server);
+                continue;
+            }
+
+            // client may have been closed earlier in this pass
+            client* current = server.clients[fd];
+            if (current == NULL) {
+                continue;
+            }
+
+            // socket writable again, send what's queued
+            if ((events[i].events & EPOLLOUT) && !flushClient(&server, current)) {
+                closeClient(&server, current, 1);
+                continue;
+            }
+
+            // message waiting (or hangup, which recv reports as 0 bytes)
+            if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                readClient(&server, current);
+            }
+        }
+
+        // send everything queued during this pass
+        flushDirtyClients(&server);
+        fflush(stdout);
+    }
+
+    // this line should never be run
+    close(server.listenFd);
+    return 0;
+}
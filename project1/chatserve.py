@@ -23,10 +23,15 @@
 # Much of this code has been adapted from the socket programming lecture:
 # https://oregonstate.instructure.com/courses/1771948/files/76024149/download?wrap=1
 
+import struct
 import sys
 from socket import socket, AF_INET, SOCK_STREAM, SOL_SOCKET, SO_REUSEADDR
 from termios import tcflush, TCIOFLUSH
 
+# frame header (see chatframe.h): 4 byte big endian payload length + 1 byte type
+FRAME_HEADER = struct.Struct('!IB')
+FRAME_TEXT = 1
+
 def openSocket(portNumber):
     """
     Opens a socket at the provided port number and listens for an incoming connection
@@ -74,10 +79,29 @@ def sendMessage(chatSocket, message):
         active socket connection
         message to send to client
     Pre-conditions: Socket must have an active connection at specified port
-    Post-conditions: Message will be sent to client at specified socket
+    Post-conditions: Message will be sent to client at specified socket as one frame
+    """
+    # encode message from string to bytes and send it to client after a frame header
+    payload = message.encode('utf-8')
+    chatSocket.sendall(FRAME_HEADER.pack(len(payload), FRAME_TEXT) + payload)
+
+
+def receiveExactly(chatSocket, size):
+    """
+    Reads exactly size bytes from the provided socket
+    Params:
+        active socket connection
+        number of bytes to read
+    Returns:
+        bytes read, or fewer if the client closed the connection
     """
-    # encode message from string to bytes and send to client
-    chatSocket.send(message.encode('utf-8'))
+    data = b''
+    while len(data) < size:
+        chunk = chatSocket.recv(size - len(data))
+        if not chunk:
+            break
+        data += chunk
+    return data
 
 
 def receiveMessage(chatSocket):
@@ -91,8 +115,18 @@ def receiveMessage(chatSocket):
                     If no message, program should halt until one comes in.
     Post-conditions: Message will be read by the server
     """
-    # read message from socket and decode from bytes to string
-    return chatSocket.recv(1024).decode('utf-8')
+    # read a frame header, then its payload, and decode payload from bytes to string
+    # (other frame types, like history requests, mean nothing to chatserve and are skipped)
+    frameType = None
+    while frameType != FRAME_TEXT:
+        header = receiveExactly(chatSocket, FRAME_HEADER.size)
+        if len(header) < FRAME_HEADER.size:
+            return ''
+        length, frameType = FRAME_HEADER.unpack(header)
+        payload = receiveExactly(chatSocket, length)
+        if len(payload) < length:
+            return ''
+    return payload.decode('utf-8')
 
 
 def getInput(query):
@@ -34,12 +34,16 @@
 # https://oregonstate.instructure.com/courses/1771948/files/76024149/download?wrap=1
 
 # import necessary modules
+import hashlib
 import os
 import sys
 from socket import socket, AF_INET, SOCK_STREAM, SOL_SOCKET, SO_REUSEADDR
 from termios import tcflush, TCIOFLUSH
 from urllib.parse import urlparse
 
+# folder where chunks received with '-c' are kept so later transfers can skip them
+CHUNK_FOLDER = '.ftchunks'
+
 def get_open_socket():
     """
     Opens a socket and sets socket options
@@ -185,6 +189,9 @@ def invalid_input(error, bad_input = None):
         print("Accepted inputs:")
         print("list: ./ftclient <SERVER_HOST> <SERVER_PORT> -l <DATA_PORT>")
         print("get: ./ftclient <SERVER_HOST> <SERVER_PORT> -g <FILENAME> <DATA_PORT>")
+        print("chunked get: ./ftclient <SERVER_HOST> <SERVER_PORT> -c <FILENAME> <DATA_PORT>")
+        print("search: ./ftclient <SERVER_HOST> <SERVER_PORT> -s <TERM> <DATA_PORT>")
+        print("watch: ./ftclient <SERVER_HOST> <SERVER_PORT> -w <DATA_PORT>")
     elif error == 'hostname':
         # if error was invalid hostname, print valid hostnames
         print(f"{bad_input} is not a valid host. Must be one of 'flip1', 'flip2', or 'flip3'.")
@@ -196,6 +203,9 @@ def invalid_input(error, bad_input = None):
         print("Correct usage:")
         print("list: ./ftclient <SERVER_HOST> <SERVER_PORT> -l <DATA_PORT>")
         print("get: ./ftclient <SERVER_HOST> <SERVER_PORT> -g <FILENAME> <DATA_PORT>")
+        print("chunked get: ./ftclient <SERVER_HOST> <SERVER_PORT> -c <FILENAME> <DATA_PORT>")
+        print("search: ./ftclient <SERVER_HOST> <SERVER_PORT> -s <TERM> <DATA_PORT>")
+        print("watch: ./ftclient <SERVER_HOST> <SERVER_PORT> -w <DATA_PORT>")
 
 
 def check_arguments(arguments):
@@ -210,8 +220,8 @@ def check_arguments(arguments):
     """
     # must be b args or 6
     if len(arguments) == 5 or len(arguments) == 6:
-        # if command == '-g' and 6 args OR if command == '-l' and 5 args, # of args is valid
-        if (arguments[3] == '-g' and len(arguments) == 6) or (arguments[3] == '-l' and len(arguments) == 5):
+        # if command == '-g', '-c', or '-s' and 6 args OR if command == '-l' or '-w' and 5 args, # of args is valid
+        if (arguments[3] in ('-g', '-c', '-s') and len(arguments) == 6) or (arguments[3] in ('-l', '-w') and len(arguments) == 5):
             # check remaining arguments for validity
             return validate_inputs(arguments)
 
@@ -235,13 +245,13 @@ def validate_inputs(arguments):
     port = int(arguments[2])
     command = arguments[3]
 
-    # if 6 total args, '-g' is the command and filename is an arg
+    # if 6 total args, '-g', '-c', or '-s' is the command and filename (or search term) is an arg
     if len(arguments) == 6:
         # get file and data_port args
         file = arguments[4]
         data_port = int(arguments[5])
     else:
-        # '-l' is the command so no file
+        # '-l' or '-w' is the command so no file
         # get data_port arg and set file to None
         data_port = int(arguments[4])
         file = None
@@ -270,6 +280,111 @@ def validate_inputs(arguments):
     return None
 
 
+def get_unused_name(filename):
+    """
+    Finds a name to save a file under without overwriting anything, by adding a counter to the name
+    Params:
+        filename (name of file to be saved)
+    Returns:
+        filename if it is unused, otherwise filename with '_<counter>' added before the extension
+    Pre-conditions: Client needs to save a file
+    Post-conditions: None
+    """
+    # use counter to find unused name
+    counter = 0
+
+    # copy filename to test_name
+    test_name = filename
+    # while the file exists
+    while os.path.isfile('./' + test_name):
+        # increment counter by 1
+        counter += 1
+        # if file has ".txt" extension, remove extension before adding counter
+        if filename.endswith(".txt"):
+            # splice last 4 chars (".txt") from filename
+            name = filename[:-4]
+
+            # increment counter in test_name and see if file with new name already exists
+            test_name = name + '_' + str(counter) + ".txt"
+        else:
+            # increment counter in test_name and see if file with new name already exists
+            test_name = filename + '_' + str(counter)
+
+    # return unused name
+    return test_name
+
+
+def receive_chunks(open_socket, request):
+    """
+    Receives a file from a server running with a chunk store. Reads the file's chunk list,
+    asks only for chunks that aren't already in CHUNK_FOLDER, then rebuilds the file from chunks.
+    Params:
+        open_socket (connected data socket)
+        request (request object from runtime arguments)
+    Returns:
+        name of newly saved file
+    Pre-conditions: Client sent '-c' command and server connected to data port
+    Post-conditions: New chunks saved to CHUNK_FOLDER and file saved to directory
+    """
+    # print update to terminal
+    print("Receiving chunks of \"{}\" from {}:{}".format(request['file'], request['hostname'], request['data_port']))
+
+    # read chunk list ("chunks", then "<hash> <size>" lines) until the blank line that ends it
+    data = b''
+    while b'\n\n' not in data:
+        segment = open_socket.recv(1024)
+        if len(segment) == 0:
+            break
+        data += segment
+    lines = data.split(b'\n\n', 1)[0].decode('utf-8').split('\n')
+
+    # remove 'chunks' from top of list and split remaining lines into (hash, size) pairs
+    lines.pop(0)
+    chunk_list = [(line.split(' ')[0], int(line.split(' ')[1])) for line in lines]
+
+    # figure out which chunks we don't have yet (only ask once for chunks that repeat)
+    os.makedirs(CHUNK_FOLDER, exist_ok=True)
+    needed = []
+    for chunk_hash, size in chunk_list:
+        if not os.path.isfile(os.path.join(CHUNK_FOLDER, chunk_hash)) and (chunk_hash, size) not in needed:
+            needed.append((chunk_hash, size))
+
+    # send needed hashes, one per line, then a blank line
+    request_text = ''.join(chunk_hash + '\n' for chunk_hash, size in needed) + '\n'
+    open_socket.sendall(request_text.encode('utf-8'))
+
+    # read needed chunks, which the server sends back to back in the order we asked
+    body = b''
+    total_size = sum(size for chunk_hash, size in needed)
+    while len(body) < total_size:
+        segment = open_socket.recv(65536)
+        if len(segment) == 0:
+            break
+        body += segment
+
+    # check each new chunk against its hash and save it to the chunk folder
+    offset = 0
+    for chunk_hash, size in needed:
+        chunk = body[offset:offset + size]
+        offset += size
+        if hashlib.sha256(chunk).hexdigest() != chunk_hash:
+            print("Chunk {} was corrupted in transfer.".format(chunk_hash))
+            return None
+        with open(os.path.join(CHUNK_FOLDER, chunk_hash), 'wb') as chunk_file:
+            chunk_file.write(chunk)
+
+    # rebuild the file from chunks under an unused name
+    save_name = get_unused_name(os.path.basename(request['file']))
+    with open(save_name, 'wb') as new_file:
+        for chunk_hash, size in chunk_list:
+            with open(os.path.join(CHUNK_FOLDER, chunk_hash), 'rb') as chunk_file:
+                new_file.write(chunk_file.read())
+
+    # print how many chunks were already here and return saved file name
+    print("{} of {} chunks were already saved locally.".format(len(chunk_list) - len(needed), len(chunk_list)))
+    return save_name
+
+
 def save_file(filename, lines):
     """
     Saves a string to a file using the provided filename. Renames the new file if it already exists in the destination.
@@ -299,25 +414,8 @@ def save_file(filename, lines):
         new_file.close()
         return filename
     else:
-        # file exists, use counter to find unused name
-        counter = 0
-
-        # copy filename to test_name
-        test_name = filename
-        # while the file exists
-        while os.path.isfile('./' + test_name):
-            # increment counter by 1
-            counter += 1
-            # if file has ".txt" extension, remove extension before adding counter
-            if filename.endswith(".txt"):
-                # splice last 4 chars (".txt") from filename
-                name = filename[:-4]
-
-                # increment counter in test_name and see if file with new name already exists
-                test_name = name + '_' + str(counter) + ".txt"
-            else:
-                # increment counter in test_name and see if file with new name already exists
-                test_name = filename + '_' + str(counter)
+        # file exists, find unused name
+        test_name = get_unused_name(filename)
 
         # unused file name found, create file for writing
         new_file = open(test_name, 'w')
@@ -372,6 +470,66 @@ def print_directory(directory_list, request):
         print(line)
 
 
+def print_search_results(results, request):
+    """
+    Prints the lines matching a search as passed by the server
+    Params:
+        results (list of "filename:line: snippet" strings from server)
+        request (request object from runtime arguments)
+    Returns:
+        None
+    Pre-conditions: Client received search results from server at data port
+    Post-conditions: Matching lines displayed in terminal
+    """
+    # print message to terminal
+    print("Receiving search results for \"{}\" from {}:{}".format(request['file'], request['hostname'], request['data_port']))
+
+    # drop empty line left after the last result
+    results = [line for line in results if line != '']
+
+    # print each match, or say there were none
+    if len(results) == 0:
+        print("No matches")
+    for line in results:
+        print(line)
+
+
+def watch_changes(open_socket, request):
+    """
+    Prints each directory change the server pushes until the server hangs up or the user presses Ctrl-C
+    Params:
+        open_socket (connected data socket)
+        request (request object from runtime arguments)
+    Returns:
+        None
+    Pre-conditions: Client sent '-w' command and server connected to data port
+    Post-conditions: Changes displayed in terminal as they happen
+    """
+    # print message to terminal
+    print("Watching {} for changes (Ctrl-C to stop)".format(request['hostname']))
+
+    # bytes received that don't make up a whole line yet
+    pending = b''
+
+    try:
+        while True:
+            # wait for more changes, stop if server closed the connection
+            data = open_socket.recv(1024)
+            if not data:
+                print("{} stopped sending changes".format(request['hostname']))
+                return
+
+            # print each whole line except the 'watch' header
+            pending += data
+            while b'\n' in pending:
+                line, pending = pending.split(b'\n', 1)
+                line = line.decode('utf-8', 'replace')
+                if line != 'watch':
+                    print(line, flush=True)
+    except KeyboardInterrupt:
+        return
+
+
 ####################################################################################
 #
 # MAIN METHOD
@@ -397,24 +555,50 @@ if (request != None):
     # connect to the server at the provided socket, url, and port
     client_socket = connect_client_socket(client_socket, request['url'], request['port'])
 
+    # get new socket for data transfer
+    data_socket = get_open_socket()
+
+    # listen to the data_port passed as a runtime arg. this has to happen before the command
+    # is sent, since the server connects to the data port right after it replies OK
+    data_socket = listen_data_socket(data_socket, request['data_port'])
+
     # send command to the server
     send_command(client_socket, request)
 
     # get response from server telling if command was valid
     is_valid_command = receive_data(client_socket, True).strip()
 
-    # command was valid, open data connection
+    # command was valid, accept data connection
     if is_valid_command == "OK\0":
 
-        # get new socket for data transfer
-        data_socket = get_open_socket()
-
-        # listen to the data_port passed as a runtime arg
-        data_socket = listen_data_socket(data_socket, request['data_port'])
-
         # accept connection on the data_socket
         connected_socket, address = data_socket.accept()
 
+        # chunked get is a conversation over the data socket, handle it separately
+        if request['command'] == '-c':
+            # receive chunks we don't have and rebuild the file
+            save_name = receive_chunks(connected_socket, request)
+
+            # print success message if file was rebuilt
+            if save_name != None:
+                print("File transfer complete. File saved as {}.".format(save_name))
+
+            # close data connection and socket, then exit
+            close_connection(data_socket)
+            close_connection(client_socket)
+            sys.exit(0)
+
+        # watching is a stream of changes over the data socket, handle it separately
+        if request['command'] == '-w':
+            # print changes until server hangs up or user stops
+            watch_changes(connected_socket, request)
+
+            # close data connection and socket, then exit
+            close_connection(connected_socket)
+            close_connection(data_socket)
+            close_connection(client_socket)
+            sys.exit(0)
+
         # get data from server, either containing a directory or a file
         response = receive_data(connected_socket, False)
 
@@ -432,18 +616,25 @@ if (request != None):
             # remove 'get' from top of file
             lines.pop(0)
 
-            # pass filename and file contents to save_file for saving
-            save_name = save_file(request['file'], lines)
+            # pass filename (without the server's directory name, if any) and file contents to save_file for saving
+            save_name = save_file(os.path.basename(request['file']), lines)
 
             # print success message
             print("File transfer complete. File saved as {}.".format(save_name))
+        elif lines[0] == 'search':
+            # remove 'search' from top of results
+            lines.pop(0)
+
+            # pass matching lines to print_search_results for printing
+            print_search_results(lines, request)
 
         # close data connection
         close_connection(data_socket)
 
-    # command not valid, print error to terminal
+    # command not valid, print error to terminal and stop listening on data port
     else:
         print("{}:{} says\n{}".format(request['hostname'], request['port'], is_valid_command))
+        close_connection(data_socket)
 
     # close socket whether successful or not
     close_connection(client_socket)
@@ -27,40 +27,813 @@
 ** This program is the server.
 *************************************************************************/
 
+// needed for sched_setaffinity and ppoll
+#define _GNU_SOURCE
+
 // import all necessary modules
 #include <arpa/inet.h>
 #include <dirent.h>
 #include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/inotify.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
 // define bool enums
 typedef enum { false, true } bool;
 
 // define command enums
-typedef enum { err, list, get } cmd;
+typedef enum { err, list, get, chunks, search, subscribe } cmd;
+
+// # of connections the kernel will queue on a listen socket before we accept them
+#define LISTEN_BACKLOG 64
+
+// set by SIGTERM/SIGINT, server stops once its queued connections are served
+volatile sig_atomic_t stop_requested = 0;
+
+// a worker that exits within WORKER_MIN_UPTIME ms of starting failed to start. it's restarted
+// after WORKER_RESTART_DELAY ms (doubling each time), and given up on after WORKER_MAX_FAILURES in a row
+#define WORKER_MIN_UPTIME 1000
+#define WORKER_RESTART_DELAY 250
+#define WORKER_MAX_FAILURES 5
+
+// one worker in the master: its process (0 if none is running), when it started, how many
+// times in a row it failed to start, and when to start it again (0 if it isn't waiting to)
+typedef struct worker_slot {
+    pid_t pid;
+    uint64_t started;
+    int failures;
+    uint64_t restart_at;
+} worker_slot;
+
+// content-defined chunking limits: chunks are cut where the rolling hash
+// matches CHUNK_MASK (~8KB average), but never smaller/larger than min/max
+#define CHUNK_MIN_SIZE 2048
+#define CHUNK_MAX_SIZE 65536
+#define CHUNK_MASK 0x1FFF
+
+// files are read and chunked through a window this big instead of all at once
+#define STORE_READ_WINDOW (4 * CHUNK_MAX_SIZE)
+
+// in-memory chunk cache size limit and hash table size
+#define CHUNK_CACHE_BYTES (64 * 1024 * 1024)
+#define CHUNK_CACHE_BUCKETS 4096
+
+// # of cached chunks handed to each sendmsg when sending from the store
+#define STORE_SEND_BATCH 16
+
+// length of a SHA-256 digest in bytes and as a hex string
+#define DIGEST_SIZE 32
+#define DIGEST_HEX_SIZE 65
+
+// one chunk held in memory, shared by every file that contains it
+typedef struct chunk {
+    unsigned char digest[DIGEST_SIZE];
+    size_t size;
+    int refs;
+    char* data;
+    struct chunk *bucket_next, *lru_prev, *lru_next;
+} chunk;
+
+// one entry in a file manifest (which chunk, and how big it is)
+typedef struct chunk_ref {
+    unsigned char digest[DIGEST_SIZE];
+    size_t size;
+} chunk_ref;
+
+// list of chunks that make up a stored file, in order
+typedef struct manifest {
+    long mtime;
+    size_t file_size;
+    int count;
+    chunk_ref* refs;
+} manifest;
+
+// deduplicated chunk store on disk plus the cache of chunks in memory
+typedef struct chunk_store {
+    char root[256];
+    uint64_t gear[256];
+    chunk* buckets[CHUNK_CACHE_BUCKETS];
+    chunk *lru_head, *lru_tail;
+    size_t cached_bytes;
+} chunk_store;
+
+// served directories (-r) and # of open files kept for reuse
+#define MAX_ROOTS 16
+#define FILE_CACHE_SIZE 64
+
+// one served directory: its name in the namespace ("" when serving just the current directory) and an open fd to it
+typedef struct served_root {
+    char name[64];
+    char path[256];
+    int dir_fd;
+} served_root;
+
+// an open file kept for reuse, and which inode it is (to notice the file being replaced)
+typedef struct cached_file {
+    char name[320];
+    int fd;
+    dev_t device;
+    ino_t inode;
+    unsigned long last_used;
+} cached_file;
+
+// every served directory, plus recently used files held open. files are
+// named "ROOT/FILE" when roots are given with -r, or just "FILE" otherwise
+typedef struct served_namespace {
+    served_root roots[MAX_ROOTS];
+    int root_count;
+    cached_file files[FILE_CACHE_SIZE];
+    unsigned long uses;
+    bool watched;
+} served_namespace;
+
+// position while listing every file in the namespace
+typedef struct namespace_cursor {
+    int root;
+    DIR* directory;
+} namespace_cursor;
+
+// namespace being served, set up in main (each worker process gets its own copy of the file cache)
+served_namespace* served = NULL;
+
+// search index: hash table sizes, biggest file that gets indexed, and limits on what a search sends back
+#define INDEX_BUCKETS 65536
+#define INDEX_NAME_BUCKETS 4096
+#define INDEX_MAX_FILE_SIZE (16 * 1024 * 1024)
+#define INDEX_SNIFF_SIZE 8192
+#define SEARCH_MAX_RESULTS 200
+#define SNIPPET_SIZE 120
+
+// files containing one trigram (3 lowercased bytes packed into 24 bits)
+typedef struct posting_list {
+    uint32_t trigram;
+    int count, capacity;
+    int* files;
+    struct posting_list* next;
+} posting_list;
+
+// one file in the served directory and the trigrams it contains
+typedef struct indexed_file {
+    char name[256];
+    long mtime;
+    off_t size;
+    bool used, present, text;
+    int trigram_count;
+    uint32_t* trigrams;
+    int name_next;
+} indexed_file;
+
+// inverted index over the text files in the served directory
+typedef struct search_index {
+    indexed_file* files;
+    int file_count, file_capacity;
+    int names[INDEX_NAME_BUCKETS];
+    posting_list* buckets[INDEX_BUCKETS];
+    unsigned char seen[(1 << 24) / 8];
+} search_index;
+
+// directory watcher: hash table size, most subscribers per process, and inotify read buffer size
+#define WATCH_BUCKETS 4096
+#define WATCH_MAX_SUBSCRIBERS 64
+#define WATCH_EVENT_BUFFER 65536
+
+// one entry known to be in the served directory
+typedef struct watched_file {
+    char* name;
+    bool present;
+    struct watched_file* next;
+} watched_file;
+
+// contents of the served directory kept up to date by inotify, and the
+// data connections of clients subscribed to changes
+typedef struct dir_watch {
+    int inotify_fd;
+    int root_watches[MAX_ROOTS];
+    watched_file* buckets[WATCH_BUCKETS];
+    int subscribers[WATCH_MAX_SUBSCRIBERS];
+    int subscriber_count;
+
+    // bumped whenever an entry is added or removed
+    unsigned long generation;
+} dir_watch;
+
+// read-ahead: clients remembered, # of files read ahead once a client is going through the
+// directory in order, and how much of each of those files is read ahead
+#define PREFETCH_CLIENTS 32
+#define PREFETCH_DEPTH 4
+#define PREFETCH_BYTES (4 * 1024 * 1024)
+
+// what one client host asked for last, to spot it requesting files in directory order
+typedef struct client_history {
+    char host[100];
+    char last_name[256];
+    char prefetched_name[256];
+    unsigned long last_used;
+} client_history;
+
+// sorted directory listing and recent clients, used to read ahead for sequential requests
+typedef struct prefetcher {
+    char** names;
+    int name_count;
+    bool loaded;
+    unsigned long generation, requests;
+    client_history clients[PREFETCH_CLIENTS];
+} prefetcher;
+
+// # of request phases kept for tracing (-t), oldest ones are overwritten
+#define TRACE_RING_SIZE 65536
+
+// request phases that can be traced
+typedef enum { trace_accept, trace_lookup, trace_parse, trace_stat, trace_open, trace_connect, trace_send, trace_close, trace_request } trace_phase;
+
+// names of the phases as they show up in the trace file
+static const char* trace_phase_names[] = { "accept", "lookup", "parse", "stat", "open", "connect", "send", "close", "request" };
+
+// one traced phase: when it started (ns on the monotonic clock), how long it took, and which request it was part of
+typedef struct trace_event {
+    uint64_t start, duration;
+    uint32_t request;
+    uint32_t phase;
+} trace_event;
+
+// ring buffer of traced phases for this process, written out when the server stops
+typedef struct request_tracer {
+    char path[256];
+    bool per_process;
+    uint32_t request;
+    uint64_t count;
+    trace_event events[TRACE_RING_SIZE];
+} request_tracer;
+
+// client name cache: # of entries, how many seconds names (and failed lookups) are kept, and # of lookups that can wait
+#define RESOLVER_CACHE_SIZE 256
+#define RESOLVER_TTL 300
+#define RESOLVER_FAILED_TTL 30
+#define RESOLVER_QUEUE_SIZE 64
+
+// hostname looked up for one client address (empty if the lookup failed)
+typedef struct resolved_name {
+    char address[INET6_ADDRSTRLEN];
+    char name[100];
+    time_t expires;
+    bool pending;
+} resolved_name;
+
+// cache of client hostnames, filled in by a background thread so a slow DNS never holds up a request
+typedef struct name_resolver {
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    resolved_name cache[RESOLVER_CACHE_SIZE];
+    struct sockaddr_storage queue[RESOLVER_QUEUE_SIZE];
+    int queue_head, queue_count;
+} name_resolver;
+
+// tracer if started with -t, NULL otherwise (each worker process gets its own copy)
+request_tracer* tracer = NULL;
+
+
+/*************************************************************************
+* function trace_init
+* Turns on request tracing
+* Params:
+*   char* path (file to write the trace to)
+*   bool per_process (true if each worker process writes its own file, named path.PID)
+* Returns:
+*   bool if tracing was started (true) or there wasn't enough memory (false)
+* Pre-conditions: Called once, before any workers are started
+* Post-conditions: Phases of every request are recorded
+*************************************************************************/
+bool trace_init(char* path, bool per_process) {
+    tracer = calloc(1, sizeof(request_tracer));
+    if (tracer == NULL) {
+        return false;
+    }
+    strncpy(tracer->path, path, sizeof(tracer->path) - 1);
+    tracer->per_process = per_process;
+    return true;
+}
+
+
+/*************************************************************************
+* function trace_start
+* Gets the time a phase starts at, to pass to trace_end when it's done
+* Returns:
+*   uint64_t (ns on the monotonic clock, or 0 if tracing is off)
+* Pre-conditions: None
+* Post-conditions: None
+*************************************************************************/
+uint64_t trace_start() {
+    struct timespec now;
+
+    // don't even read the clock when tracing is off
+    if (tracer == NULL) {
+        return 0;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+
+/*************************************************************************
+* function trace_end
+* Records a phase of the current request in the ring buffer
+* Params:
+*   trace_phase phase (phase that finished)
+*   uint64_t start (time from trace_start when the phase started)
+* Pre-conditions: None
+* Post-conditions: Phase recorded (if tracing is on)
+*************************************************************************/
+void trace_end(trace_phase phase, uint64_t start) {
+    if (tracer == NULL) {
+        return;
+    }
+    trace_event* event = &tracer->events[tracer->count++ % TRACE_RING_SIZE];
+    event->start = start;
+    event->duration = trace_start() - start;
+    event->request = tracer->request;
+    event->phase = phase;
+}
+
+
+/*************************************************************************
+* function trace_dump
+* Writes the recorded phases to the trace file in Chrome's trace event
+* format (open it in chrome://tracing or ui.perfetto.dev)
+* Pre-conditions: None
+* Post-conditions: Trace file written (if tracing is on)
+*************************************************************************/
+void trace_dump() {
+    char path[300];
+
+    if (tracer == NULL) {
+        return;
+    }
+
+    // each worker writes its own file
+    if (tracer->per_process) {
+        snprintf(path, sizeof path, "%s.%d", tracer->path, (int) getpid());
+    } else {
+        snprintf(path, sizeof path, "%s", tracer->path);
+    }
+    FILE* trace_file = fopen(path, "w");
+    if (trace_file == NULL) {
+        printf("Could not write trace to %s\n", path);
+        return;
+    }
+
+    // write events oldest first (only the last TRACE_RING_SIZE are still in the ring), times in microseconds
+    int pid = getpid();
+    uint64_t first = tracer->count > TRACE_RING_SIZE ? tracer->count - TRACE_RING_SIZE : 0;
+    fprintf(trace_file, "{\"traceEvents\":[\n");
+    for (uint64_t i = first; i < tracer->count; i++) {
+        trace_event* event = &tracer->events[i % TRACE_RING_SIZE];
+        fprintf(trace_file, "%s{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%d,\"args\":{\"request\":%u}}\n",
+                i == first ? "" : ",", trace_phase_names[event->phase], event->start / 1000.0, event->duration / 1000.0, pid, pid, event->request);
+    }
+    fprintf(trace_file, "]}\n");
+    fclose(trace_file);
+
+    printf("Wrote %llu traced phases to %s\n", (unsigned long long) (tracer->count - first), path);
+}
+
+
+/*************************************************************************
+* function resolver_now
+* Gets the current time in seconds on the monotonic clock, for expiring
+* cached names (unaffected by changes to the system time)
+* Returns:
+*   time_t seconds
+* Pre-conditions: None
+* Post-conditions: None
+*************************************************************************/
+time_t resolver_now() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec;
+}
+
+
+/*************************************************************************
+* function resolver_slot
+* Hashes a numeric address (FNV-1a) to pick its cache entry
+* Params:
+*   name_resolver* resolver (resolver holding the cache)
+*   const char* address (numeric address string)
+* Returns:
+*   resolved_name* (cache entry the address belongs in)
+* Pre-conditions: None
+* Post-conditions: None
+*************************************************************************/
+resolved_name* resolver_slot(name_resolver* resolver, const char* address) {
+    uint32_t hash = 2166136261u;
+    for (const char* c = address; *c != '\0'; c++) {
+        hash = (hash ^ (unsigned char) *c) * 16777619u;
+    }
+    return &resolver->cache[hash % RESOLVER_CACHE_SIZE];
+}
+
+
+/*************************************************************************
+* function resolver_thread
+* Background thread that does the (blocking) reverse DNS lookups queued
+* by resolver_lookup and saves the results in the cache
+* Params:
+*   void* argument (name_resolver* to serve)
+* Returns:
+*   NULL (never returns, the thread ends with the process)
+* Pre-conditions: Started by resolver_init
+* Post-conditions: None
+*************************************************************************/
+void* resolver_thread(void* argument) {
+    name_resolver* resolver = (name_resolver*) argument;
+    struct sockaddr_storage address;
+    char numeric[INET6_ADDRSTRLEN], name[100];
+
+    while (true) {
+        // wait for an address to look up
+        pthread_mutex_lock(&resolver->lock);
+        while (resolver->queue_count == 0) {
+            pthread_cond_wait(&resolver->wake, &resolver->lock);
+        }
+        address = resolver->queue[resolver->queue_head];
+        resolver->queue_head = (resolver->queue_head + 1) % RESOLVER_QUEUE_SIZE;
+        resolver->queue_count--;
+        pthread_mutex_unlock(&resolver->lock);
+
+        // look the name up without holding the lock
+        socklen_t length = address.ss_family == AF_INET6 ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
+        getnameinfo((struct sockaddr*) &address, length, numeric, sizeof numeric, NULL, 0, NI_NUMERICHOST);
+        bool found = getnameinfo((struct sockaddr*) &address, length, name, sizeof name, NULL, 0, NI_NAMEREQD) == 0;
+
+        // save the name (or that there isn't one), unless the entry was taken over by another address since
+        pthread_mutex_lock(&resolver->lock);
+        resolved_name* entry = resolver_slot(resolver, numeric);
+        if (strcmp(entry->address, numeric) == 0) {
+            strcpy(entry->name, found ? name : "");
+            entry->expires = resolver_now() + (found ? RESOLVER_TTL : RESOLVER_FAILED_TTL);
+            entry->pending = false;
+        }
+        pthread_mutex_unlock(&resolver->lock);
+    }
+    return NULL;
+}
+
+
+/*************************************************************************
+* function resolver_init
+* Creates the client name cache and starts its lookup thread
+* Returns:
+*   name_resolver* (new resolver), or NULL if the thread couldn't be started
+* Pre-conditions: Called in the process that will use it (threads don't survive fork)
+* Post-conditions: Lookup thread waiting for addresses
+*************************************************************************/
+name_resolver* resolver_init() {
+    pthread_t thread;
+    name_resolver* resolver = calloc(1, sizeof(name_resolver));
+    if (resolver == NULL) {
+        return NULL;
+    }
+    pthread_mutex_init(&resolver->lock, NULL);
+    pthread_cond_init(&resolver->wake, NULL);
+
+    if (pthread_create(&thread, NULL, resolver_thread, resolver) != 0) {
+        free(resolver);
+        return NULL;
+    }
+    pthread_detach(thread);
+    return resolver;
+}
+
+
+/*************************************************************************
+* function resolver_lookup
+* Gets a client's hostname from the cache without waiting on DNS. If it
+* isn't cached (or has expired) a lookup is queued for the background
+* thread and the caller goes on with the numeric address.
+* Params:
+*   name_resolver* resolver (resolver to use)
+*   struct sockaddr_storage* client_address (client's address)
+*   const char* address (client's address as a numeric string)
+*   char* name (set to the hostname, 100 chars)
+* Returns:
+*   bool true if a cached hostname was found
+* Pre-conditions: resolver created by resolver_init
+* Post-conditions: Lookup queued if the name wasn't cached
+*************************************************************************/
+bool resolver_lookup(name_resolver* resolver, struct sockaddr_storage* client_address, const char* address, char* name) {
+    bool found = false;
+
+    pthread_mutex_lock(&resolver->lock);
+    resolved_name* entry = resolver_slot(resolver, address);
+    if (strcmp(entry->address, address) == 0 && (entry->pending || entry->expires > resolver_now())) {
+        // cached (or already being looked up)
+        if (!entry->pending && entry->name[0] != '\0') {
+            strcpy(name, entry->name);
+            found = true;
+        }
+    } else if (resolver->queue_count < RESOLVER_QUEUE_SIZE) {
+        // not cached, take over the entry and queue a lookup
+        strcpy(entry->address, address);
+        entry->name[0] = '\0';
+        entry->pending = true;
+        resolver->queue[(resolver->queue_head + resolver->queue_count++) % RESOLVER_QUEUE_SIZE] = *client_address;
+        pthread_cond_signal(&resolver->wake);
+    }
+    pthread_mutex_unlock(&resolver->lock);
+    return found;
+}
+
+
+/*************************************************************************
+* function namespace_add_root
+* Adds a directory to the served namespace
+* Params:
+*   char* name (name files in the directory appear under, "" for none)
+*   char* path (path to the directory)
+* Returns:
+*   bool if the directory was added (true) or is invalid or can't be opened (false)
+* Pre-conditions: served allocated, roots are either all named or a single unnamed one
+* Post-conditions: Directory open and listed in the namespace
+*************************************************************************/
+bool namespace_add_root(char* name, char* path) {
+    if (served->root_count == MAX_ROOTS || strlen(name) >= sizeof(served->roots[0].name) || strlen(path) >= sizeof(served->roots[0].path)) {
+        return false;
+    }
+
+    // names can only have letters, digits, '-' and '_', and must be unique
+    for (char* c = name; *c != '\0'; c++) {
+        if (!isalnum((unsigned char) *c) && *c != '-' && *c != '_') {
+            return false;
+        }
+    }
+    for (int i = 0; i < served->root_count; i++) {
+        if (strcmp(served->roots[i].name, name) == 0) {
+            return false;
+        }
+    }
+
+    // keep the directory open so files are looked up relative to it
+    served_root* root = &served->roots[served->root_count];
+    root->dir_fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (root->dir_fd < 0) {
+        return false;
+    }
+    strcpy(root->name, name);
+    strcpy(root->path, path);
+    served->root_count++;
+    return true;
+}
+
+
+/*************************************************************************
+* function namespace_resolve
+* Finds which served directory a file name belongs to. Names can't leave
+* their directory: no "/" in the file part, and no "." or "..".
+* Params:
+*   const char* name (name in the namespace)
+*   const char** relative (set to the file's name within its directory)
+* Returns:
+*   served_root* (directory holding the file), or NULL if the name is invalid
+* Pre-conditions: served set up
+* Post-conditions: None
+*************************************************************************/
+served_root* namespace_resolve(const char* name, const char** relative) {
+    served_root* root = NULL;
+
+    // a single unnamed root serves names as they are, otherwise the name starts with "ROOT/"
+    if (served->root_count == 1 && served->roots[0].name[0] == '\0') {
+        root = &served->roots[0];
+        *relative = name;
+    } else {
+        const char* slash = strchr(name, '/');
+        for (int i = 0; slash != NULL && i < served->root_count; i++) {
+            if (strlen(served->roots[i].name) == (size_t) (slash - name) && strncmp(served->roots[i].name, name, slash - name) == 0) {
+                root = &served->roots[i];
+                *relative = slash + 1;
+            }
+        }
+    }
+
+    if (root == NULL || **relative == '\0' || strchr(*relative, '/') != NULL || strcmp(*relative, ".") == 0 || strcmp(*relative, "..") == 0) {
+        return NULL;
+    }
+    return root;
+}
+
+
+/*************************************************************************
+* function namespace_stat
+* Gets stats about a file in the namespace (relative to its directory's
+* open fd, so only the last part of the path is looked up)
+* Params:
+*   const char* name (name in the namespace)
+*   struct stat* file_stat (struct to store stats to)
+* Returns:
+*   int 0 on success, -1 on error (like stat)
+* Pre-conditions: served set up
+* Post-conditions: file_stat filled in
+*************************************************************************/
+int namespace_stat(const char* name, struct stat* file_stat) {
+    const char* relative;
+    served_root* root = namespace_resolve(name, &relative);
+    if (root == NULL) {
+        errno = ENOENT;
+        return -1;
+    }
+    return fstatat(root->dir_fd, relative, file_stat, 0);
+}
+
+
+/*************************************************************************
+* function namespace_open_file
+* Opens a file in the namespace for reading, bypassing the file cache
+* (for reading through lots of files once, so they don't push out the hot ones)
+* Params:
+*   const char* name (name in the namespace)
+* Returns:
+*   int fd (caller closes it), or -1 on error
+* Pre-conditions: served set up
+* Post-conditions: None
+*************************************************************************/
+int namespace_open_file(const char* name) {
+    const char* relative;
+    served_root* root = namespace_resolve(name, &relative);
+    if (root == NULL) {
+        errno = ENOENT;
+        return -1;
+    }
+    return openat(root->dir_fd, relative, O_RDONLY | O_CLOEXEC);
+}
+
+
+/*************************************************************************
+* function namespace_forget
+* Closes a cached file, since it changed on disk
+* Params:
+*   const char* name (name in the namespace, or NULL for every file)
+* Pre-conditions: served set up
+* Post-conditions: File (or every file) no longer cached
+*************************************************************************/
+void namespace_forget(const char* name) {
+    for (int i = 0; i < FILE_CACHE_SIZE; i++) {
+        cached_file* file = &served->files[i];
+        if (file->last_used != 0 && (name == NULL || strcmp(file->name, name) == 0)) {
+            close(file->fd);
+            file->last_used = 0;
+        }
+    }
+}
+
+
+/*************************************************************************
+* function namespace_cached_fd
+* Gets an open fd for a file in the namespace, reusing one from the cache
+* when possible. When directories aren't watched with inotify, the cached
+* fd is checked against the file's inode first in case it was replaced.
+* Files should be read with pread, since the fd is shared.
+* Params:
+*   const char* name (name in the namespace)
+* Returns:
+*   int fd (owned by the cache, don't close it), or -1 on error
+* Pre-conditions: served set up
+* Post-conditions: File is in the cache as the most recently used
+*************************************************************************/
+int namespace_cached_fd(const char* name) {
+    struct stat file_stat;
+    cached_file* oldest = &served->files[0];
+    served->uses++;
+
+    if (strlen(name) >= sizeof(oldest->name)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    // look for the file in the cache, remembering the least recently used entry in case it isn't there
+    for (int i = 0; i < FILE_CACHE_SIZE; i++) {
+        cached_file* file = &served->files[i];
+        if (file->last_used != 0 && strcmp(file->name, name) == 0) {
+            // without inotify, make sure the name still points at the same file
+            if (!served->watched && (namespace_stat(name, &file_stat) != 0 || file_stat.st_dev != file->device || file_stat.st_ino != file->inode)) {
+                close(file->fd);
+                file->last_used = 0;
+                oldest = file;
+                break;
+            }
+            file->last_used = served->uses;
+            return file->fd;
+        }
+        if (file->last_used < oldest->last_used) {
+            oldest = file;
+        }
+    }
+
+    // not cached, open it and replace the least recently used entry
+    int fd = namespace_open_file(name);
+    if (fd < 0 || fstat(fd, &file_stat) != 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+    if (oldest->last_used != 0) {
+        close(oldest->fd);
+    }
+    strcpy(oldest->name, name);
+    oldest->fd = fd;
+    oldest->device = file_stat.st_dev;
+    oldest->inode = file_stat.st_ino;
+    oldest->last_used = served->uses;
+    return fd;
+}
+
+
+/*************************************************************************
+* function namespace_next
+* Gets the next entry in the namespace, going through each served
+* directory in turn. Start with a zeroed cursor and keep calling until it
+* returns false (which also closes the cursor).
+* Params:
+*   namespace_cursor* cursor (position in the listing)
+*   char* name (set to the entry's name in the namespace)
+*   size_t size (size of name)
+* Returns:
+*   bool true if there was another entry, false at the end
+* Pre-conditions: served set up
+* Post-conditions: None
+*************************************************************************/
+bool namespace_next(namespace_cursor* cursor, char* name, size_t size) {
+    struct dirent* entry;
+
+    while (cursor->root < served->root_count) {
+        // open the next directory afresh. a dup of the root's fd would share its read position
+        // with every other listing (and, after fork, with every worker), so they'd skip entries
+        if (cursor->directory == NULL) {
+            int dir_fd = openat(served->roots[cursor->root].dir_fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            if (dir_fd < 0 || (cursor->directory = fdopendir(dir_fd)) == NULL) {
+                if (dir_fd >= 0) {
+                    close(dir_fd);
+                }
+                cursor->root++;
+                continue;
+            }
+        }
+
+        // return the next entry except the current and parent directory
+        while ((entry = readdir(cursor->directory)) != NULL) {
+            if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+                continue;
+            }
+            served_root* root = &served->roots[cursor->root];
+            if (snprintf(name, size, "%s%s%s", root->name, root->name[0] != '\0' ? "/" : "", entry->d_name) < (int) size) {
+                return true;
+            }
+        }
+
+        // done with this directory, move on to the next
+        closedir(cursor->directory);
+        cursor->directory = NULL;
+        cursor->root++;
+    }
+    return false;
+}
 
 
 /*************************************************************************
 * function open_listen_port
-* Opens a socket for listening using the provided addrinfo struct
+* Opens a socket for listening using the provided addrinfo struct. The
+* address can be re-used right away after a restart, and with share_port
+* several worker processes can each bind their own socket to the same port
+* (SO_REUSEPORT) and the kernel spreads new connections across them.
 * Params:
 *   struct addrinfo listen_hints (contains client host info)
 *   struct addrinfo *listen_res (to store client socket info)
 *   int port (port number to listen on)
+*   bool share_port (true if other processes will listen on the same port)
 * Returns:
-*   int pointing to socket_fd
+*   int pointing to socket_fd, or -1 if the port could not be opened
 * Pre-conditions: No existing socket to client at listen_res
-* Post-conditions: Socket opened but not connected to host at listen_res
+* Post-conditions: Socket listening (non-blocking) but not connected to host at listen_res
 *************************************************************************/
-int open_listen_port(char* port, struct addrinfo listen_hints, struct addrinfo *listen_res) {
+int open_listen_port(char* port, struct addrinfo listen_hints, struct addrinfo *listen_res, bool share_port) {
     // create int for server socket file descriptor
     int socket_fd;
 
@@ -73,15 +846,38 @@ int open_listen_port(char* port, struct addrinfo listen_hints, struct addrinfo *
 
     // Code excerpted from Beej's Guide: http://beej.us/guide/bgnet/html/#getaddrinfoprepare-to-launch
     // get localhost info and store to listen_res
-    getaddrinfo(NULL, port, &listen_hints, &listen_res);
+    if (getaddrinfo(NULL, port, &listen_hints, &listen_res) != 0) {
+        printf("Could not get address info for port %s\n", port);
+        return -1;
+    }
 
     // Code excerpted from Beej's Guide: http://beej.us/guide/bgnet/html/#socket
     // open socket based on info stored in listen_res
     socket_fd = socket(listen_res->ai_family, listen_res->ai_socktype, listen_res->ai_protocol);
 
+    // Code excerpted from Beej's Guide: http://beej.us/guide/bgnet/html/#setsockoptman
+    // allow re-using the port right after a restart, and sharing it between workers if asked
+    int yes = 1;
+    setsockopt(socket_fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof yes);
+    if (share_port) {
+        setsockopt(socket_fd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof yes);
+    }
+
     // Code excerpted from Beej's Guide: http://beej.us/guide/bgnet/html/#bind
     // bind server to socket
-    bind(socket_fd, listen_res->ai_addr, listen_res->ai_addrlen);
+    if (bind(socket_fd, listen_res->ai_addr, listen_res->ai_addrlen) != 0) {
+        printf("Could not bind to port %s: %s\n", port, strerror(errno));
+        freeaddrinfo(listen_res);
+        close(socket_fd);
+        return -1;
+    }
+    freeaddrinfo(listen_res);
+
+    // Code excerpted from Beej's Guide: http://beej.us/guide/bgnet/html/#listen
+    // listen to socket for client connections. accepts are non-blocking so the
+    // server can wait for connections and stop signals at the same time
+    listen(socket_fd, LISTEN_BACKLOG);
+    fcntl(socket_fd, F_SETFL, fcntl(socket_fd, F_GETFL) | O_NONBLOCK);
 
     // print update to terminal and return socket number
     printf("Server open on %s\n\n", port);
@@ -91,84 +887,101 @@ int open_listen_port(char* port, struct addrinfo listen_hints, struct addrinfo *
 
 /*************************************************************************
 * function open_data_port
-* Opens a socket for sending data using the provided addrinfo struct
+* Opens a socket for sending data to the client. Connects to the address
+* the client's control connection came from, so no name lookup is needed.
 * Params:
-*   struct addrinfo data_hints (contains client data socket info)
-*   struct addrinfo *data_res (to store client data socket host info)
-*   int port (port number to connect to)
+*   struct sockaddr_storage* client_address (address of the client's control connection)
+*   char* port (string holding data port provided by client)
 * Returns:
-*   int pointing to data_fd
-* Pre-conditions: No existing socket to client at data_res
-* Post-conditions: Socket opened and connected to host at data_res
+*   int pointing to data_fd, or -1 if the connection failed
+* Pre-conditions: client_address filled in by accept_client_connection
+* Post-conditions: Socket opened and connected to client's data port
 *************************************************************************/
-int open_data_port(char* host, char* port, struct addrinfo data_hints, struct addrinfo *data_res) {
+int open_data_port(struct sockaddr_storage* client_address, char* port) {
     // create int for data socket file descriptor
     int data_fd;
+    uint64_t started = trace_start();
 
-    // Code excerpted from Beej's Guide: http://beej.us/guide/bgnet/html/#connect
-    // clear data port address intfo struct and set fields for getting client info
-    memset(&data_hints, 0, sizeof data_hints);
-    data_hints.ai_family = AF_UNSPEC;
-    data_hints.ai_socktype = SOCK_STREAM;
-
-    // Code excerpted from Beej's Guide: http://beej.us/guide/bgnet/html/#getaddrinfoprepare-to-launch
-    // get client's info and store to data_res
-    getaddrinfo(host, port, &data_hints, &data_res);
-
-    // Code excerpted from Beej's Guide: http://beej.us/guide/bgnet/html/#connect
-    // open socket pointing to client using data stored in data_res sturect
-    data_fd = socket(data_res->ai_family, data_res->ai_socktype, data_res->ai_protocol);
+    // copy client's address and swap in the data port
+    struct sockaddr_storage data_address = *client_address;
+    socklen_t address_size;
+    if (data_address.ss_family == AF_INET6) {
+        ((struct sockaddr_in6*) &data_address)->sin6_port = htons(atoi(port));
+        address_size = sizeof(struct sockaddr_in6);
+    } else {
+        ((struct sockaddr_in*) &data_address)->sin_port = htons(atoi(port));
+        address_size = sizeof(struct sockaddr_in);
+    }
 
     // Code excerpted from Beej's Guide: http://beej.us/guide/bgnet/html/#connect
-    // connect to data socket and return socket numer
-    connect(data_fd, data_res->ai_addr, data_res->ai_addrlen);
+    // open socket and connect to data port, then return socket number
+    data_fd = socket(data_address.ss_family, SOCK_STREAM, 0);
+    if (data_fd >= 0 && connect(data_fd, (struct sockaddr*) &data_address, address_size) < 0) {
+        close(data_fd);
+        data_fd = -1;
+    }
+    trace_end(trace_connect, started);
     return data_fd;
 }
 
 
 /*************************************************************************
 * function accept_client_connection
-* Accept a client connection at the provided listen socket
+* Accept a client connection at the provided listen socket. client_host
+* is always the numeric address (no DNS). client_name is the first part
+* of the client's hostname if the resolver has it cached, otherwise the
+* numeric address while the name is looked up in the background.
 * Params:
 *   int socket_fd (int pointing to open but not connected listen socket)
-*   struct sockaddr_storage client_address (struct to store info about the client_address)
+*   struct sockaddr_storage* client_address (struct to store info about the client_address)
 *   socklen_t address_size (struct to store info about the size of the address socket)
-*   char* client_host (string to hold client host)
-*   char* client_name (string to hold client name)
+*   char* client_host (string to hold client address, 100 chars)
+*   char* client_name (string to hold client name, 100 chars)
 *   char* service (string to hold client service (port #))
+*   name_resolver* resolver (client name cache, or NULL to skip names)
 * Returns:
-*   int new_fd pointing to new data connection
+*   int new_fd pointing to new data connection, or -1 if no connection was waiting
 * Pre-conditions: Socket with client opened but not connected
 * Post-conditions: Connection exists between server and client
 *************************************************************************/
-int accept_client_connection(int socket_fd, struct sockaddr_storage client_address, socklen_t address_size, char* client_host, char* client_name, char* service) {
-    // Code excerpted from Beej's Guide: http://beej.us/guide/bgnet/html/#listen
-    // listen to socket for client connection. only accepts 1 connection at a time
-    listen(socket_fd, 1);
-
+int accept_client_connection(int socket_fd, struct sockaddr_storage* client_address, socklen_t address_size, char* client_host, char* client_name, char* service, name_resolver* resolver) {
     // Code excerpted from Beej's Guide: http://beej.us/guide/bgnet/html/#acceptthank-you-for-calling-port-3490.
-    // accept client connection and save to new socket number
-    int new_fd = accept(socket_fd, (struct sockaddr *) &client_address, &address_size);
+    // accept client connection and save to new socket number (accept fills in the client's address)
+    uint64_t started = trace_start();
+    int new_fd = accept(socket_fd, (struct sockaddr *) client_address, &address_size);
+
+    // listen socket is non-blocking, so there may not have been anyone to accept
+    if (new_fd < 0) {
+        return -1;
+    }
 
-    // Code excerpted from Beej's Guide: http://beej.us/guide/bgnet/html/#getpeernameman
-    // get info about client host and store to client_address
-    getpeername(new_fd, (struct sockaddr *) &client_address, &address_size);
+    // this is a new request for tracing
+    if (tracer != NULL) {
+        tracer->request++;
+    }
+    trace_end(trace_accept, started);
+    started = trace_start();
 
     // clear fields for client host, name, and service (port)
     memset(client_host, '\0', 100);
-    memset(client_name, '\0', 10);
+    memset(client_name, '\0', 100);
     memset(service, '\0', 10);
 
     // Code excerpted from Beej's Guide: http://beej.us/guide/bgnet/html/#getnameinfoman
-    // get client hostname and port, store to client_host and service
-    getnameinfo((struct sockaddr *) &client_address, address_size, client_host,
-                    sizeof (char[100]), service, sizeof (char[10]), 0);
-
-    // copy first 6 chars of hostname to get host server
-    strncpy(client_name, client_host, 6);
+    // get client address and port as numbers (never blocks on DNS), store to client_host and service
+    getnameinfo((struct sockaddr *) client_address, address_size, client_host,
+                    sizeof (char[100]), service, sizeof (char[10]), NI_NUMERICHOST | NI_NUMERICSERV);
 
-    // add null terminator to end string
-    client_name[5] = '\0';
+    // use the cached hostname up to the first dot (e.g. "flip1") as the name, or the address if there isn't one yet
+    if (resolver != NULL && resolver_lookup(resolver, client_address, client_host, client_name)) {
+        char* dot = strchr(client_name, '.');
+        if (dot != NULL) {
+            *dot = '\0';
+        }
+    } else {
+        strcpy(client_name, client_host);
+    }
+    trace_end(trace_lookup, started);
 
     // print update to terminal and return data socket to caller
     printf("Connection from %s.\n", client_name);
@@ -186,7 +999,7 @@ int accept_client_connection(int socket_fd, struct sockaddr_storage client_addre
 *   char* filename (string to hold requested filename from client)
 *   char* filename (string to hold data port provided by client)
 * Returns:
-*   cmd enum containing type of command ('list', 'get', or 'err')
+*   cmd enum containing type of command ('list', 'get', 'chunks', 'search', 'subscribe', or 'err')
 * Pre-conditions: Connected socket waiting for a message
 * Post-conditions: Server receives message, stores command to local strings, and returns enum
 *************************************************************************/
@@ -201,8 +1014,8 @@ cmd get_command(int listen_fd, char* buffer, char* command, char* filename, char
     memset(data_port, '\0', 10);
 
     // Code excerpted from Beej's Guide: http://beej.us/guide/bgnet/html/#sendrecv
-    // receive data from the socket
-    bytes_sent = recv(listen_fd, buffer, 1000, 0);
+    // receive data from the socket (leaving room for the end of the string)
+    bytes_sent = recv(listen_fd, buffer, 999, 0);
 
     // if data received
     if (bytes_sent != 0) {
@@ -222,46 +1035,47 @@ cmd get_command(int listen_fd, char* buffer, char* command, char* filename, char
             command[2] = '\0';
 
             // if just one space and command is "-l", client requesting directory
-            if (spaces == 1 && strcmp(command, "-l") == 0) {
+            // (or "-w", client subscribing to directory changes)
+            if (spaces == 1 && (strcmp(command, "-l") == 0 || strcmp(command, "-w") == 0)) {
                 // get first token (command)
                 char* token = strtok(buffer, " ");
 
                 // if not null, get next token and copy to data_port
-                if (token != NULL) {
-                    token = strtok(NULL, " ");
+                if (token != NULL && (token = strtok(NULL, " ")) != NULL && strlen(token) < 10) {
                     strcpy(data_port, token);
                 } else {
                     // not enough tokens, invalid input - return error enum
                     return err;
                 }
 
-                // return list enum
-                return list;
-            } else if (spaces == 2 && strcmp(command, "-g") == 0) {
-                // if 2 spaces and command is "-g", client requesting file
+                // return list enum, or subscribe enum if client wants changes pushed
+                return strcmp(command, "-w") == 0 ? subscribe : list;
+            } else if ((spaces == 2 && (strcmp(command, "-g") == 0 || strcmp(command, "-c") == 0)) ||
+                    (spaces >= 2 && strcmp(command, "-s") == 0)) {
+                // if 2 spaces and command is "-g" (or "-c" for chunks), client requesting file
+                // if command is "-s", client searching files (the search term goes in filename).
+                // the term can have spaces, so it's everything between the command and the last space
+                char* name = &buffer[3];
+                char* last_space = strrchr(buffer, ' ');
+                size_t name_length = last_space - name;
 
-                // get first token (command)
-                char* token = strtok(buffer, " ");
-
-                // if not null, get next token and copy to filename
-                if (token != NULL) {
-                    token = strtok(NULL, " ");
-                    strcpy(filename, token);
-                    // if not null, get next token and copy to data_port
-                    if (token != NULL) {
-                        token = strtok(NULL, " ");
-                        strcpy(data_port, token);
-                    } else {
-                        // not enough tokens, invalid input - return error enum
-                        return err;
-                    }
-                } else {
-                    // not enough tokens, invalid input - return error enum
+                // name and data port can't be empty or too long to hold, invalid input - return error enum
+                if (buffer[2] != ' ' || name_length == 0 || name_length >= 100 || strlen(last_space + 1) == 0 || strlen(last_space + 1) >= 10) {
                     return err;
                 }
 
-                // return get enum
-                return get;
+                // copy filename (or search term) and data port
+                memcpy(filename, name, name_length);
+                filename[name_length] = '\0';
+                strcpy(data_port, last_space + 1);
+
+                // return search enum for a search
+                if (strcmp(command, "-s") == 0) {
+                    return search;
+                }
+
+                // return get enum, or chunks enum if client asked for the chunk list
+                return strcmp(command, "-c") == 0 ? chunks : get;
             }
         }
     }
@@ -272,7 +1086,7 @@ cmd get_command(int listen_fd, char* buffer, char* command, char* filename, char
 
 /*************************************************************************
 * function get_directory
-* Gets the contents of the local directory and stores it to dir_string
+* Gets the contents of the served directories and stores it to dir_string
 * Params:
 *   char* dir_string (string where contents of directory should be saved)
 * Returns:
@@ -281,174 +1095,175 @@ cmd get_command(int listen_fd, char* buffer, char* command, char* filename, char
 * Post-conditions: dir_string contains directory contents
 *************************************************************************/
 int get_directory(char* dir_string) {
-    // Code excerpted from https://stackoverflow.com/questions/4204666/how-to-list-files-in-a-directory-in-a-c-program/17683417
-
-    // var to count number of files
+    // var to count number of files, and name of the current one
     int files = 0;
+    char name[320];
+    size_t length = 0;
 
     // clear out directory string
     memset(dir_string, '\0', 1000);
 
-    // initialize directory structs and objects
-    DIR* directory;
-    struct dirent* file;
-
-    // open current directory
-    directory = opendir("./");
-
-    // if directory was opened
-    if (directory) {
-        // loop through files in folder until there are no more
-        while((file = readdir(directory)) != NULL) {
-            // only count files that are not shortscuts to current directory or parent directory
-            if (strcmp(file->d_name, ".") != 0 && strcmp(file->d_name, "..")) {
-                // if no files so far, copy current name to directory string
-                if (files == 0) {
-                    strcpy(dir_string, file->d_name);
-                } else {
-                    // if 1 or more files listed, concat filename to directory string
-                    strcat(dir_string, "\n");
-                    strcat(dir_string, file->d_name);
-                }
-                // increment number of files
-                files++;
-            }
+    // loop through files in every served directory until there are no more
+    namespace_cursor cursor = { 0, NULL };
+    while (namespace_next(&cursor, name, sizeof name)) {
+        // skip names that don't fit in the listing
+        if (length + strlen(name) + 2 > 1000) {
+            continue;
         }
-    }
+
+        // if 1 or more files listed, add a newline before the name
+        if (files > 0) {
+            strcat(dir_string, "\n");
+        }
+        strcat(dir_string, name);
+        length = strlen(dir_string);
+
+        // increment number of files
+        files++;
+    }
     // return number of files
     return files;
 }
 
 
+/*************************************************************************
+* function send_vectors
+* Sends several buffers over the provided socket with as few sendmsg calls
+* as possible, so they can go out in the same packets without first being
+* copied together. Loops over short sends.
+* Params:
+*   int socket (int pointing to connected socket)
+*   struct iovec* vectors (buffers to send, in order; changed while sending)
+*   int count (# of buffers)
+*   bool more (true if more data will follow right away, so the last packet can be held back for it)
+* Returns:
+*   int containing # of bytes sent, or -1 if the socket failed
+* Pre-conditions: Socket is connected
+* Post-conditions: All buffers sent to client (unless an error occurred)
+*************************************************************************/
+int send_vectors(int socket, struct iovec* vectors, int count, bool more) {
+    struct msghdr message;
+    size_t total = 0;
+
+    memset(&message, 0, sizeof message);
+    message.msg_iov = vectors;
+    message.msg_iovlen = count;
+
+    while (message.msg_iovlen > 0) {
+        ssize_t bytes_sent = sendmsg(socket, &message, MSG_NOSIGNAL | (more ? MSG_MORE : 0));
+        if (bytes_sent < 0) {
+            // retry if interrupted by a signal, otherwise give up
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        total += bytes_sent;
+
+        // skip buffers that went out completely, and the sent part of a buffer that didn't
+        while (message.msg_iovlen > 0 && (size_t) bytes_sent >= message.msg_iov->iov_len) {
+            bytes_sent -= message.msg_iov->iov_len;
+            message.msg_iov++;
+            message.msg_iovlen--;
+        }
+        if (message.msg_iovlen > 0) {
+            message.msg_iov->iov_base = (char*) message.msg_iov->iov_base + bytes_sent;
+            message.msg_iov->iov_len -= bytes_sent;
+        }
+    }
+
+    // return # bytes sent
+    return total;
+}
+
+
 /*************************************************************************
 * function send_data
-* Appends the text in message to the command, then copies that into the
-* buffer and sends the buffer over the provided socket
+* Sends the command's header line followed by message over the provided
+* socket. The two are sent together with sendmsg, without copying message.
 * Params:
-*   char* message (string containing message to send to client)
-*   char* buffer (string where text to be sent to client will be stored)
+*   char* message (data to send to client)
+*   size_t length (# of bytes in message)
 *   cmd cmd (enum holding type of command sent by client)
 *   int socket (int pointing to connected data socket)
 * Returns:
-*   int containing # of bytes sent
-* Pre-conditions: Data ready to be sent to client, buffer is empty
-* Post-conditions: Buffer filled and data sent to client
+*   int containing # of bytes sent, or -1 on error
+* Pre-conditions: Data ready to be sent to client
+* Post-conditions: Header and data sent to client
 *************************************************************************/
-int send_data(char* message, char* buffer, cmd cmd, int socket) {
-    // set buffer to username + message
-    sprintf(buffer, "%s\n%s", cmd == list ? "list" : "get", message);
+int send_data(char* message, size_t length, cmd cmd, int socket) {
+    // header line goes in front of the message
+    char* header = cmd == list ? "list\n" : "get\n";
+    struct iovec vectors[2] = { { header, strlen(header) }, { message, length } };
 
-    // send buffer to socket and return bytes written
-    return send(socket, buffer, strlen(buffer), 0);
+    // send both and return bytes written
+    return send_vectors(socket, vectors, 2, false);
 }
 
 
 /*************************************************************************
 * function send_list
-* Gets the local directory contents into a string and sends that to the client
+* Gets the contents of the served directories into a string and sends that to the client
 * Params:
-*   char* buffer (string where text to be sent to client will be stored)
 *   int data_fd (int pointing to connected data socket)
 * Returns:
 *   int containing # of bytes sent
 * Pre-conditions: Client requested directory list from server, need to get directory
 * Post-conditions: Directory sent to client
 *************************************************************************/
-int send_list(char* buffer, int data_fd) {
+int send_list(int data_fd) {
     // create string to hold directory and pass to get_directory function
     char directory[1000];
     get_directory(&directory[0]);
 
-    // clear out buffer
-    memset(buffer, '\0', 1000);
-
-    // send directory to client and store bytes sent to return_value
-    int return_value = send_data(&directory[0], &buffer[0], list, data_fd);
-
-    // clear buffer after sending and return # bytes sent
-    memset(buffer, '\0', 1000);
-    return return_value;
+    // send directory to client and return # bytes sent
+    return send_data(&directory[0], strlen(directory), list, data_fd);
 }
 
 
 /*************************************************************************
 * function send_file
-* Sends the requested file to the client
+* Sends the requested file to the client. The file goes straight from the
+* page cache to the socket with sendfile, and the socket is corked until
+* it's all queued so the header shares a packet with the start of the file
+* (a small file goes out as a single packet).
 * Params:
-*   char* file (string holding contents of file to be sent)
-*   char* buffer (string where text to be sent to client will be stored)
+*   int file_fd (int pointing to the open file; its offset isn't changed)
 *   int data_fd (int pointing to connected data socket)
-*   size_t file_size (size of file so that buffer is correctly cleared)
+*   size_t file_size (# of bytes to send from the file)
 * Returns:
-*   int containing # of bytes sent
-* Pre-conditions: Client requested valid file from server that is stored in char* file
+*   int containing # of bytes sent, or -1 on error
+* Pre-conditions: Client requested valid file from server that is open at file_fd
 * Post-conditions: File sent to client
 *************************************************************************/
-int send_file(char* file, char* buffer, int data_fd, size_t file_size) {
-    // clear out buffer
-    memset(buffer, '\0', file_size + 11);
-
-    // pass file and buffer to send_data function for sending
-    int return_value = send_data(&file[0], &buffer[0], get, data_fd);
-
-    // clear out buffer and return # bytes sent
-    memset(buffer, '\0', file_size + 11);
-    return return_value;
-}
-
-
-/*************************************************************************
-* function open_file
-* Opens the requested file and saves its contents to the save_string parameter
-* Params:
-*   FILE* file (FILE pointer pointing to the file descriptor)
-*   char* filename (string holding the requested file's name)
-*   char* save_string (string where the contents of the file will be stored)
-*   size_t file_size (size of file so that save_string is correctly cleared)
-* Returns:
-*   bool if file was opened (true) or not (false)
-* Pre-conditions: Client requested file from server
-* Post-conditions: Server either opens file and stores to string or returns false
-*************************************************************************/
-bool open_file(FILE* file, char* filename, char* save_string, size_t file_size) {
-    // clear out string to hold file text data
-    memset(save_string, '\0', file_size + 11);
-
-    // open file for reading
-    file = fopen(filename, "r");
+int send_file(int file_fd, int data_fd, size_t file_size) {
+    // hold back partial packets until the header and file are queued
+    int cork = 1;
+    setsockopt(data_fd, IPPROTO_TCP, TCP_CORK, &cork, sizeof cork);
 
-    // if file exists and was opened successfully
-    if (file != NULL) {
-        // create 10000 char temp string to read through file
-        char temp[10000];
-
-        // get 9999 characters (plus null terminator appended by fgets)
-        fgets(temp, 9999, file);
-
-        // copy chars from temp variable to save_string
-        strncpy(save_string, temp, strlen(temp));
-
-        // clear out temp string to all null terminators
-        memset(temp, '\0', 10000);
-
-        // while text is still being read from the file
-        while(fgets(temp, 9999, file)) {
-            // remove null terminator from temp
-            strncpy(temp, temp, strlen(temp));
-
-            // concat temp string to save_string
-            strcat(save_string, temp);
-
-            // clear out temp string
-            memset(temp, '\0', 10000);
+    // send header, then the file from offset 0 (sendfile uses its own offset, so the shared fd is untouched)
+    struct iovec header = { "get\n", 4 };
+    int total = send_vectors(data_fd, &header, 1, true);
+    off_t offset = 0;
+    while (total >= 0 && (size_t) offset < file_size) {
+        ssize_t bytes_sent = sendfile(data_fd, file_fd, &offset, file_size - offset);
+        if (bytes_sent < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytes_sent < 0) {
+            total = -1;
+        } else if (bytes_sent == 0) {
+            // file got shorter since it was stat'ed, nothing left to send
+            break;
+        } else {
+            total += bytes_sent;
         }
-
-        // all reading done, file text stored to save_string and return true
-        return true;
     }
 
-    // open failed, return false
-    return false;
+    // uncork to push out the last partial packet, and return # bytes sent
+    cork = 0;
+    setsockopt(data_fd, IPPROTO_TCP, TCP_CORK, &cork, sizeof cork);
+    return total;
 }
 
 
@@ -475,156 +1290,2863 @@ int send_error(int client_fd, char* print_message, char* send_message) {
 
 
 /*************************************************************************
-* main method
-* Listens on a socket connection for an incoming connection from the client.
-* Once connected to a client, waits for a command. If the command is invalid,
-* send back an error on the already-opened connection. If the command is
-* valid, open up a new data connection and send the requested resource (list
-* or file) to the client at the specified data port. After receiving data, the
-* client will close the connection and the server will go back to listening
-* for new connections.
+* function send_all
+* Sends every byte of data over the provided socket, looping over short sends
+* Params:
+*   int socket (int pointing to connected socket)
+*   const char* data (bytes to send)
+*   size_t length (# of bytes to send)
+* Returns:
+*   int containing # of bytes sent, or -1 if the socket failed
+* Pre-conditions: Socket is connected
+* Post-conditions: All of data sent to client (unless an error occurred)
 *************************************************************************/
-int main(int argc, char* argv[]) {
-    // If # of args is not 2 (./ftserver <SERVER_PORT>) then print an error and quit
-    if (argc != 2) {
-        printf("Invalid input. Server must be started using following command:\n./ftserver <SERVER_PORT>\n");
-        return -1;
+int send_all(int socket, const char* data, size_t length) {
+    // keep track of how many bytes have gone out so far
+    size_t total = 0;
+
+    // loop until everything is sent, since send() may only take part of the data
+    while (total < length) {
+        int bytes_sent = send(socket, data + total, length - total, 0);
+        if (bytes_sent < 0) {
+            // retry if interrupted by a signal, otherwise give up
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        total += bytes_sent;
     }
 
-    // keep accepting client connections until SIGINT
-    bool keep_open = true;
+    // return # bytes sent
+    return total;
+}
 
-    // enum to store command received from server
-    cmd cmd;
 
-    // static size strings for use by server
-    char port[10], print_message[500], text_buffer[1000];
+// SHA-256 round constants (first 32 bits of the fractional parts of the cube roots of the first 64 primes)
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
 
-    // unknown size strings for use by server
-    char *file_buffer, *read_file;
+// rotate a 32 bit word right by n bits
+#define ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
 
-    // static size strings for info about client and command
-    char client_host[100], client_name[10], command[10], filename[100], data_port[10], service[10];
 
-    // file to be sent if client passes "-g"
-    FILE* requested_file = NULL;
+/*************************************************************************
+* function sha256_block
+* Mixes one 64 byte block into the SHA-256 hash state
+* Params:
+*   uint32_t* state (8 word hash state)
+*   const unsigned char* block (64 bytes of message)
+* Pre-conditions: state initialized by sha256
+* Post-conditions: state updated with the contents of block
+*************************************************************************/
+void sha256_block(uint32_t* state, const unsigned char* block) {
+    // Adapted from the pseudocode at https://en.wikipedia.org/wiki/SHA-2#Pseudocode
+    uint32_t w[64], a, b, c, d, e, f, g, h, temp1, temp2;
 
-    // ints to store socket #s and listen port number
-    int data_fd, new_fd, port_number, socket_fd;
+    // first 16 words come straight from the block (big endian)
+    for (int i = 0; i < 16; i++) {
+        w[i] = (uint32_t) block[i * 4] << 24 | (uint32_t) block[i * 4 + 1] << 16 |
+               (uint32_t) block[i * 4 + 2] << 8 | (uint32_t) block[i * 4 + 3];
+    }
 
-    // struct to hold size of client address
-    socklen_t address_size;
+    // extend into the remaining 48 words
+    for (int i = 16; i < 64; i++) {
+        uint32_t s0 = ROTR(w[i - 15], 7) ^ ROTR(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = ROTR(w[i - 2], 17) ^ ROTR(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
 
-    // structs for networking to hold client info
-    struct addrinfo data_hints, listen_hints, *data_res = NULL, *listen_res = NULL;
-    struct sockaddr_storage client_address;
+    // run the 64 compression rounds
+    a = state[0]; b = state[1]; c = state[2]; d = state[3];
+    e = state[4]; f = state[5]; g = state[6]; h = state[7];
+    for (int i = 0; i < 64; i++) {
+        temp1 = h + (ROTR(e, 6) ^ ROTR(e, 11) ^ ROTR(e, 25)) + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+        temp2 = (ROTR(a, 2) ^ ROTR(a, 13) ^ ROTR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g; g = f; f = e; e = d + temp1;
+        d = c; c = b; b = a; a = temp1 + temp2;
+    }
 
-    // struct to store info about file size
+    // add compressed block back into the state
+    state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+    state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+}
+
+
+/*************************************************************************
+* function sha256
+* Computes the SHA-256 digest of a buffer. Used to name chunks by content.
+* Params:
+*   const unsigned char* data (bytes to hash)
+*   size_t length (# of bytes to hash)
+*   unsigned char* digest (32 byte array to store the result)
+* Pre-conditions: None
+* Post-conditions: digest holds the SHA-256 of data
+*************************************************************************/
+void sha256(const unsigned char* data, size_t length, unsigned char* digest) {
+    // initial hash values (first 32 bits of the fractional parts of the square roots of the first 8 primes)
+    uint32_t state[8] = { 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                          0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 };
+    unsigned char block[64];
+    uint64_t bit_length = (uint64_t) length * 8;
+
+    // hash all full blocks directly out of data
+    size_t offset = 0;
+    while (length - offset >= 64) {
+        sha256_block(state, data + offset);
+        offset += 64;
+    }
+
+    // pad the last partial block with 0x80, zeros, and the message length in bits
+    size_t remaining = length - offset;
+    memset(block, 0, 64);
+    memcpy(block, data + offset, remaining);
+    block[remaining] = 0x80;
+
+    // if the length doesn't fit after the padding byte, it goes in one more block
+    if (remaining >= 56) {
+        sha256_block(state, block);
+        memset(block, 0, 64);
+    }
+    for (int i = 0; i < 8; i++) {
+        block[63 - i] = (unsigned char) (bit_length >> (i * 8));
+    }
+    sha256_block(state, block);
+
+    // write the state out as the digest (big endian)
+    for (int i = 0; i < 8; i++) {
+        digest[i * 4] = (unsigned char) (state[i] >> 24);
+        digest[i * 4 + 1] = (unsigned char) (state[i] >> 16);
+        digest[i * 4 + 2] = (unsigned char) (state[i] >> 8);
+        digest[i * 4 + 3] = (unsigned char) state[i];
+    }
+}
+
+
+/*************************************************************************
+* function digest_to_hex
+* Converts a binary digest into a lowercase hex string
+* Params:
+*   const unsigned char* digest (32 byte digest)
+*   char* hex (string of at least 65 chars to hold the result)
+* Pre-conditions: None
+* Post-conditions: hex holds the digest as a null-terminated string
+*************************************************************************/
+void digest_to_hex(const unsigned char* digest, char* hex) {
+    // print each byte as 2 hex chars
+    for (int i = 0; i < DIGEST_SIZE; i++) {
+        sprintf(&hex[i * 2], "%02x", digest[i]);
+    }
+    hex[DIGEST_HEX_SIZE - 1] = '\0';
+}
+
+
+/*************************************************************************
+* function hex_to_digest
+* Converts a hex string back into a binary digest
+* Params:
+*   const char* hex (64 char hex string)
+*   unsigned char* digest (32 byte array to hold the result)
+* Returns:
+*   bool if hex was a valid digest (true) or not (false)
+* Pre-conditions: None
+* Post-conditions: digest holds the parsed bytes if valid
+*************************************************************************/
+bool hex_to_digest(const char* hex, unsigned char* digest) {
+    // digest must be exactly 64 hex chars
+    if (strlen(hex) != DIGEST_HEX_SIZE - 1) {
+        return false;
+    }
+
+    // parse 2 chars at a time
+    for (int i = 0; i < DIGEST_SIZE; i++) {
+        unsigned int byte;
+        if (!isxdigit(hex[i * 2]) || !isxdigit(hex[i * 2 + 1]) || sscanf(&hex[i * 2], "%2x", &byte) != 1) {
+            return false;
+        }
+        digest[i] = (unsigned char) byte;
+    }
+    return true;
+}
+
+
+/*************************************************************************
+* function store_init
+* Creates the chunk store directories (if needed) and sets up the chunker
+* Params:
+*   chunk_store* store (store to initialize)
+*   char* root (directory where chunks and manifests are kept)
+* Returns:
+*   bool if store is ready (true) or directories could not be created (false)
+* Pre-conditions: Server started with -d
+* Post-conditions: <root>/chunks and <root>/manifests exist and cache is empty
+*************************************************************************/
+bool store_init(chunk_store* store, char* root) {
+    char path[512];
     struct stat stat_struct;
 
-    // clear port string and retrieve from arguments
-    memset(port, '\0', 10);
-    strcpy(port, argv[1]);
+    // clear out store (empty cache) and save root path
+    memset(store, 0, sizeof(chunk_store));
+    strncpy(store->root, root, sizeof(store->root) - 1);
 
-    // convert port number to int and check that it is in valid range
-    port_number = atoi(port);
-    if (port_number <= 1024 || port_number > 65535) {
-        // port is invalid, print error and quit to terminal
-        printf("%d is not a valid port number. Must be between 1025 and 65535.\n", port_number);
-        return -1;
+    // fill gear table for the rolling hash. uses a fixed seed (splitmix64) so that
+    // chunk boundaries, and therefore chunk hashes, are the same every time the server runs
+    uint64_t seed = 0;
+    for (int i = 0; i < 256; i++) {
+        seed += 0x9E3779B97F4A7C15ULL;
+        uint64_t z = seed;
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        store->gear[i] = z ^ (z >> 31);
     }
 
-    // port is valid, open and store socket # to socket_fd
-    socket_fd = open_listen_port(port, listen_hints, listen_res);
+    // create root, chunks, and manifests directories (fine if they already exist)
+    char* subdirs[3] = { "", "/chunks", "/manifests" };
+    for (int i = 0; i < 3; i++) {
+        snprintf(path, sizeof path, "%s%s", store->root, subdirs[i]);
+        mkdir(path, 0755);
+        if (stat(path, &stat_struct) != 0 || !S_ISDIR(stat_struct.st_mode)) {
+            return false;
+        }
+    }
+    return true;
+}
 
-    // get address size for accepting client connection
-    address_size = sizeof client_address;
 
-    // keep looping until SIGINT
-    while(keep_open) {
-        // listen for and accept client connection, store socket # to new_fd
-        new_fd = accept_client_connection(socket_fd, client_address, address_size, &client_host[0], &client_name[0], &service[0]);
+/*************************************************************************
+* function find_chunk_boundary
+* Finds where the next chunk ends using a gear rolling hash, so boundaries
+* depend on content rather than offset and shifted copies still dedup
+* Params:
+*   chunk_store* store (holds gear table)
+*   const unsigned char* data (start of the next chunk)
+*   size_t length (# of bytes left in the file)
+* Returns:
+*   size_t length of the next chunk
+* Pre-conditions: store initialized
+* Post-conditions: None
+*************************************************************************/
+size_t find_chunk_boundary(chunk_store* store, const unsigned char* data, size_t length) {
+    // rest of file fits in a minimum size chunk, just take all of it
+    if (length <= CHUNK_MIN_SIZE) {
+        return length;
+    }
 
-        // receive command from server
-        cmd = get_command(new_fd, text_buffer, &command[0], &filename[0], &data_port[0]);
+    // never look past the maximum chunk size
+    if (length > CHUNK_MAX_SIZE) {
+        length = CHUNK_MAX_SIZE;
+    }
 
-        // if command is 'list' or 'get', go to the next step
-        if (cmd == list || cmd == get) {
-            // if command is 'list'
-            if (cmd == list) {
-                // send OK message to client on control socket
-                send(new_fd, "OK", 3, 0);
+    // roll the hash forward and cut where its low bits are all zero
+    uint64_t hash = 0;
+    for (size_t i = CHUNK_MIN_SIZE; i < length; i++) {
+        hash = (hash << 1) + store->gear[data[i]];
+        if ((hash & CHUNK_MASK) == 0) {
+            return i + 1;
+        }
+    }
+    return length;
+}
 
-                // print message about request to terminal
-                printf("List directory requested on port %s\n", data_port);
 
-                // open data port at port number requested by client
-                data_fd = open_data_port(&client_host[0], &data_port[0], data_hints, data_res);
+/*************************************************************************
+* function store_write_chunk
+* Hashes a chunk and writes it to the store unless it is already there
+* Params:
+*   chunk_store* store (store to write to)
+*   const unsigned char* data (chunk contents)
+*   size_t size (chunk size)
+*   unsigned char* digest (32 byte array to store the chunk hash)
+* Returns:
+*   bool if chunk is in the store (true) or could not be written (false)
+* Pre-conditions: store initialized
+* Post-conditions: <root>/chunks/<hash> holds the chunk
+*************************************************************************/
+bool store_write_chunk(chunk_store* store, const unsigned char* data, size_t size, unsigned char* digest) {
+    char hex[DIGEST_HEX_SIZE], path[512], temp_path[600];
 
-                // print to terminal that directory contents being sent to client
-                printf("Sending directory contents to %s:%s\n\n", client_name, data_port);
+    // name the chunk after its contents
+    sha256(data, size, digest);
+    digest_to_hex(digest, hex);
+    snprintf(path, sizeof path, "%s/chunks/%s", store->root, hex);
 
-                // send directory to data connection and close data socket
-                send_list(text_buffer, data_fd);
-                close(data_fd);
-            } else {
-                // else if command is 'get'
+    // identical chunk already stored (by this file or another one), nothing to do
+    if (access(path, F_OK) == 0) {
+        return true;
+    }
 
-                // print message about request
-                printf("File \"%s\" requested on port %s\n", filename, data_port);
+    // write to a temp file and rename so a half-written chunk is never visible
+    snprintf(temp_path, sizeof temp_path, "%s.%d", path, (int) getpid());
+    FILE* chunk_file = fopen(temp_path, "wb");
+    if (chunk_file == NULL) {
+        return false;
+    }
+    size_t written = fwrite(data, 1, size, chunk_file);
+    fclose(chunk_file);
+    if (written != size || rename(temp_path, path) != 0) {
+        unlink(temp_path);
+        return false;
+    }
+    return true;
+}
 
-                // get stats about file, then get file size
-                // adapted from https://stackoverflow.com/questions/238603/how-can-i-get-a-files-size-in-c
-                stat(filename, &stat_struct);
-                size_t file_size = stat_struct.st_size;
 
-                // allocate memory for read_file string and file_buffer to be big enough for entire file
-                read_file = (char*) calloc(file_size + 1, sizeof(char));
-                file_buffer = (char*) calloc(file_size + 11, sizeof(char));
+/*************************************************************************
+* function store_manifest_path
+* Builds the path of a file's manifest. Files in a named root ("ROOT/FILE")
+* get "ROOT:FILE" so every manifest stays directly in the manifests folder
+* (root names can't contain ':', so this can't clash).
+* Params:
+*   chunk_store* store (store holding the manifest)
+*   char* filename (name of the file in the namespace)
+*   char* path (string to store the path to)
+*   size_t size (size of path)
+* Pre-conditions: None
+* Post-conditions: path holds the manifest's path
+*************************************************************************/
+void store_manifest_path(chunk_store* store, char* filename, char* path, size_t size) {
+    snprintf(path, size, "%s/manifests/%s", store->root, filename);
+    char* slash = strchr(path + strlen(store->root) + strlen("/manifests/"), '/');
+    if (slash != NULL) {
+        *slash = ':';
+    }
+}
 
-                // if file opened successfully, send to client
-                if(open_file(requested_file, filename, &read_file[0], file_size)) {
-                    // send OK message to client on control socket
-                    send(new_fd, "OK", 3, 0);
 
-                    // open data port at port number requested by client
-                    data_fd = open_data_port(&client_host[0], &data_port[0], data_hints, data_res);
+/*************************************************************************
+* function store_write_manifest
+* Saves the list of chunks for a file to <root>/manifests/<filename>
+* Params:
+*   chunk_store* store (store to write to)
+*   char* filename (name of the stored file)
+*   manifest* file_manifest (chunk list to save)
+* Returns:
+*   bool if manifest was saved (true) or not (false)
+* Pre-conditions: All chunks in file_manifest already written
+* Post-conditions: Manifest saved to disk
+*************************************************************************/
+bool store_write_manifest(chunk_store* store, char* filename, manifest* file_manifest) {
+    char hex[DIGEST_HEX_SIZE], path[512], temp_path[600];
 
-                    // print to terminal that file being sent to client
-                    printf("Sending \"%s\" to %s:%s\n\n", filename, client_name, data_port);
+    // write manifest to a temp file first, then rename over the old one
+    store_manifest_path(store, filename, path, sizeof path);
+    snprintf(temp_path, sizeof temp_path, "%s.%d", path, (int) getpid());
+    FILE* manifest_file = fopen(temp_path, "w");
+    if (manifest_file == NULL) {
+        return false;
+    }
 
-                    // send file to data connection and close data socket
-                    send_file(&read_file[0], file_buffer, data_fd, file_size);
-                    close(data_fd);
-                } else {
-                    // error opening file, send error message to client
+    // first line is file info, then one line per chunk
+    fprintf(manifest_file, "%ld %zu %d\n", file_manifest->mtime, file_manifest->file_size, file_manifest->count);
+    for (int i = 0; i < file_manifest->count; i++) {
+        digest_to_hex(file_manifest->refs[i].digest, hex);
+        fprintf(manifest_file, "%s %zu\n", hex, file_manifest->refs[i].size);
+    }
 
-                    // clear print_message string and format with error message
-                    memset(print_message, '\0', 500);
-                    sprintf(print_message, "File \"%s\" could not be found.\nSending error message to %s:%s\n", filename, client_name, port);
+    // close and move into place
+    if (fclose(manifest_file) != 0 || rename(temp_path, path) != 0) {
+        unlink(temp_path);
+        return false;
+    }
+    return true;
+}
 
-                    // print message to terminal and send "FILE NOT FOUND" to client
-                    send_error(new_fd, print_message, "FILE NOT FOUND");
+
+/*************************************************************************
+* function store_ingest
+* Splits a file into content-defined chunks and adds it to the store
+* Params:
+*   chunk_store* store (store to add file to)
+*   char* filename (file in the served directory)
+*   struct stat* file_stat (stat info for the file)
+*   manifest* file_manifest (filled with the chunk list of the file)
+* Returns:
+*   bool if file was stored (true) or not (false)
+* Pre-conditions: store initialized, filename is a regular file
+* Post-conditions: File chunks and manifest saved, file_manifest->refs must be freed by caller
+*************************************************************************/
+bool store_ingest(chunk_store* store, char* filename, struct stat* file_stat, manifest* file_manifest) {
+    // open file for reading
+    int fd = namespace_open_file(filename);
+    if (fd < 0) {
+        return false;
+    }
+
+    // window the file is read through, and list of chunks that grows as the file is split up
+    int capacity = 16;
+    unsigned char* window = (unsigned char*) malloc(STORE_READ_WINDOW);
+    file_manifest->count = 0;
+    file_manifest->refs = (chunk_ref*) calloc(capacity, sizeof(chunk_ref));
+    file_manifest->mtime = file_stat->st_mtime;
+    file_manifest->file_size = file_stat->st_size;
+    if (window == NULL || file_manifest->refs == NULL) {
+        close(fd);
+        free(window);
+        free(file_manifest->refs);
+        return false;
+    }
+
+    // cut the file into chunks and write each one to the store
+    bool ok = true, end_of_file = false;
+    size_t total_read = 0, buffered = 0;
+    while (ok) {
+        // top up the window (a chunk never spans more than CHUNK_MAX_SIZE, so the cuts match reading it all at once)
+        while (!end_of_file && buffered < STORE_READ_WINDOW) {
+            ssize_t bytes_read = read(fd, window + buffered, STORE_READ_WINDOW - buffered);
+            if (bytes_read < 0 && errno == EINTR) {
+                continue;
+            }
+            if (bytes_read < 0) {
+                ok = false;
+            }
+            if (bytes_read <= 0) {
+                end_of_file = true;
+            } else {
+                buffered += bytes_read;
+                total_read += bytes_read;
+            }
+        }
+        if (!ok || buffered == 0) {
+            break;
+        }
+
+        // store chunks while a whole maximum size chunk is buffered (or the rest of the file is)
+        size_t offset = 0;
+        while (ok && offset < buffered && (end_of_file || buffered - offset >= CHUNK_MAX_SIZE)) {
+            // make room for another chunk if the list is full
+            if (file_manifest->count == capacity) {
+                chunk_ref* grown = (chunk_ref*) realloc(file_manifest->refs, capacity * 2 * sizeof(chunk_ref));
+                if (grown == NULL) {
+                    ok = false;
+                    break;
                 }
+                file_manifest->refs = grown;
+                capacity *= 2;
             }
-        } else {
-            // invalid command (not 'list' or 'get'), send error message to client
 
-            // clear print_message string and format with error message
-            memset(print_message, '\0', 500);
-            sprintf(print_message, "Invalid Command.\n%s is not valid input.\nSending error message to %s:%s\n\n", text_buffer, client_name, port);
+            // find chunk end and store the chunk
+            chunk_ref* ref = &file_manifest->refs[file_manifest->count];
+            ref->size = find_chunk_boundary(store, window + offset, buffered - offset);
+            if (!store_write_chunk(store, window + offset, ref->size, ref->digest)) {
+                ok = false;
+                break;
+            }
 
-            // print message to terminal and send "INVALID COMMAND" to client
-            send_error(new_fd, print_message, "INVALID COMMAND");
+            // move on to next chunk
+            offset += ref->size;
+            file_manifest->count++;
         }
 
-        // close client connection on server side
-        close(new_fd);
+        // keep the unchunked tail at the front of the window
+        memmove(window, window + offset, buffered - offset);
+        buffered -= offset;
     }
+    close(fd);
+    free(window);
 
-    // close connection socket and listen to socket for new connection
-    close(socket_fd);
+    // file must have been read completely (it may have changed since it was stat'd), then save the manifest
+    if (!ok || total_read != file_manifest->file_size || !store_write_manifest(store, filename, file_manifest)) {
+        free(file_manifest->refs);
+        return false;
+    }
+    return true;
+}
+
+
+/*************************************************************************
+* function store_load_manifest
+* Reads the saved chunk list for a file from the store
+* Params:
+*   chunk_store* store (store to read from)
+*   char* filename (name of the stored file)
+*   manifest* file_manifest (filled with the chunk list of the file)
+* Returns:
+*   bool if manifest was found and valid (true) or not (false)
+* Pre-conditions: store initialized
+* Post-conditions: file_manifest filled, file_manifest->refs must be freed by caller
+*************************************************************************/
+bool store_load_manifest(chunk_store* store, char* filename, manifest* file_manifest) {
+    char hex[DIGEST_HEX_SIZE], path[512];
+
+    // open manifest for the file
+    store_manifest_path(store, filename, path, sizeof path);
+    FILE* manifest_file = fopen(path, "r");
+    if (manifest_file == NULL) {
+        return false;
+    }
+
+    // read file info line
+    if (fscanf(manifest_file, "%ld %zu %d", &file_manifest->mtime, &file_manifest->file_size, &file_manifest->count) != 3 ||
+            file_manifest->count < 0) {
+        fclose(manifest_file);
+        return false;
+    }
+
+    // read one line per chunk
+    file_manifest->refs = (chunk_ref*) calloc(file_manifest->count + 1, sizeof(chunk_ref));
+    for (int i = 0; i < file_manifest->count; i++) {
+        if (fscanf(manifest_file, "%64s %zu", hex, &file_manifest->refs[i].size) != 2 ||
+                !hex_to_digest(hex, file_manifest->refs[i].digest)) {
+            fclose(manifest_file);
+            free(file_manifest->refs);
+            return false;
+        }
+    }
+
+    // close file and return success
+    fclose(manifest_file);
+    return true;
+}
+
+
+/*************************************************************************
+* function store_get_manifest
+* Gets the chunk list for a requested file. If the file in the served
+* directory is newer than the stored copy (or was never stored), it is
+* ingested first. Files that were deleted after being stored are no longer
+* served, and their manifest is removed.
+* Params:
+*   chunk_store* store (store to read from)
+*   char* filename (name of the requested file)
+*   manifest* file_manifest (filled with the chunk list of the file)
+* Returns:
+*   bool if the file is in the store (true) or not (false)
+* Pre-conditions: Client requested filename
+* Post-conditions: file_manifest filled, file_manifest->refs must be freed by caller
+*************************************************************************/
+bool store_get_manifest(chunk_store* store, char* filename, manifest* file_manifest) {
+    struct stat file_stat;
+
+    // store only holds files directly in the served directories
+    const char* relative;
+    if (namespace_resolve(filename, &relative) == NULL) {
+        return false;
+    }
+
+    // look for an existing manifest
+    bool stored = store_load_manifest(store, filename, file_manifest);
+
+    // file is gone (or isn't a regular file any more), drop its manifest so -g and -c match -l
+    if (namespace_stat(filename, &file_stat) != 0 || !S_ISREG(file_stat.st_mode)) {
+        if (stored) {
+            char path[512];
+            free(file_manifest->refs);
+            store_manifest_path(store, filename, path, sizeof path);
+            unlink(path);
+        }
+        return false;
+    }
 
-    // return 0 at exit (should never happen)
+    // if file changed since it was stored, store it again
+    if (!stored || file_manifest->mtime != file_stat.st_mtime || file_manifest->file_size != (size_t) file_stat.st_size) {
+        if (stored) {
+            free(file_manifest->refs);
+        }
+        return store_ingest(store, filename, &file_stat, file_manifest);
+    }
+    return stored;
+}
+
+
+/*************************************************************************
+* function store_ingest_directory
+* Adds every regular file in the served directory to the store
+* Params:
+*   chunk_store* store (store to add files to)
+* Returns:
+*   int files (# of files stored)
+* Pre-conditions: store initialized
+* Post-conditions: All files in the served directories have up to date manifests
+*************************************************************************/
+int store_ingest_directory(chunk_store* store) {
+    int files = 0;
+    manifest file_manifest;
+    char name[320];
+
+    // store each file in every served directory (store_get_manifest skips directories and unchanged files)
+    namespace_cursor cursor = { 0, NULL };
+    while (namespace_next(&cursor, name, sizeof name)) {
+        if (store_get_manifest(store, name, &file_manifest)) {
+            free(file_manifest.refs);
+            files++;
+        }
+    }
+    return files;
+}
+
+
+/*************************************************************************
+* function cache_evict
+* Frees least recently used chunks until the cache is under its size
+* limit. Chunks that are currently being sent are skipped.
+* Params:
+*   chunk_store* store (store holding the cache)
+* Pre-conditions: None
+* Post-conditions: cache is at or below CHUNK_CACHE_BYTES if possible
+*************************************************************************/
+void cache_evict(chunk_store* store) {
+    // start at the least recently used end of the list
+    chunk* current = store->lru_tail;
+    while (store->cached_bytes > CHUNK_CACHE_BYTES && current != NULL) {
+        chunk* previous = current->lru_prev;
+
+        // only free chunks no one is using
+        if (current->refs == 0) {
+            // unlink from lru list
+            if (current->lru_prev) current->lru_prev->lru_next = current->lru_next;
+            else store->lru_head = current->lru_next;
+            if (current->lru_next) current->lru_next->lru_prev = current->lru_prev;
+            else store->lru_tail = current->lru_prev;
+
+            // unlink from hash bucket
+            chunk** link = &store->buckets[(current->digest[0] | current->digest[1] << 8) % CHUNK_CACHE_BUCKETS];
+            while (*link != current) {
+                link = &(*link)->bucket_next;
+            }
+            *link = current->bucket_next;
+
+            // free chunk memory
+            store->cached_bytes -= current->size;
+            free(current->data);
+            free(current);
+        }
+        current = previous;
+    }
+}
+
+
+/*************************************************************************
+* function cache_get
+* Gets a chunk from the in-memory cache, loading it from disk on a miss.
+* Every file containing the chunk shares the same copy in memory.
+* Params:
+*   chunk_store* store (store holding the cache)
+*   chunk_ref* ref (hash and size of chunk to get)
+* Returns:
+*   chunk* (with its reference count raised) or NULL if chunk is missing
+* Pre-conditions: store initialized
+* Post-conditions: Caller must pass the chunk to cache_release when done
+*************************************************************************/
+chunk* cache_get(chunk_store* store, chunk_ref* ref) {
+    char hex[DIGEST_HEX_SIZE], path[512];
+
+    // look for chunk in its hash bucket
+    unsigned int bucket = (ref->digest[0] | ref->digest[1] << 8) % CHUNK_CACHE_BUCKETS;
+    chunk* current = store->buckets[bucket];
+    while (current != NULL && memcmp(current->digest, ref->digest, DIGEST_SIZE) != 0) {
+        current = current->bucket_next;
+    }
+
+    if (current != NULL) {
+        // cache hit, move chunk to the front of the lru list if not already there
+        if (current != store->lru_head) {
+            current->lru_prev->lru_next = current->lru_next;
+            if (current->lru_next) current->lru_next->lru_prev = current->lru_prev;
+            else store->lru_tail = current->lru_prev;
+            current->lru_prev = NULL;
+            current->lru_next = store->lru_head;
+            store->lru_head->lru_prev = current;
+            store->lru_head = current;
+        }
+        current->refs++;
+        return current;
+    }
+
+    // cache miss, read chunk from disk
+    digest_to_hex(ref->digest, hex);
+    snprintf(path, sizeof path, "%s/chunks/%s", store->root, hex);
+    FILE* chunk_file = fopen(path, "rb");
+    if (chunk_file == NULL) {
+        return NULL;
+    }
+    current = (chunk*) calloc(1, sizeof(chunk));
+    current->data = (char*) malloc(ref->size + 1);
+    size_t bytes_read = fread(current->data, 1, ref->size, chunk_file);
+    fclose(chunk_file);
+    if (bytes_read != ref->size) {
+        free(current->data);
+        free(current);
+        return NULL;
+    }
+    memcpy(current->digest, ref->digest, DIGEST_SIZE);
+    current->size = ref->size;
+    current->refs = 1;
+
+    // add to hash bucket and front of lru list
+    current->bucket_next = store->buckets[bucket];
+    store->buckets[bucket] = current;
+    current->lru_next = store->lru_head;
+    if (store->lru_head) store->lru_head->lru_prev = current;
+    else store->lru_tail = current;
+    store->lru_head = current;
+    store->cached_bytes += current->size;
+
+    // make room if the cache grew past its limit
+    cache_evict(store);
+    return current;
+}
+
+
+/*************************************************************************
+* function cache_release
+* Drops a reference taken by cache_get so the chunk can be evicted
+* Params:
+*   chunk_store* store (store holding the cache)
+*   chunk* cached (chunk returned by cache_get)
+* Pre-conditions: cached was returned by cache_get
+* Post-conditions: cached may be freed if the cache is over its limit
+*************************************************************************/
+void cache_release(chunk_store* store, chunk* cached) {
+    cached->refs--;
+    cache_evict(store);
+}
+
+
+/*************************************************************************
+* function send_stored_chunks
+* Sends chunks straight out of the cache, STORE_SEND_BATCH at a time with
+* one sendmsg each, so they go out in full packets without being copied
+* into a send buffer first. The header (if any) goes with the first batch.
+* Params:
+*   chunk_store* store (store holding the chunks)
+*   int data_fd (int pointing to connected data socket)
+*   char* header (text to send before the chunks, or NULL)
+*   chunk_ref** refs (chunks to send, in order)
+*   int count (# of chunks)
+* Returns:
+*   int containing # of bytes sent, or -1 on error
+* Pre-conditions: Data connection open
+* Post-conditions: Header and chunks sent to client
+*************************************************************************/
+int send_stored_chunks(chunk_store* store, int data_fd, char* header, chunk_ref** refs, int count) {
+    struct iovec vectors[STORE_SEND_BATCH + 1];
+    chunk* batch[STORE_SEND_BATCH];
+    int total = 0, next = 0, vector_count = 0;
+
+    // header goes in front of the first batch
+    if (header != NULL) {
+        vectors[vector_count].iov_base = header;
+        vectors[vector_count++].iov_len = strlen(header);
+    }
+
+    while (total >= 0 && (next < count || vector_count > 0)) {
+        // hold the next batch of chunks in the cache while they're sent
+        int held = 0;
+        while (next < count && held < STORE_SEND_BATCH) {
+            chunk* cached = cache_get(store, refs[next]);
+            if (cached == NULL) {
+                printf("Chunk %d of file is missing from the store\n", next);
+                total = -1;
+                break;
+            }
+            batch[held++] = cached;
+            vectors[vector_count].iov_base = cached->data;
+            vectors[vector_count++].iov_len = cached->size;
+            next++;
+        }
+
+        // send the batch, telling the kernel more is coming if it isn't the last one
+        if (total >= 0) {
+            int bytes_sent = send_vectors(data_fd, vectors, vector_count, next < count);
+            total = bytes_sent < 0 ? -1 : total + bytes_sent;
+        }
+        for (int i = 0; i < held; i++) {
+            cache_release(store, batch[i]);
+        }
+        vector_count = 0;
+    }
+    return total;
+}
+
+
+/*************************************************************************
+* function send_stored_file
+* Reassembles a file from the chunk store and sends it to the client in
+* the same format as a regular 'get' ("get\n" followed by the contents)
+* Params:
+*   chunk_store* store (store holding the file)
+*   manifest* file_manifest (chunk list of the file)
+*   int data_fd (int pointing to connected data socket)
+* Returns:
+*   int containing # of bytes sent, or -1 on error
+* Pre-conditions: Client requested a file that is in the store
+* Post-conditions: File sent to client
+*************************************************************************/
+int send_stored_file(chunk_store* store, manifest* file_manifest, int data_fd) {
+    // list every chunk of the file, in order
+    chunk_ref** refs = (chunk_ref**) malloc((file_manifest->count + 1) * sizeof(chunk_ref*));
+    if (refs == NULL) {
+        return -1;
+    }
+    for (int i = 0; i < file_manifest->count; i++) {
+        refs[i] = &file_manifest->refs[i];
+    }
+
+    // send header (same as send_data) and chunks straight from the cache
+    int total = send_stored_chunks(store, data_fd, "get\n", refs, file_manifest->count);
+    free(refs);
+    return total;
+}
+
+
+/*************************************************************************
+* function send_chunk_list
+* Handles a '-c' request. Sends the file's chunk list ("chunks\n", then
+* "<hash> <size>" lines, then a blank line), reads back the hashes the
+* client doesn't have yet (one per line, blank line to end), and sends just
+* those chunks back to back in the order they were asked for.
+* Params:
+*   chunk_store* store (store holding the file)
+*   manifest* file_manifest (chunk list of the file)
+*   int data_fd (int pointing to connected data socket)
+* Returns:
+*   int containing # of chunk bytes sent, or -1 on error
+* Pre-conditions: Client requested chunks of a file that is in the store
+* Post-conditions: Client has every chunk of the file
+*************************************************************************/
+int send_chunk_list(chunk_store* store, manifest* file_manifest, int data_fd) {
+    char hex[DIGEST_HEX_SIZE];
+
+    // build the whole chunk list (header, one line per chunk, blank line) and send it at once
+    char* list_text = (char*) malloc((file_manifest->count + 1) * (DIGEST_HEX_SIZE + 24) + 16);
+    if (list_text == NULL) {
+        return -1;
+    }
+    size_t list_length = sprintf(list_text, "chunks\n");
+    for (int i = 0; i < file_manifest->count; i++) {
+        digest_to_hex(file_manifest->refs[i].digest, hex);
+        list_length += sprintf(list_text + list_length, "%s %zu\n", hex, file_manifest->refs[i].size);
+    }
+    list_length += sprintf(list_text + list_length, "\n");
+    int list_sent = send_all(data_fd, list_text, list_length);
+    free(list_text);
+    if (list_sent < 0) {
+        return -1;
+    }
+
+    // read list of needed hashes until a blank line (or the client hangs up)
+    size_t capacity = (file_manifest->count + 1) * DIGEST_HEX_SIZE + 2, length = 0;
+    char* needed = (char*) calloc(capacity + 1, sizeof(char));
+    while (length < capacity && !(length == 1 && needed[0] == '\n') &&
+            !(length >= 2 && needed[length - 1] == '\n' && needed[length - 2] == '\n')) {
+        int bytes_read = recv(data_fd, needed + length, capacity - length, 0);
+        if (bytes_read <= 0) {
+            break;
+        }
+        length += bytes_read;
+    }
+
+    // find each needed chunk that belongs to this file (the client can't ask for more chunks than the list has)
+    chunk_ref** refs = (chunk_ref**) malloc((file_manifest->count + 1) * sizeof(chunk_ref*));
+    int ref_count = 0;
+    char* token = strtok(needed, "\n");
+    while (refs != NULL && token != NULL && ref_count < file_manifest->count) {
+        unsigned char digest[DIGEST_SIZE];
+        if (hex_to_digest(token, digest)) {
+            for (int i = 0; i < file_manifest->count; i++) {
+                if (memcmp(file_manifest->refs[i].digest, digest, DIGEST_SIZE) == 0) {
+                    refs[ref_count++] = &file_manifest->refs[i];
+                    break;
+                }
+            }
+        }
+        token = strtok(NULL, "\n");
+    }
+
+    // send them in batches, then free lists and return # bytes sent
+    int total = refs == NULL ? -1 : send_stored_chunks(store, data_fd, NULL, refs, ref_count);
+    free(refs);
+    free(needed);
+    return total;
+}
+
+
+/*************************************************************************
+* function send_from_store
+* Handles a '-g' or '-c' request when the server is running with a chunk
+* store. Sends OK and the file (or chunks) if it is in the store, otherwise
+* sends an error on the control connection.
+* Params:
+*   chunk_store* store (store holding the files)
+*   cmd cmd (enum holding type of command sent by client, 'get' or 'chunks')
+*   int client_fd (int pointing to client control socket)
+*   char* filename (string holding the requested file's name)
+*   struct sockaddr_storage* client_address (address of the client's control connection)
+*   char* client_name (string holding client name for printing)
+*   char* data_port (string holding data port provided by client)
+*   char* port (string holding server port for printing)
+* Returns:
+*   int containing # of bytes sent, or -1 on error
+* Pre-conditions: Client requested a file, server started with -d
+* Post-conditions: File or error sent to client
+*************************************************************************/
+int send_from_store(chunk_store* store, cmd cmd, int client_fd, char* filename, struct sockaddr_storage* client_address, char* client_name, char* data_port, char* port) {
+    // struct for chunk list
+    manifest file_manifest;
+    char print_message[500];
+    int return_value;
+
+    // if file isn't in the store (and can't be added), send error to client
+    uint64_t started = trace_start();
+    bool found = store_get_manifest(store, filename, &file_manifest);
+    trace_end(trace_open, started);
+    if (!found) {
+        memset(print_message, '\0', 500);
+        sprintf(print_message, "File \"%s\" could not be found.\nSending error message to %s:%s\n", filename, client_name, port);
+        return send_error(client_fd, print_message, "FILE NOT FOUND");
+    }
+
+    // send OK message to client on control socket
+    send(client_fd, "OK", 3, 0);
+
+    // open data port at port number requested by client, nothing to send if the client isn't listening
+    int data_fd = open_data_port(client_address, data_port);
+    if (data_fd < 0) {
+        printf("Could not connect to data port %s:%s\n\n", client_name, data_port);
+        free(file_manifest.refs);
+        return -1;
+    }
+
+    // print to terminal and send whole file or chunk list over data connection
+    started = trace_start();
+    if (cmd == chunks) {
+        printf("Sending chunks of \"%s\" to %s:%s\n\n", filename, client_name, data_port);
+        return_value = send_chunk_list(store, &file_manifest, data_fd);
+    } else {
+        printf("Sending \"%s\" to %s:%s\n\n", filename, client_name, data_port);
+        return_value = send_stored_file(store, &file_manifest, data_fd);
+    }
+    trace_end(trace_send, started);
+
+    // close data socket, free chunk list, and return # bytes sent
+    started = trace_start();
+    close(data_fd);
+    trace_end(trace_close, started);
+    free(file_manifest.refs);
+    return return_value;
+}
+
+
+/*************************************************************************
+* function make_trigram
+* Packs 3 bytes into a trigram, lowercasing them so searches ignore case
+* Params:
+*   const unsigned char* text (first of the 3 bytes)
+* Returns:
+*   uint32_t trigram (24 bits)
+* Pre-conditions: text has at least 3 bytes
+* Post-conditions: None
+*************************************************************************/
+uint32_t make_trigram(const unsigned char* text) {
+    return ((uint32_t) tolower(text[0]) << 16) | ((uint32_t) tolower(text[1]) << 8) | (uint32_t) tolower(text[2]);
+}
+
+
+/*************************************************************************
+* function index_init
+* Allocates an empty search index
+* Returns:
+*   search_index* (new index), or NULL if out of memory
+* Pre-conditions: None
+* Post-conditions: Index has no files, index_refresh fills it in
+*************************************************************************/
+search_index* index_init() {
+    search_index* index = calloc(1, sizeof(search_index));
+    if (index == NULL) {
+        return NULL;
+    }
+
+    // mark every filename bucket as empty
+    for (int i = 0; i < INDEX_NAME_BUCKETS; i++) {
+        index->names[i] = -1;
+    }
+    return index;
+}
+
+
+/*************************************************************************
+* function index_free
+* Frees a search index and everything in it
+* Params:
+*   search_index* index (index to free, may be NULL)
+* Pre-conditions: None
+* Post-conditions: index no longer usable
+*************************************************************************/
+void index_free(search_index* index) {
+    if (index == NULL) {
+        return;
+    }
+
+    // free every posting list
+    for (int i = 0; i < INDEX_BUCKETS; i++) {
+        posting_list* list = index->buckets[i];
+        while (list != NULL) {
+            posting_list* next = list->next;
+            free(list->files);
+            free(list);
+            list = next;
+        }
+    }
+
+    // free each file's trigram list, then the files and the index
+    for (int i = 0; i < index->file_count; i++) {
+        free(index->files[i].trigrams);
+    }
+    free(index->files);
+    free(index);
+}
+
+
+/*************************************************************************
+* function index_name_bucket
+* Hashes a filename (FNV-1a) to pick its bucket in the filename table
+* Params:
+*   const char* name (filename)
+* Returns:
+*   unsigned int bucket #
+* Pre-conditions: None
+* Post-conditions: None
+*************************************************************************/
+unsigned int index_name_bucket(const char* name) {
+    uint32_t hash = 2166136261u;
+    while (*name != '\0') {
+        hash = (hash ^ (unsigned char) *name++) * 16777619u;
+    }
+    return hash % INDEX_NAME_BUCKETS;
+}
+
+
+/*************************************************************************
+* function index_find_posting
+* Finds the posting list for a trigram, creating it if asked to
+* Params:
+*   search_index* index (index to look in)
+*   uint32_t trigram (trigram to find)
+*   bool create (true to add an empty list if there isn't one)
+* Returns:
+*   posting_list* (the list), or NULL if not found (or out of memory)
+* Pre-conditions: None
+* Post-conditions: If create, the trigram has a posting list
+*************************************************************************/
+posting_list* index_find_posting(search_index* index, uint32_t trigram, bool create) {
+    // mix the trigram bits so similar trigrams land in different buckets
+    unsigned int bucket = (trigram * 2654435761u) >> 16;
+    posting_list* list;
+
+    for (list = index->buckets[bucket]; list != NULL; list = list->next) {
+        if (list->trigram == trigram) {
+            return list;
+        }
+    }
+
+    if (!create || (list = calloc(1, sizeof(posting_list))) == NULL) {
+        return NULL;
+    }
+    list->trigram = trigram;
+    list->next = index->buckets[bucket];
+    index->buckets[bucket] = list;
+    return list;
+}
+
+
+/*************************************************************************
+* function index_remove_file
+* Takes a file out of the index. Only the posting lists of trigrams the
+* file contained are touched. The file's slot is kept for reuse.
+* Params:
+*   search_index* index (index holding the file)
+*   int file_id (slot # of the file)
+* Pre-conditions: Slot is in use
+* Post-conditions: No posting list refers to the file and the slot is free
+*************************************************************************/
+void index_remove_file(search_index* index, int file_id) {
+    indexed_file* file = &index->files[file_id];
+
+    // remove the file from each of its posting lists (order in a list doesn't matter, so swap in the last entry)
+    for (int i = 0; i < file->trigram_count; i++) {
+        posting_list* list = index_find_posting(index, file->trigrams[i], false);
+        if (list == NULL) {
+            continue;
+        }
+        for (int j = 0; j < list->count; j++) {
+            if (list->files[j] == file_id) {
+                list->files[j] = list->files[--list->count];
+                break;
+            }
+        }
+    }
+    free(file->trigrams);
+    file->trigrams = NULL;
+    file->trigram_count = 0;
+
+    // unlink the slot from its filename bucket
+    int* link = &index->names[index_name_bucket(file->name)];
+    while (*link != file_id) {
+        link = &index->files[*link].name_next;
+    }
+    *link = file->name_next;
+    file->used = false;
+}
+
+
+/*************************************************************************
+* function index_read_file
+* Reads a whole file into memory
+* Params:
+*   const char* filename (file to read)
+*   size_t file_size (# of bytes to read)
+* Returns:
+*   char* (file contents followed by '\0', caller frees), or NULL on error
+* Pre-conditions: None
+* Post-conditions: None
+*************************************************************************/
+char* index_read_file(const char* filename, size_t file_size) {
+    int fd = namespace_open_file(filename);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    char* contents = malloc(file_size + 1);
+    size_t total = 0;
+    while (contents != NULL && total < file_size) {
+        ssize_t bytes_read = read(fd, contents + total, file_size - total);
+        if (bytes_read < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytes_read <= 0) {
+            break;
+        }
+        total += bytes_read;
+    }
+    close(fd);
+
+    // file may have shrunk since it was stat'ed, only keep what was read
+    if (contents != NULL) {
+        contents[total] = '\0';
+    }
+    return contents;
+}
+
+
+/*************************************************************************
+* function index_add_file
+* Reads a file and adds each distinct trigram in it to the index. Files
+* that look binary (a NUL byte near the start) or are too big are kept
+* in the index without trigrams so they aren't read again until they change.
+* Params:
+*   search_index* index (index to add to)
+*   int file_id (free slot # to put the file in)
+*   const char* filename (name of the file in the served directory)
+*   struct stat* file_stat (file's stats)
+* Pre-conditions: Slot is not in use
+* Post-conditions: File is in the index
+*************************************************************************/
+void index_add_file(search_index* index, int file_id, const char* filename, struct stat* file_stat) {
+    indexed_file* file = &index->files[file_id];
+
+    // fill in the slot and link it into its filename bucket
+    memset(file, 0, sizeof(indexed_file));
+    strncpy(file->name, filename, sizeof(file->name) - 1);
+    file->mtime = file_stat->st_mtime;
+    file->size = file_stat->st_size;
+    file->used = true;
+    file->present = true;
+    unsigned int bucket = index_name_bucket(file->name);
+    file->name_next = index->names[bucket];
+    index->names[bucket] = file_id;
+
+    // skip files that are too big to index
+    if (file_stat->st_size > INDEX_MAX_FILE_SIZE) {
+        return;
+    }
+    size_t size = file_stat->st_size;
+    unsigned char* contents = (unsigned char*) index_read_file(filename, size);
+    if (contents == NULL) {
+        return;
+    }
+
+    // skip binary files
+    size = strlen((char*) contents);
+    if (size < (size_t) file_stat->st_size && size < INDEX_SNIFF_SIZE) {
+        free(contents);
+        return;
+    }
+    file->text = true;
+
+    // collect each distinct trigram once, using the seen bitmap. trigrams
+    // across line breaks are left out since matches never span lines
+    int capacity = 0;
+    for (size_t i = 0; i + 2 < size; i++) {
+        if (contents[i] == '\n' || contents[i + 1] == '\n' || contents[i + 2] == '\n') {
+            continue;
+        }
+        uint32_t trigram = make_trigram(&contents[i]);
+        if (index->seen[trigram >> 3] & (1 << (trigram & 7))) {
+            continue;
+        }
+        index->seen[trigram >> 3] |= 1 << (trigram & 7);
+
+        // grow the file's trigram list if needed
+        if (file->trigram_count == capacity) {
+            capacity = capacity == 0 ? 1024 : capacity * 2;
+            uint32_t* grown = realloc(file->trigrams, capacity * sizeof(uint32_t));
+            if (grown == NULL) {
+                break;
+            }
+            file->trigrams = grown;
+        }
+        file->trigrams[file->trigram_count++] = trigram;
+    }
+    free(contents);
+
+    // add the file to each trigram's posting list, and clear the bitmap for the next file
+    for (int i = 0; i < file->trigram_count; i++) {
+        uint32_t trigram = file->trigrams[i];
+        index->seen[trigram >> 3] &= ~(1 << (trigram & 7));
+
+        posting_list* list = index_find_posting(index, trigram, true);
+        if (list == NULL) {
+            continue;
+        }
+        if (list->count == list->capacity) {
+            int new_capacity = list->capacity == 0 ? 4 : list->capacity * 2;
+            int* grown = realloc(list->files, new_capacity * sizeof(int));
+            if (grown == NULL) {
+                continue;
+            }
+            list->files = grown;
+            list->capacity = new_capacity;
+        }
+        list->files[list->count++] = file_id;
+    }
+}
+
+
+/*************************************************************************
+* function index_refresh
+* Brings the index up to date with the served directories. Only files that
+* are new or whose mtime or size changed are read again, and files that
+* are gone are taken out.
+* Params:
+*   search_index* index (index to refresh)
+* Returns:
+*   int files (# of text files in the index)
+* Pre-conditions: index created by index_init
+* Post-conditions: index matches the files in the served directories
+*************************************************************************/
+int index_refresh(search_index* index) {
+    struct stat file_stat;
+    char name[320];
+    int files = 0;
+
+    // nothing has been seen yet this pass
+    for (int i = 0; i < index->file_count; i++) {
+        index->files[i].present = false;
+    }
+
+    namespace_cursor cursor = { 0, NULL };
+    while (namespace_next(&cursor, name, sizeof name)) {
+        // only index regular files
+        if (strlen(name) >= sizeof(index->files[0].name) || namespace_stat(name, &file_stat) != 0 || !S_ISREG(file_stat.st_mode)) {
+            continue;
+        }
+
+        // look the file up by name
+        int file_id = index->names[index_name_bucket(name)];
+        while (file_id >= 0 && strcmp(index->files[file_id].name, name) != 0) {
+            file_id = index->files[file_id].name_next;
+        }
+
+        // unchanged, keep it as it is
+        if (file_id >= 0 && index->files[file_id].mtime == file_stat.st_mtime && index->files[file_id].size == file_stat.st_size) {
+            index->files[file_id].present = true;
+            continue;
+        }
+
+        // changed, drop the old trigrams and index it again in the same slot
+        if (file_id >= 0) {
+            index_remove_file(index, file_id);
+        } else {
+            // new file, reuse a free slot or add one at the end
+            for (file_id = 0; file_id < index->file_count && index->files[file_id].used; file_id++);
+            if (file_id == index->file_capacity) {
+                int new_capacity = index->file_capacity == 0 ? 64 : index->file_capacity * 2;
+                indexed_file* grown = realloc(index->files, new_capacity * sizeof(indexed_file));
+                if (grown == NULL) {
+                    continue;
+                }
+                index->files = grown;
+                index->file_capacity = new_capacity;
+            }
+            if (file_id == index->file_count) {
+                index->file_count++;
+            }
+        }
+        index_add_file(index, file_id, name, &file_stat);
+    }
+
+    // take out files that were deleted, and count the rest
+    for (int i = 0; i < index->file_count; i++) {
+        if (index->files[i].used && !index->files[i].present) {
+            index_remove_file(index, i);
+        } else if (index->files[i].used && index->files[i].text) {
+            files++;
+        }
+    }
+    return files;
+}
+
+
+/*************************************************************************
+* function compare_file_names
+* qsort comparator that orders indexed files by name
+* Params:
+*   const void* a, const void* b (pointers to indexed_file pointers)
+* Returns:
+*   int (<0, 0, or >0 like strcmp)
+* Pre-conditions: None
+* Post-conditions: None
+*************************************************************************/
+int compare_file_names(const void* a, const void* b) {
+    return strcmp((*(indexed_file**) a)->name, (*(indexed_file**) b)->name);
+}
+
+
+/*************************************************************************
+* function index_search
+* Finds the lines containing term (ignoring case) in the indexed files.
+* Terms of 3 or more characters only check the files that contain every
+* trigram of the term; shorter terms check every text file.
+* Params:
+*   search_index* index (up to date index)
+*   const char* term (text to look for)
+*   size_t* length (set to # of bytes in the results)
+* Returns:
+*   char* results ("name:line: snippet" lines, caller frees), or NULL if out of memory
+* Pre-conditions: index_refresh was just called
+* Post-conditions: None
+*************************************************************************/
+char* index_search(search_index* index, const char* term, size_t* length) {
+    size_t term_length = strlen(term);
+    int candidate_count = 0, matches = 0, needed = 0;
+
+    // results buffer, grown as lines are added
+    size_t capacity = 4096;
+    char* results = malloc(capacity);
+    *length = 0;
+
+    // count how many of the term's distinct trigrams each file contains
+    int* hits = calloc(index->file_count + 1, sizeof(int));
+    indexed_file** candidates = malloc((index->file_count + 1) * sizeof(indexed_file*));
+    if (results == NULL || hits == NULL || candidates == NULL) {
+        free(results);
+        free(hits);
+        free(candidates);
+        return NULL;
+    }
+    for (size_t i = 0; term_length >= 3 && i + 2 < term_length; i++) {
+        uint32_t trigram = make_trigram((const unsigned char*) &term[i]);
+
+        // skip trigrams already counted earlier in the term
+        bool repeated = false;
+        for (size_t j = 0; j < i && !repeated; j++) {
+            repeated = make_trigram((const unsigned char*) &term[j]) == trigram;
+        }
+        if (repeated) {
+            continue;
+        }
+        needed++;
+
+        posting_list* list = index_find_posting(index, trigram, false);
+        for (int j = 0; list != NULL && j < list->count; j++) {
+            hits[list->files[j]]++;
+        }
+    }
+
+    // candidates are the text files with every trigram, sorted by name
+    for (int i = 0; i < index->file_count; i++) {
+        if (index->files[i].used && index->files[i].text && hits[i] == needed) {
+            candidates[candidate_count++] = &index->files[i];
+        }
+    }
+    qsort(candidates, candidate_count, sizeof(indexed_file*), compare_file_names);
+
+    // check each candidate line by line, since trigrams can match without the whole term matching
+    for (int i = 0; i < candidate_count && matches < SEARCH_MAX_RESULTS; i++) {
+        char* contents = index_read_file(candidates[i]->name, candidates[i]->size);
+        if (contents == NULL) {
+            continue;
+        }
+
+        char* line = contents;
+        for (int line_number = 1; line != NULL && *line != '\0' && matches < SEARCH_MAX_RESULTS; line_number++) {
+            // end the line in place so strcasestr only looks at this line
+            char* next = strchr(line, '\n');
+            if (next != NULL) {
+                *next++ = '\0';
+            }
+
+            char* found = strcasestr(line, term);
+            if (found != NULL) {
+                // snippet is the whole line, or a window around the match if the line is long
+                size_t line_length = strlen(line);
+                char* snippet = line;
+                if (line_length > SNIPPET_SIZE && found - line > SNIPPET_SIZE / 2) {
+                    snippet = found - SNIPPET_SIZE / 2;
+                }
+                int snippet_length = line_length - (snippet - line) > SNIPPET_SIZE ? SNIPPET_SIZE : line_length - (snippet - line);
+
+                // grow results if this line might not fit
+                size_t needed_size = *length + strlen(candidates[i]->name) + SNIPPET_SIZE + 32;
+                if (needed_size > capacity) {
+                    capacity = needed_size * 2;
+                    char* grown = realloc(results, capacity);
+                    if (grown == NULL) {
+                        break;
+                    }
+                    results = grown;
+                }
+                *length += sprintf(results + *length, "%s:%d: %.*s\n", candidates[i]->name, line_number, snippet_length, snippet);
+                matches++;
+            }
+            line = next;
+        }
+        free(contents);
+    }
+
+    free(hits);
+    free(candidates);
+    return results;
+}
+
+
+/*************************************************************************
+* function send_search
+* Refreshes the search index and sends the lines matching term to the client
+* Params:
+*   search_index* index (search index for the served directory)
+*   const char* term (text to look for)
+*   int data_fd (int pointing to connected data socket)
+* Returns:
+*   int containing # of bytes sent, or -1 on error
+* Pre-conditions: Client requested a search, data connection open
+* Post-conditions: "search" and the matching lines sent to client
+*************************************************************************/
+int send_search(search_index* index, const char* term, int data_fd) {
+    size_t length = 0;
+
+    // pick up files that were added, changed, or removed since the last search
+    index_refresh(index);
+    char* results = index_search(index, term, &length);
+
+    // send header line and results together
+    struct iovec vectors[2] = { { "search\n", 7 }, { results, results != NULL ? length : 0 } };
+    int return_value = send_vectors(data_fd, vectors, 2, false);
+    free(results);
+    return return_value;
+}
+
+
+/*************************************************************************
+* function watch_find
+* Finds the link pointing to a directory entry in the watcher's hash table
+* Params:
+*   dir_watch* watch (watcher to look in)
+*   const char* name (entry name)
+* Returns:
+*   watched_file** (link to the entry, or to the NULL at the end of its bucket if not found)
+* Pre-conditions: None
+* Post-conditions: None
+*************************************************************************/
+watched_file** watch_find(dir_watch* watch, const char* name) {
+    // FNV-1a hash of the name picks the bucket
+    uint32_t hash = 2166136261u;
+    for (const char* c = name; *c != '\0'; c++) {
+        hash = (hash ^ (unsigned char) *c) * 16777619u;
+    }
+
+    watched_file** link = &watch->buckets[hash % WATCH_BUCKETS];
+    while (*link != NULL && strcmp((*link)->name, name) != 0) {
+        link = &(*link)->next;
+    }
+    return link;
+}
+
+
+/*************************************************************************
+* function watch_add
+* Adds an entry to the watcher's copy of the directory
+* Params:
+*   dir_watch* watch (watcher to add to)
+*   const char* name (entry name)
+* Returns:
+*   bool true if the entry is new, false if it was already there
+* Pre-conditions: None
+* Post-conditions: Entry is in the directory copy and marked present
+*************************************************************************/
+bool watch_add(dir_watch* watch, const char* name) {
+    watched_file** link = watch_find(watch, name);
+    if (*link != NULL) {
+        (*link)->present = true;
+        return false;
+    }
+
+    watched_file* file = malloc(sizeof(watched_file));
+    if (file == NULL || (file->name = strdup(name)) == NULL) {
+        free(file);
+        return false;
+    }
+    file->present = true;
+    file->next = NULL;
+    *link = file;
+    watch->generation++;
+    return true;
+}
+
+
+/*************************************************************************
+* function watch_remove
+* Removes an entry from the watcher's copy of the directory
+* Params:
+*   dir_watch* watch (watcher to remove from)
+*   const char* name (entry name)
+* Returns:
+*   bool true if the entry was there
+* Pre-conditions: None
+* Post-conditions: Entry is not in the directory copy
+*************************************************************************/
+bool watch_remove(dir_watch* watch, const char* name) {
+    watched_file** link = watch_find(watch, name);
+    watched_file* file = *link;
+    if (file == NULL) {
+        return false;
+    }
+    *link = file->next;
+    free(file->name);
+    free(file);
+    watch->generation++;
+    return true;
+}
+
+
+/*************************************************************************
+* function watch_drop
+* Closes a subscriber's data connection and stops sending it changes
+* Params:
+*   dir_watch* watch (watcher holding the subscriber)
+*   int data_fd (subscriber's data socket)
+* Pre-conditions: None
+* Post-conditions: data_fd closed if it was a subscriber
+*************************************************************************/
+void watch_drop(dir_watch* watch, int data_fd) {
+    for (int i = 0; i < watch->subscriber_count; i++) {
+        if (watch->subscribers[i] == data_fd) {
+            close(data_fd);
+            watch->subscribers[i] = watch->subscribers[--watch->subscriber_count];
+            printf("Subscriber on socket %d disconnected\n", data_fd);
+            return;
+        }
+    }
+}
+
+
+/*************************************************************************
+* function watch_notify
+* Pushes a change to every subscriber as one "<event> <name>" line.
+* Subscribers that can't take the whole line right away are dropped so a
+* slow client never holds up the server.
+* Params:
+*   dir_watch* watch (watcher holding the subscribers)
+*   const char* event ("add", "modify", or "delete")
+*   const char* name (entry that changed)
+* Pre-conditions: None
+* Post-conditions: Change sent to every subscriber still connected
+*************************************************************************/
+void watch_notify(dir_watch* watch, const char* event, const char* name) {
+    char line[300];
+    int length = snprintf(line, sizeof line, "%s %s\n", event, name);
+    if (length >= (int) sizeof line) {
+        return;
+    }
+
+    // go backwards so dropping a subscriber doesn't skip the one swapped into its place
+    for (int i = watch->subscriber_count - 1; i >= 0; i--) {
+        if (send(watch->subscribers[i], line, length, MSG_DONTWAIT | MSG_NOSIGNAL) != length) {
+            watch_drop(watch, watch->subscribers[i]);
+        }
+    }
+}
+
+
+/*************************************************************************
+* function watch_scan
+* Reads every served directory and brings the watcher's copy up to date. Used
+* at startup, and again if inotify dropped events because its queue filled up.
+* Params:
+*   dir_watch* watch (watcher to update)
+*   bool notify (true to push the differences to subscribers)
+* Pre-conditions: None
+* Post-conditions: Directory copy matches the served directory
+*************************************************************************/
+void watch_scan(dir_watch* watch, bool notify) {
+    char name[320];
+
+    // nothing has been seen yet this pass
+    for (int i = 0; i < WATCH_BUCKETS; i++) {
+        for (watched_file* file = watch->buckets[i]; file != NULL; file = file->next) {
+            file->present = false;
+        }
+    }
+
+    // add (and mark) every entry in the served directories
+    namespace_cursor cursor = { 0, NULL };
+    while (namespace_next(&cursor, name, sizeof name)) {
+        if (watch_add(watch, name) && notify) {
+            watch_notify(watch, "add", name);
+        }
+    }
+
+    // remove entries that weren't seen
+    for (int i = 0; i < WATCH_BUCKETS; i++) {
+        watched_file** link = &watch->buckets[i];
+        while (*link != NULL) {
+            watched_file* file = *link;
+            if (file->present) {
+                link = &file->next;
+                continue;
+            }
+            *link = file->next;
+            watch->generation++;
+            if (notify) {
+                watch_notify(watch, "delete", file->name);
+            }
+            free(file->name);
+            free(file);
+        }
+    }
+}
+
+
+/*************************************************************************
+* function watch_init
+* Starts watching the served directories with inotify and reads their
+* contents. Cached file fds are trusted from then on, since any change that
+* could make one stale shows up as an event.
+* Returns:
+*   dir_watch* (new watcher), or NULL if inotify is not available
+* Pre-conditions: None
+* Post-conditions: Directory copy filled in, changes queued on inotify_fd
+*************************************************************************/
+dir_watch* watch_init() {
+    dir_watch* watch = calloc(1, sizeof(dir_watch));
+    if (watch == NULL) {
+        return NULL;
+    }
+
+    // watch before scanning, so nothing that changes during the scan is missed
+    watch->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    for (int i = 0; i < served->root_count && watch->inotify_fd >= 0; i++) {
+        watch->root_watches[i] = inotify_add_watch(watch->inotify_fd, served->roots[i].path, IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_CLOSE_WRITE);
+        if (watch->root_watches[i] < 0) {
+            close(watch->inotify_fd);
+            watch->inotify_fd = -1;
+        }
+    }
+    if (watch->inotify_fd < 0) {
+        free(watch);
+        return NULL;
+    }
+
+    // drop files cached before watching started, since changes to them may have been missed
+    namespace_forget(NULL);
+    served->watched = true;
+    watch_scan(watch, false);
+    return watch;
+}
+
+
+/*************************************************************************
+* function watch_update
+* Applies every change inotify has queued to the directory copy and
+* pushes each one to subscribers
+* Params:
+*   dir_watch* watch (watcher to update)
+* Pre-conditions: watch created by watch_init
+* Post-conditions: No changes left queued on inotify_fd
+*************************************************************************/
+void watch_update(dir_watch* watch) {
+    // buffer aligned for struct inotify_event
+    char buffer[WATCH_EVENT_BUFFER] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    char name[320];
+    ssize_t length;
+
+    // read until the queue is empty (inotify_fd is non-blocking)
+    while ((length = read(watch->inotify_fd, buffer, sizeof buffer)) > 0) {
+        for (char* position = buffer; position < buffer + length; ) {
+            struct inotify_event* event = (struct inotify_event*) position;
+            position += sizeof(struct inotify_event) + event->len;
+
+            // queue overflowed and events were lost, forget cached files and read every directory again
+            if (event->mask & IN_Q_OVERFLOW) {
+                namespace_forget(NULL);
+                watch_scan(watch, true);
+                continue;
+            }
+            if (event->len == 0) {
+                continue;
+            }
+
+            // find which served directory the event is for, to get the name in the namespace
+            int root = 0;
+            while (root < served->root_count && watch->root_watches[root] != event->wd) {
+                root++;
+            }
+            if (root == served->root_count) {
+                continue;
+            }
+            served_root* served_dir = &served->roots[root];
+            if (snprintf(name, sizeof name, "%s%s%s", served_dir->name, served_dir->name[0] != '\0' ? "/" : "", event->name) >= (int) sizeof name) {
+                continue;
+            }
+
+            // whatever happened, a cached fd for this name may be stale now
+            namespace_forget(name);
+
+            // created or moved in is an add (or a modify if it replaced a file), deleted or moved out is a delete,
+            // and a file closed after writing is a modify (or an add if we hadn't seen it yet)
+            if (event->mask & (IN_CREATE | IN_MOVED_TO)) {
+                watch_notify(watch, watch_add(watch, name) ? "add" : "modify", name);
+            } else if (event->mask & (IN_DELETE | IN_MOVED_FROM)) {
+                if (watch_remove(watch, name)) {
+                    watch_notify(watch, "delete", name);
+                }
+            } else if (event->mask & IN_CLOSE_WRITE) {
+                watch_notify(watch, watch_add(watch, name) ? "add" : "modify", name);
+            }
+        }
+    }
+}
+
+
+/*************************************************************************
+* function watch_list
+* Copies the watcher's directory listing into dir_string (in the same
+* format as get_directory), without reading the directory again
+* Params:
+*   dir_watch* watch (up to date watcher)
+*   char* dir_string (string where contents of directory should be saved)
+* Returns:
+*   int files (# of files listed)
+* Pre-conditions: watch_update was just called
+* Post-conditions: dir_string contains directory contents (as many names as fit)
+*************************************************************************/
+int watch_list(dir_watch* watch, char* dir_string) {
+    int files = 0;
+    size_t length = 0;
+
+    // clear out directory string
+    memset(dir_string, '\0', 1000);
+
+    // add each name on its own line, leaving room for the null terminator
+    for (int i = 0; i < WATCH_BUCKETS; i++) {
+        for (watched_file* file = watch->buckets[i]; file != NULL; file = file->next) {
+            size_t name_length = strlen(file->name);
+            if (length + name_length + 2 > 1000) {
+                return files;
+            }
+            if (files > 0) {
+                dir_string[length++] = '\n';
+            }
+            memcpy(dir_string + length, file->name, name_length);
+            length += name_length;
+            files++;
+        }
+    }
+    return files;
+}
+
+
+/*************************************************************************
+* function watch_subscribe
+* Starts sending directory changes to a client's data connection
+* Params:
+*   dir_watch* watch (watcher to subscribe to)
+*   int data_fd (int pointing to connected data socket)
+* Returns:
+*   bool true if subscribed, false if there are too many subscribers
+* Pre-conditions: Client requested to watch the directory
+* Post-conditions: "watch" sent to client, later changes will follow
+*************************************************************************/
+bool watch_subscribe(dir_watch* watch, int data_fd) {
+    if (watch->subscriber_count == WATCH_MAX_SUBSCRIBERS || send_all(data_fd, "watch\n", 6) < 0) {
+        return false;
+    }
+    watch->subscribers[watch->subscriber_count++] = data_fd;
+    return true;
+}
+
+
+/*************************************************************************
+* function send_watched_list
+* Same as send_list, but the directory contents come from the watcher's
+* copy instead of reading the directory again
+* Params:
+*   dir_watch* watch (watcher for the served directory)
+*   int data_fd (int pointing to connected data socket)
+* Returns:
+*   int containing # of bytes sent
+* Pre-conditions: Client requested directory list from server
+* Post-conditions: Directory sent to client
+*************************************************************************/
+int send_watched_list(dir_watch* watch, int data_fd) {
+    char directory[1000];
+
+    // apply any changes inotify has queued, then list the directory copy
+    watch_update(watch);
+    watch_list(watch, &directory[0]);
+
+    // send directory to client and return # bytes sent
+    return send_data(&directory[0], strlen(directory), list, data_fd);
+}
+
+
+/*************************************************************************
+* function watch_close
+* Stops watching the directory, hanging up on every subscriber
+* Params:
+*   dir_watch* watch (watcher to close, may be NULL)
+* Pre-conditions: None
+* Post-conditions: watch freed and its sockets closed
+*************************************************************************/
+void watch_close(dir_watch* watch) {
+    if (watch == NULL) {
+        return;
+    }
+
+    // hang up on subscribers and stop inotify
+    for (int i = 0; i < watch->subscriber_count; i++) {
+        close(watch->subscribers[i]);
+    }
+    close(watch->inotify_fd);
+
+    // free directory copy
+    for (int i = 0; i < WATCH_BUCKETS; i++) {
+        watched_file* file = watch->buckets[i];
+        while (file != NULL) {
+            watched_file* next = file->next;
+            free(file->name);
+            free(file);
+            file = next;
+        }
+    }
+    free(watch);
+}
+
+
+/*************************************************************************
+* function compare_listing_names
+* qsort/bsearch comparator that orders filenames like ftclient sorts a
+* listing (ignoring case), breaking ties with case
+* Params:
+*   const void* a, const void* b (pointers to filename strings)
+* Returns:
+*   int (<0, 0, or >0 like strcmp)
+* Pre-conditions: None
+* Post-conditions: None
+*************************************************************************/
+int compare_listing_names(const void* a, const void* b) {
+    const char* name_a = *(const char**) a;
+    const char* name_b = *(const char**) b;
+    int result = strcasecmp(name_a, name_b);
+    return result != 0 ? result : strcmp(name_a, name_b);
+}
+
+
+/*************************************************************************
+* function prefetch_load_names
+* Gets a sorted listing of the served namespace. With a watcher the
+* listing is only rebuilt after the directory changed, otherwise the
+* directory is read each time.
+* Params:
+*   prefetcher* prefetch (prefetcher holding the listing)
+*   dir_watch* watch (directory watcher, or NULL)
+* Pre-conditions: None
+* Post-conditions: prefetch->names is sorted and up to date
+*************************************************************************/
+void prefetch_load_names(prefetcher* prefetch, dir_watch* watch) {
+    int capacity = 0;
+
+    // listing from the watcher is still good if nothing was added or removed since
+    if (watch != NULL) {
+        watch_update(watch);
+        if (prefetch->loaded && prefetch->generation == watch->generation) {
+            return;
+        }
+    }
+
+    // drop old listing
+    for (int i = 0; i < prefetch->name_count; i++) {
+        free(prefetch->names[i]);
+    }
+    prefetch->name_count = 0;
+
+    // copy names from the watcher, or read them from the served directories
+    namespace_cursor cursor = { 0, NULL };
+    char listed_name[320];
+    watched_file* file = NULL;
+    int bucket = 0;
+    while (true) {
+        const char* name;
+        if (watch != NULL) {
+            while (file == NULL && bucket < WATCH_BUCKETS) {
+                file = watch->buckets[bucket++];
+            }
+            if (file == NULL) {
+                break;
+            }
+            name = file->name;
+            file = file->next;
+        } else {
+            if (!namespace_next(&cursor, listed_name, sizeof listed_name)) {
+                break;
+            }
+            name = listed_name;
+        }
+
+        // grow listing if needed
+        if (prefetch->name_count == capacity || prefetch->names == NULL) {
+            capacity = capacity == 0 ? 256 : capacity * 2;
+            char** grown = realloc(prefetch->names, capacity * sizeof(char*));
+            if (grown == NULL) {
+                break;
+            }
+            prefetch->names = grown;
+        }
+        if ((prefetch->names[prefetch->name_count] = strdup(name)) != NULL) {
+            prefetch->name_count++;
+        }
+    }
+    qsort(prefetch->names, prefetch->name_count, sizeof(char*), compare_listing_names);
+    prefetch->loaded = watch != NULL;
+    prefetch->generation = watch != NULL ? watch->generation : 0;
+}
+
+
+/*************************************************************************
+* function prefetch_position
+* Finds a filename in the sorted listing
+* Params:
+*   prefetcher* prefetch (prefetcher holding the listing)
+*   const char* name (filename to find)
+* Returns:
+*   int position in the listing, or -1 if not there
+* Pre-conditions: prefetch_load_names was called
+* Post-conditions: None
+*************************************************************************/
+int prefetch_position(prefetcher* prefetch, const char* name) {
+    if (name[0] == '\0' || prefetch->name_count == 0) {
+        return -1;
+    }
+    char** found = bsearch(&name, prefetch->names, prefetch->name_count, sizeof(char*), compare_listing_names);
+    return found == NULL ? -1 : (int) (found - prefetch->names);
+}
+
+
+/*************************************************************************
+* function prefetch_file
+* Asks the kernel to start reading the beginning of a file into the page
+* cache in the background, so a later request for it doesn't wait on the disk.
+* The file is also left open in the file cache for when it's requested.
+* Params:
+*   const char* filename (file to read ahead)
+* Returns:
+*   bool true if read-ahead was started (false for missing files and directories)
+* Pre-conditions: None
+* Post-conditions: File reads queued, this doesn't wait for them
+*************************************************************************/
+bool prefetch_file(const char* filename) {
+    struct stat file_stat;
+
+    // only regular files are worth reading ahead (and keeping open)
+    if (namespace_stat(filename, &file_stat) != 0 || !S_ISREG(file_stat.st_mode)) {
+        return false;
+    }
+    int fd = namespace_cached_fd(filename);
+    return fd >= 0 && posix_fadvise(fd, 0, PREFETCH_BYTES, POSIX_FADV_WILLNEED) == 0;
+}
+
+
+/*************************************************************************
+* function prefetch_after_request
+* Records a client's file request. Once a client asks for a file shortly
+* after the one it asked for last in the listing (skipping fewer than
+* PREFETCH_DEPTH files), the next PREFETCH_DEPTH files are read ahead, and
+* each later request in order only reads ahead the files it moved past,
+* keeping PREFETCH_DEPTH files ahead of the client.
+* Params:
+*   prefetcher* prefetch (prefetcher to update)
+*   dir_watch* watch (directory watcher, or NULL)
+*   char* client_host (string holding client host)
+*   char* filename (string holding the requested file's name)
+* Pre-conditions: Client requested a file
+* Post-conditions: Next files read ahead if the client is going in order
+*************************************************************************/
+void prefetch_after_request(prefetcher* prefetch, dir_watch* watch, char* client_host, char* filename) {
+    client_history* client = NULL;
+    prefetch->requests++;
+
+    // find this client, or take over the least recently used slot
+    for (int i = 0; i < PREFETCH_CLIENTS; i++) {
+        if (strcmp(prefetch->clients[i].host, client_host) == 0) {
+            client = &prefetch->clients[i];
+            break;
+        }
+        if (client == NULL || prefetch->clients[i].last_used < client->last_used) {
+            client = &prefetch->clients[i];
+        }
+    }
+    if (strcmp(client->host, client_host) != 0) {
+        memset(client, 0, sizeof(client_history));
+        strncpy(client->host, client_host, sizeof(client->host) - 1);
+    }
+    client->last_used = prefetch->requests;
+
+    // is this file a little after the one this client asked for last?
+    prefetch_load_names(prefetch, watch);
+    int position = prefetch_position(prefetch, filename);
+    int last_position = prefetch_position(prefetch, client->last_name);
+    strncpy(client->last_name, filename, sizeof(client->last_name) - 1);
+    if (position < 0 || last_position < 0 || position <= last_position || position > last_position + PREFETCH_DEPTH) {
+        client->prefetched_name[0] = '\0';
+        return;
+    }
+
+    // read ahead from after whatever was already read ahead, up to PREFETCH_DEPTH files past this one
+    int start = position + 1;
+    int prefetched_position = prefetch_position(prefetch, client->prefetched_name);
+    if (prefetched_position >= start) {
+        start = prefetched_position + 1;
+    }
+    int end = position + PREFETCH_DEPTH;
+    if (end >= prefetch->name_count) {
+        end = prefetch->name_count - 1;
+    }
+    int files = 0;
+    for (int i = start; i <= end; i++) {
+        files += prefetch_file(prefetch->names[i]);
+    }
+    if (end >= start) {
+        strncpy(client->prefetched_name, prefetch->names[end], sizeof(client->prefetched_name) - 1);
+    }
+    if (files > 0) {
+        printf("Reading ahead %d file(s) after \"%s\" for %s\n", files, filename, client_host);
+    }
+}
+
+
+/*************************************************************************
+* function prefetch_free
+* Frees the prefetcher's listing
+* Params:
+*   prefetcher* prefetch (prefetcher to clean up)
+* Pre-conditions: None
+* Post-conditions: Listing freed
+*************************************************************************/
+void prefetch_free(prefetcher* prefetch) {
+    for (int i = 0; i < prefetch->name_count; i++) {
+        free(prefetch->names[i]);
+    }
+    free(prefetch->names);
+}
+
+
+/*************************************************************************
+* function handle_stop_signal
+* Signal handler for SIGTERM and SIGINT. Asks the server to stop once the
+* request in progress (and any connections already queued) are finished.
+* Params:
+*   int signal_number (signal that was caught)
+* Pre-conditions: Installed by setup_stop_signals
+* Post-conditions: stop_requested is set
+*************************************************************************/
+void handle_stop_signal(int signal_number) {
+    (void) signal_number;
+    stop_requested = 1;
+}
+
+
+/*************************************************************************
+* function setup_stop_signals
+* Installs the stop handler and blocks SIGTERM/SIGINT everywhere except while
+* waiting for a connection, so a signal never interrupts a transfer halfway.
+* Calling it again (once the listen socket is open) just gets wait_mask.
+* Params:
+*   sigset_t* wait_mask (set to the signal mask to use while waiting)
+* Pre-conditions: None
+* Post-conditions: SIGTERM/SIGINT blocked, SIGPIPE ignored, wait_mask set
+*************************************************************************/
+void setup_stop_signals(sigset_t* wait_mask) {
+    struct sigaction action;
+    sigset_t stop_signals;
+
+    // catch SIGTERM and SIGINT with handle_stop_signal
+    memset(&action, 0, sizeof action);
+    action.sa_handler = handle_stop_signal;
+    sigaction(SIGTERM, &action, NULL);
+    sigaction(SIGINT, &action, NULL);
+
+    // a client hanging up mid-transfer shouldn't kill the server
+    signal(SIGPIPE, SIG_IGN);
+
+    // block stop signals, and save the mask without them for use while waiting
+    sigemptyset(&stop_signals);
+    sigaddset(&stop_signals, SIGTERM);
+    sigaddset(&stop_signals, SIGINT);
+    sigprocmask(SIG_BLOCK, &stop_signals, wait_mask);
+    sigdelset(wait_mask, SIGTERM);
+    sigdelset(wait_mask, SIGINT);
+}
+
+
+/*************************************************************************
+* function wait_for_client
+* Waits until a connection is ready to accept or a stop signal arrives.
+* Stop signals are only unblocked inside ppoll, so one that arrives just
+* before waiting is still seen and can't be lost. While waiting, directory
+* changes are pushed to subscribers and subscribers that hang up are dropped.
+* Params:
+*   int socket_fd (int pointing to listen socket)
+*   sigset_t* wait_mask (signal mask from setup_stop_signals)
+*   dir_watch* watch (directory watcher, or NULL if inotify isn't available)
+* Pre-conditions: setup_stop_signals was called
+* Post-conditions: Connection waiting on socket_fd, or stop_requested set
+*************************************************************************/
+void wait_for_client(int socket_fd, sigset_t* wait_mask, dir_watch* watch) {
+    // listen socket, inotify, and each subscriber's data socket
+    struct pollfd fds[2 + WATCH_MAX_SUBSCRIBERS];
+
+    while (!stop_requested) {
+        // poll listen socket for incoming connections
+        int count = 1;
+        fds[0].fd = socket_fd;
+        fds[0].events = POLLIN;
+
+        // poll inotify for changes, and subscribers for hanging up (they never send anything)
+        if (watch != NULL) {
+            fds[count].fd = watch->inotify_fd;
+            fds[count++].events = POLLIN;
+            for (int i = 0; i < watch->subscriber_count; i++) {
+                fds[count].fd = watch->subscribers[i];
+                fds[count++].events = POLLIN;
+            }
+        }
+        if (ppoll(fds, count, NULL, wait_mask) < 0) {
+            continue;
+        }
+
+        // push changes, then drop subscribers that hung up
+        if (watch != NULL) {
+            if (fds[1].revents) {
+                watch_update(watch);
+            }
+            for (int i = 2; i < count; i++) {
+                if (fds[i].revents) {
+                    watch_drop(watch, fds[i].fd);
+                }
+            }
+        }
+
+        // stop waiting once a client is ready to accept
+        if (fds[0].revents) {
+            return;
+        }
+    }
+}
+
+
+/*************************************************************************
+* function serve_clients
+* Accepts and handles client requests one at a time on the listen socket.
+* Once a stop signal arrives, the connections already queued on the socket
+* are still served before returning. The socket itself is left open (with
+* workers the master keeps it for the next worker), so no client is dropped.
+* Params:
+*   int socket_fd (int pointing to listen socket)
+*   chunk_store* store (chunk store, or NULL to serve files directly)
+*   char* port (string holding server port for printing)
+* Pre-conditions: socket_fd opened by open_listen_port
+* Post-conditions: Stop was requested and all queued clients were served
+*************************************************************************/
+void serve_clients(int socket_fd, chunk_store* store, char* port) {
+    // keep accepting client connections until stop is requested
+    bool keep_open = true;
+
+    // enum to store command received from server
+    cmd cmd;
+
+    // static size strings for use by server
+    char print_message[500], text_buffer[1000];
+
+    // static size strings for info about client and command
+    char client_host[100], client_name[100], command[10], filename[100], data_port[10], service[10];
+
+    // ints to store socket #s
+    int data_fd, new_fd;
+
+    // struct to hold size of client address
+    socklen_t address_size;
+
+    // struct for networking to hold client info
+    struct sockaddr_storage client_address;
+
+    // struct to store info about file size
+    struct stat stat_struct;
+
+    // search index, built the first time a client searches
+    search_index* index = NULL;
+
+    // watcher keeping the directory listing up to date (NULL if inotify isn't available)
+    dir_watch* watch = watch_init();
+
+    // recent file requests, for reading ahead when a client goes through the directory in order
+    prefetcher prefetch;
+    memset(&prefetch, 0, sizeof prefetch);
+
+    // signal mask to use while waiting for clients
+    sigset_t wait_mask;
+    setup_stop_signals(&wait_mask);
+
+    // client name cache, started after stop signals are blocked so its thread never gets them
+    name_resolver* resolver = resolver_init();
+
+    // get address size for accepting client connection
+    address_size = sizeof client_address;
+
+    // when each request and its phases started, for tracing
+    uint64_t request_started, started;
+
+    // keep looping until stop is requested
+    while(keep_open) {
+        // wait for a client, unless stopping (then only connections already queued are accepted)
+        if (!stop_requested) {
+            wait_for_client(socket_fd, &wait_mask, watch);
+        }
+
+        // accept client connection, store socket # to new_fd
+        request_started = trace_start();
+        new_fd = accept_client_connection(socket_fd, &client_address, address_size, &client_host[0], &client_name[0], &service[0], resolver);
+
+        // nothing to accept. if stopping, the queue is empty so we're done
+        if (new_fd < 0) {
+            if (stop_requested) {
+                keep_open = false;
+            }
+            continue;
+        }
+
+        // receive command from server
+        started = trace_start();
+        cmd = get_command(new_fd, text_buffer, &command[0], &filename[0], &data_port[0]);
+        trace_end(trace_parse, started);
+
+        // if command is 'list', 'get', 'chunks', 'search', or 'subscribe', go to the next step
+        if (cmd == list || cmd == get || cmd == chunks || cmd == search || cmd == subscribe) {
+            // if command is 'list'
+            if (cmd == list) {
+                // send OK message to client on control socket
+                send(new_fd, "OK", 3, 0);
+
+                // print message about request to terminal
+                printf("List directory requested on port %s\n", data_port);
+
+                // open data port at port number requested by client
+                data_fd = open_data_port(&client_address, &data_port[0]);
+                if (data_fd < 0) {
+                    printf("Could not connect to data port %s:%s\n\n", client_name, data_port);
+                } else {
+                    // print to terminal that directory contents being sent to client
+                    printf("Sending directory contents to %s:%s\n\n", client_name, data_port);
+
+                    // send directory (from the watcher if there is one) to data connection and close data socket
+                    started = trace_start();
+                    if (watch != NULL) {
+                        send_watched_list(watch, data_fd);
+                    } else {
+                        send_list(data_fd);
+                    }
+                    trace_end(trace_send, started);
+                    started = trace_start();
+                    close(data_fd);
+                    trace_end(trace_close, started);
+                }
+            } else if (cmd == subscribe) {
+                // else if command is 'subscribe', need inotify to see changes
+                if (watch == NULL) {
+                    memset(print_message, '\0', 500);
+                    sprintf(print_message, "Watch requested but directory watching is not available.\nSending error message to %s:%s\n", client_name, port);
+                    send_error(new_fd, print_message, "WATCH UNAVAILABLE");
+                } else {
+                    // send OK message to client on control socket
+                    send(new_fd, "OK", 3, 0);
+
+                    // print message about request to terminal
+                    printf("Watch directory requested on port %s\n", data_port);
+
+                    // open data port at port number requested by client
+                    data_fd = open_data_port(&client_address, &data_port[0]);
+                    if (data_fd < 0) {
+                        printf("Could not connect to data port %s:%s\n\n", client_name, data_port);
+                    } else {
+                        // catch up on changes first so the subscriber only hears about ones after it joined,
+                        // then keep the data socket open for pushing changes
+                        watch_update(watch);
+                        if (watch_subscribe(watch, data_fd)) {
+                            printf("Sending directory changes to %s:%s\n\n", client_name, data_port);
+                        } else {
+                            printf("Too many subscribers, hanging up on %s:%s\n\n", client_name, data_port);
+                            close(data_fd);
+                        }
+                    }
+                }
+            } else if (cmd == search) {
+                // else if command is 'search', build the index if this is the first search
+                if (index == NULL && (index = index_init()) == NULL) {
+                    memset(print_message, '\0', 500);
+                    sprintf(print_message, "Search for \"%s\" failed, out of memory.\nSending error message to %s:%s\n", filename, client_name, port);
+                    send_error(new_fd, print_message, "SEARCH FAILED");
+                } else {
+                    // send OK message to client on control socket
+                    send(new_fd, "OK", 3, 0);
+
+                    // print message about request to terminal
+                    printf("Search for \"%s\" requested on port %s\n", filename, data_port);
+
+                    // open data port at port number requested by client
+                    data_fd = open_data_port(&client_address, &data_port[0]);
+                    if (data_fd < 0) {
+                        printf("Could not connect to data port %s:%s\n\n", client_name, data_port);
+                    } else {
+                        // print to terminal that search results being sent to client
+                        printf("Sending search results to %s:%s\n\n", client_name, data_port);
+
+                        // refresh index, send matching lines to data connection, and close data socket
+                        started = trace_start();
+                        send_search(index, filename, data_fd);
+                        trace_end(trace_send, started);
+                        started = trace_start();
+                        close(data_fd);
+                        trace_end(trace_close, started);
+                    }
+                }
+            } else if (store != NULL) {
+                // else if command is 'get' or 'chunks' and files are kept in the chunk store
+
+                // print message about request, then send file from the store
+                printf("File \"%s\" requested on port %s\n", filename, data_port);
+                send_from_store(store, cmd, new_fd, &filename[0], &client_address, &client_name[0], &data_port[0], &port[0]);
+            } else if (cmd == chunks) {
+                // chunk list requested but there is no chunk store, send error message to client
+                memset(print_message, '\0', 500);
+                sprintf(print_message, "Chunks of \"%s\" requested but server has no chunk store.\nSending error message to %s:%s\n", filename, client_name, port);
+                send_error(new_fd, print_message, "CHUNK STORE DISABLED");
+            } else {
+                // else if command is 'get'
+
+                // print message about request
+                printf("File \"%s\" requested on port %s\n", filename, data_port);
+
+                // get file's fd (kept open between requests for hot files)
+                started = trace_start();
+                int file_fd = namespace_cached_fd(filename);
+                trace_end(trace_open, started);
+
+                // get stats about file (it must be a regular file), then get file size
+                started = trace_start();
+                bool found = file_fd >= 0 && fstat(file_fd, &stat_struct) == 0 && S_ISREG(stat_struct.st_mode);
+                trace_end(trace_stat, started);
+
+                // if file opened successfully, send to client
+                if (found) {
+                    // send OK message to client on control socket
+                    send(new_fd, "OK", 3, 0);
+
+                    // open data port at port number requested by client
+                    data_fd = open_data_port(&client_address, &data_port[0]);
+                    if (data_fd < 0) {
+                        printf("Could not connect to data port %s:%s\n\n", client_name, data_port);
+                    } else {
+                        // print to terminal that file being sent to client
+                        printf("Sending \"%s\" to %s:%s\n\n", filename, client_name, data_port);
+
+                        // send file to data connection and close data socket
+                        started = trace_start();
+                        send_file(file_fd, data_fd, stat_struct.st_size);
+                        trace_end(trace_send, started);
+                        started = trace_start();
+                        close(data_fd);
+                        trace_end(trace_close, started);
+                    }
+                } else {
+                    // error opening file, send error message to client
+
+                    // clear print_message string and format with error message
+                    memset(print_message, '\0', 500);
+                    sprintf(print_message, "File \"%s\" could not be found.\nSending error message to %s:%s\n", filename, client_name, port);
+
+                    // print message to terminal and send "FILE NOT FOUND" to client
+                    send_error(new_fd, print_message, "FILE NOT FOUND");
+                }
+            }
+
+            // after a file request, read ahead the next files if this client is going through the directory in order
+            if (cmd == get || cmd == chunks) {
+                prefetch_after_request(&prefetch, watch, &client_host[0], &filename[0]);
+            }
+        } else {
+            // invalid command (not 'list' or 'get'), send error message to client
+
+            // clear print_message string and format with error message
+            memset(print_message, '\0', 500);
+            snprintf(print_message, sizeof print_message, "Invalid Command.\n%.300s is not valid input.\nSending error message to %s:%s\n\n", text_buffer, client_name, port);
+
+            // print message to terminal and send "INVALID COMMAND" to client
+            send_error(new_fd, print_message, "INVALID COMMAND");
+        }
+
+        // close client connection on server side
+        started = trace_start();
+        close(new_fd);
+        trace_end(trace_close, started);
+        trace_end(trace_request, request_started);
+    }
+
+    // write out trace, free search index and read-ahead listing, and hang up on subscribers
+    trace_dump();
+    index_free(index);
+    prefetch_free(&prefetch);
+    watch_close(watch);
+
+}
+
+/*************************************************************************
+* function start_worker
+* Forks a worker process that serves clients on one of the master's listen
+* sockets until it is told to stop. The master keeps the socket open, so
+* connections queued on it while workers are swapped are never reset.
+* Params:
+*   int* sockets (every listen socket the master opened)
+*   int socket_count (# of listen sockets)
+*   int slot (index of the socket this worker serves)
+*   char* port (string holding server port)
+*   chunk_store* store (chunk store, or NULL to serve files directly)
+*   int cpu (CPU # to pin the worker to, or -1 to let it run anywhere)
+* Returns:
+*   pid_t of the worker, or -1 if fork failed
+* Pre-conditions: Called by the master process with its signals blocked
+* Post-conditions: Worker running (the worker itself never returns)
+*************************************************************************/
+pid_t start_worker(int* sockets, int socket_count, int slot, char* port, chunk_store* store, int cpu) {
+    // flush anything printed so far so the child doesn't print it again
+    fflush(stdout);
+
+    // fork worker, parent just returns the pid
+    pid_t pid = fork();
+    if (pid != 0) {
+        return pid;
+    }
+
+    // unblock the master's signals except stop signals, which stay blocked until
+    // serve_clients waits so a stop during startup can't drop queued connections
+    sigset_t worker_mask, wait_mask;
+    sigprocmask(SIG_SETMASK, NULL, &worker_mask);
+    sigdelset(&worker_mask, SIGHUP);
+    sigdelset(&worker_mask, SIGCHLD);
+    sigprocmask(SIG_SETMASK, &worker_mask, NULL);
+    setup_stop_signals(&wait_mask);
+
+    // leave reloads to the master
+    signal(SIGHUP, SIG_IGN);
+
+    // pin worker to a CPU if asked
+    if (cpu >= 0) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(cpu, &cpus);
+        sched_setaffinity(0, sizeof cpus, &cpus);
+    }
+
+    // only keep this worker's listen socket
+    for (int i = 0; i < socket_count; i++) {
+        if (i != slot) {
+            close(sockets[i]);
+        }
+    }
+
+    // serve clients until stopped, then exit (the master still holds the socket)
+    serve_clients(sockets[slot], store, port);
+    close(sockets[slot]);
+    exit(0);
+}
+
+
+/*************************************************************************
+* function worker_now
+* Gets the current time in milliseconds on the monotonic clock, for timing
+* worker restarts
+* Returns:
+*   uint64_t milliseconds
+* Pre-conditions: None
+* Post-conditions: None
+*************************************************************************/
+uint64_t worker_now() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+
+/*************************************************************************
+* function start_slot
+* Starts the worker for a slot. If fork fails, another try is scheduled
+* for WORKER_RESTART_DELAY ms later.
+* Params:
+*   worker_slot* slot (slot to start a worker in)
+*   int* sockets (every listen socket the master opened)
+*   int workers (# of worker slots)
+*   int index (# of this slot, which is also its socket)
+*   char* port (string holding server port)
+*   chunk_store* store (chunk store, or NULL to serve files directly)
+*   int cpu (CPU # to pin the worker to, or -1 to let it run anywhere)
+* Pre-conditions: Called by the master process
+* Post-conditions: Worker running in the slot, or a restart scheduled
+*************************************************************************/
+void start_slot(worker_slot* slot, int* sockets, int workers, int index, char* port, chunk_store* store, int cpu) {
+    slot->started = worker_now();
+    slot->restart_at = 0;
+    slot->pid = start_worker(sockets, workers, index, port, store, cpu);
+    if (slot->pid < 0) {
+        printf("Could not start worker %d: %s, trying again\n\n", index, strerror(errno));
+        slot->pid = 0;
+        slot->restart_at = slot->started + WORKER_RESTART_DELAY;
+    }
+}
+
+
+/*************************************************************************
+* function worker_exited
+* Decides what to do about a worker that exited: restart it right away if
+* it had been running a while, after a growing delay if it died while
+* starting up, or give up on the slot once that has happened
+* WORKER_MAX_FAILURES times in a row (so a worker that can never start,
+* e.g. because of a bad trace file, doesn't keep the master forking)
+* Params:
+*   worker_slot* slot (slot whose worker exited)
+*   int* sockets (every listen socket the master opened)
+*   int workers (# of worker slots)
+*   int index (# of this slot)
+*   char* port (string holding server port)
+*   chunk_store* store (chunk store, or NULL to serve files directly)
+*   int cpu (CPU # to pin the worker to, or -1 to let it run anywhere)
+* Returns:
+*   bool false if the slot was given up on, true otherwise
+* Pre-conditions: slot's worker was reaped
+* Post-conditions: Worker restarted, restart scheduled, or slot given up on
+*************************************************************************/
+bool worker_exited(worker_slot* slot, int* sockets, int workers, int index, char* port, chunk_store* store, int cpu) {
+    pid_t pid = slot->pid;
+    slot->pid = 0;
+
+    // count failed starts in a row
+    uint64_t now = worker_now();
+    slot->failures = now - slot->started < WORKER_MIN_UPTIME ? slot->failures + 1 : 0;
+    if (slot->failures >= WORKER_MAX_FAILURES) {
+        printf("Worker %d exited right after starting %d times in a row, giving up on it\n\n", (int) pid, slot->failures);
+        return false;
+    }
+
+    // restart now if it had been running, otherwise wait longer after each failed start
+    if (slot->failures == 0) {
+        printf("Worker %d exited, restarting\n\n", (int) pid);
+        start_slot(slot, sockets, workers, index, port, store, cpu);
+    } else {
+        int delay = WORKER_RESTART_DELAY << (slot->failures - 1);
+        printf("Worker %d exited while starting, restarting in %d ms\n\n", (int) pid, delay);
+        slot->restart_at = now + delay;
+    }
+    return true;
+}
+
+
+/*************************************************************************
+* function run_workers
+* Runs the master process for multi-process mode. Opens one listen socket
+* per worker on the shared port (SO_REUSEPORT) and keeps them open for as
+* long as it runs, then starts the workers and waits for signals:
+*   SIGHUP - graceful reload. A new set of workers is started (and the chunk
+*            store is refreshed) before the old workers are sent SIGTERM.
+*            Each new worker serves the same socket as the one it replaces,
+*            so old workers finish in-flight transfers and nothing queued on
+*            the sockets is lost. Slots that were given up on get a new try.
+*   SIGCHLD - a worker exited and is restarted on its socket (see
+*             worker_exited for workers that die while starting).
+*   SIGTERM/SIGINT - stop all workers gracefully and exit.
+* Workers waiting to be restarted are started once their delay is up.
+* Params:
+*   char* port (string holding server port)
+*   chunk_store* store (chunk store, or NULL to serve files directly)
+*   int workers (# of worker processes)
+*   bool pin_cpus (true to pin worker i to CPU i)
+* Returns:
+*   int 0 once all workers have exited, or -1 if the port could not be opened
+* Pre-conditions: Server started with -n
+* Post-conditions: All workers stopped and listen sockets closed
+*************************************************************************/
+int run_workers(char* port, chunk_store* store, int workers, bool pin_cpus) {
+    // worker slots, their listen sockets, and # of CPUs for pinning
+    worker_slot* slots = (worker_slot*) calloc(workers, sizeof(worker_slot));
+    int* sockets = (int*) calloc(workers, sizeof(int));
+    int cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int running = workers, signal_number, status;
+    pid_t pid;
+
+    // block signals the master handles so sigwait can pick them up one at a time
+    sigset_t master_signals;
+    sigemptyset(&master_signals);
+    sigaddset(&master_signals, SIGHUP);
+    sigaddset(&master_signals, SIGTERM);
+    sigaddset(&master_signals, SIGINT);
+    sigaddset(&master_signals, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &master_signals, NULL);
+
+    // open a listen socket for each worker, give up if the port can't be opened
+    for (int i = 0; i < workers; i++) {
+        struct addrinfo listen_hints, *listen_res = NULL;
+        sockets[i] = open_listen_port(port, listen_hints, listen_res, true);
+        if (sockets[i] < 0) {
+            while (i-- > 0) {
+                close(sockets[i]);
+            }
+            free(sockets);
+            free(slots);
+            return -1;
+        }
+    }
+
+    // start first set of workers
+    for (int i = 0; i < workers; i++) {
+        start_slot(&slots[i], sockets, workers, i, port, store, pin_cpus ? i % cpus : -1);
+    }
+    printf("Started %d workers on port %s (master pid %d)\n\n", workers, port, (int) getpid());
+
+    // handle signals until told to stop or every slot was given up on
+    while (running > 0) {
+        // start workers whose restart delay is up, and find when the next one is due
+        uint64_t now = worker_now(), next_restart = 0;
+        for (int i = 0; i < workers; i++) {
+            if (slots[i].restart_at != 0 && slots[i].restart_at <= now) {
+                start_slot(&slots[i], sockets, workers, i, port, store, pin_cpus ? i % cpus : -1);
+            }
+            if (slots[i].restart_at != 0 && (next_restart == 0 || slots[i].restart_at < next_restart)) {
+                next_restart = slots[i].restart_at;
+            }
+        }
+
+        // wait for a signal, or only until the next restart is due
+        if (next_restart != 0) {
+            uint64_t wait = next_restart > now ? next_restart - now : 0;
+            struct timespec timeout = { wait / 1000, (wait % 1000) * 1000000 };
+            signal_number = sigtimedwait(&master_signals, NULL, &timeout);
+        } else {
+            signal_number = sigwaitinfo(&master_signals, NULL);
+        }
+        if (signal_number < 0) {
+            continue;
+        }
+
+        if (signal_number == SIGHUP) {
+            // refresh chunk store so new workers start with up to date manifests
+            printf("Reloading workers\n\n");
+            if (store != NULL) {
+                store_ingest_directory(store);
+            }
+
+            // start each replacement on the same socket before retiring the worker it replaces
+            for (int i = 0; i < workers; i++) {
+                pid_t old_pid = slots[i].pid;
+                slots[i].failures = 0;
+                start_slot(&slots[i], sockets, workers, i, port, store, pin_cpus ? i % cpus : -1);
+                if (old_pid > 0) {
+                    kill(old_pid, SIGTERM);
+                }
+            }
+            running = workers;
+        } else if (signal_number == SIGCHLD) {
+            // reap every worker that exited. retired workers are no longer in a slot
+            while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+                for (int i = 0; i < workers; i++) {
+                    if (slots[i].pid == pid && !worker_exited(&slots[i], sockets, workers, i, port, store, pin_cpus ? i % cpus : -1)) {
+                        running--;
+                    }
+                }
+            }
+        } else {
+            // SIGTERM or SIGINT, stop handling signals
+            break;
+        }
+    }
+
+    // tell current workers to finish up, then wait for every worker (old and new) to exit
+    for (int i = 0; i < workers; i++) {
+        if (slots[i].pid > 0) {
+            kill(slots[i].pid, SIGTERM);
+        }
+    }
+    while (wait(NULL) > 0) {
+        continue;
+    }
+
+    // close listen sockets, free slots and return
+    for (int i = 0; i < workers; i++) {
+        close(sockets[i]);
+    }
+    free(sockets);
+    free(slots);
+    return 0;
+}
+
+
+/*************************************************************************
+* main method
+* Listens on a socket connection for an incoming connection from the client.
+* Once connected to a client, waits for a command. If the command is invalid,
+* send back an error on the already-opened connection. If the command is
+* valid, open up a new data connection and send the requested resource (list
+* or file) to the client at the specified data port. After receiving data, the
+* client will close the connection and the server will go back to listening
+* for new connections.
+*************************************************************************/
+int main(int argc, char* argv[]) {
+    // directory for the deduplicated chunk store (-d), NULL to serve files directly
+    char* store_dir = NULL;
+    chunk_store* store = NULL;
+
+    // # of worker processes (-n), 0 to serve from this process, and whether to pin them to CPUs (-a)
+    int workers = 0;
+    bool pin_cpus = false;
+
+    // file to write a trace of each request's phases to (-t), NULL for no tracing
+    char* trace_path = NULL;
+
+    // directories to serve (-r NAME=PATH), the current directory if none are given
+    char* roots[MAX_ROOTS];
+    int root_count = 0;
+
+    // read options, then there must be exactly 1 arg left (./ftserver [options] <SERVER_PORT>)
+    int option;
+    while ((option = getopt(argc, argv, "d:n:at:r:")) != -1) {
+        if (option == 'd') {
+            store_dir = optarg;
+        } else if (option == 'n' && atoi(optarg) > 0) {
+            workers = atoi(optarg);
+        } else if (option == 'a') {
+            pin_cpus = true;
+        } else if (option == 't') {
+            trace_path = optarg;
+        } else if (option == 'r' && root_count < MAX_ROOTS) {
+            roots[root_count++] = optarg;
+        } else {
+            argc = 0;
+        }
+    }
+
+    // if # of args is wrong then print an error and quit
+    if (argc - optind != 1) {
+        printf("Invalid input. Server must be started using following command:\n./ftserver [-d STORE_DIR] [-n WORKERS [-a]] [-t TRACE_FILE] [-r NAME=DIR ...] <SERVER_PORT>\n");
+        return -1;
+    }
+
+    // string and int for the listen port
+    char port[10];
+    int port_number, socket_fd;
+
+    // structs for opening the listen socket
+    struct addrinfo listen_hints, *listen_res = NULL;
+
+    // clear port string and retrieve from arguments
+    memset(port, '\0', 10);
+    strncpy(port, argv[optind], 9);
+
+    // convert port number to int and check that it is in valid range
+    port_number = atoi(port);
+    if (port_number <= 1024 || port_number > 65535) {
+        // port is invalid, print error and quit to terminal
+        printf("%d is not a valid port number. Must be between 1025 and 65535.\n", port_number);
+        return -1;
+    }
+
+    // set up the namespace: each -r directory with its files under NAME/, or just the current directory
+    served = (served_namespace*) calloc(1, sizeof(served_namespace));
+    for (int i = 0; i < root_count; i++) {
+        char* equals = strchr(roots[i], '=');
+        if (equals == NULL || equals == roots[i]) {
+            printf("Invalid root %s. Roots must be given as NAME=DIR\n", roots[i]);
+            return -1;
+        }
+        *equals = '\0';
+        if (!namespace_add_root(roots[i], equals + 1)) {
+            printf("Could not serve %s as %s (name must be unique and only use letters, digits, '-' and '_')\n", equals + 1, roots[i]);
+            return -1;
+        }
+        printf("Serving %s as %s/\n", equals + 1, roots[i]);
+    }
+    if (root_count == 0 && !namespace_add_root("", ".")) {
+        printf("Could not open current directory\n");
+        return -1;
+    }
+
+    // if running with a chunk store, open it and store everything in the served directories
+    if (store_dir != NULL) {
+        store = (chunk_store*) malloc(sizeof(chunk_store));
+        if (!store_init(store, store_dir)) {
+            printf("Could not open chunk store at %s\n", store_dir);
+            return -1;
+        }
+        printf("Chunk store open at %s (%d files stored)\n", store_dir, store_ingest_directory(store));
+    }
+
+    // start tracing before workers are started so they all trace (each to its own file)
+    if (trace_path != NULL && !trace_init(trace_path, workers > 0)) {
+        printf("Could not start tracing\n");
+        return -1;
+    }
+
+    // if workers were asked for, this process becomes the master and they do the serving
+    if (workers > 0) {
+        return run_workers(port, store, workers, pin_cpus);
+    }
+
+    // block stop signals before listening, so one arriving before serve_clients waits can't drop queued connections
+    sigset_t wait_mask;
+    setup_stop_signals(&wait_mask);
+
+    // port is valid, open and store socket # to socket_fd
+    socket_fd = open_listen_port(port, listen_hints, listen_res, false);
+    if (socket_fd < 0) {
+        return -1;
+    }
+
+    // handle clients until SIGTERM or SIGINT
+    serve_clients(socket_fd, store, port);
+
+    // close listen socket and exit
+    close(socket_fd);
     return 0;
 }
\ No newline at end of file